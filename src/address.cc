@@ -5,6 +5,7 @@
  * @LastEditTime: 2022-10-22 19:30:26
  */
 #include "address.h"
+#include "dns.h"
 #include "log.h"
 #include "spadger_endian.h"
 #include <ifaddrs.h>
@@ -63,7 +64,7 @@ IPAddress::ptr Address::LookupAnyIPAddress(const std::string &host, int family,
 
 bool Address::Lookup(std::vector<Address::ptr> &result, const std::string &host,
                      int family, int type, int protocol) {
-  addrinfo hints, *results, *next;
+  addrinfo hints;
   hints.ai_flags = 0;
   hints.ai_family = family;
   hints.ai_socktype = type;
@@ -103,23 +104,15 @@ bool Address::Lookup(std::vector<Address::ptr> &result, const std::string &host,
   if (node.empty()) {
     node = host;
   }
-  int error = getaddrinfo(node.c_str(), service, &hints, &results);
+  // 在协程里不阻塞线程 带缓存 见dns.h
+  int error =
+      ResolverMgr::GetInstance()->getAddrInfo(node, service, hints, result);
   if (error) {
     SPADGER_LOG_DEBUG(g_logger)
         << "Address::Lookup getaddress(" << host << ", " << family << ", "
         << type << ") err=" << error << " errstr=" << gai_strerror(error);
     return false;
   }
-
-  next = results;
-  while (next) {
-    result.push_back(Create(next->ai_addr, (socklen_t)next->ai_addrlen));
-    // SYLAR_LOG_INFO(g_logger) <<
-    // ((sockaddr_in*)next->ai_addr)->sin_addr.s_addr;
-    next = next->ai_next;
-  }
-
-  freeaddrinfo(results);
   return !result.empty();
 }
 
@@ -0,0 +1,167 @@
+/*
+ * @Author: lxk
+ * @Date: 2022-10-30 14:20:16
+ * @LastEditors: lxk
+ * @LastEditTime: 2022-10-30 18:05:41
+ */
+#include "clock.h"
+#include "config.h"
+#include "log.h"
+#include "util.h"
+#include <atomic>
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <x86intrin.h>
+#define SPADGER_HAVE_TSC 1
+#endif
+
+namespace spadger {
+
+static spadger::Logger::ptr g_logger = SPADGER_LOG_NAME("system");
+
+static ConfigVar<bool>::ptr g_clock_tsc = Config::Lookup<bool>(
+    "clock.tsc", false,
+    "read the monotonic clock from an invariant TSC instead of clock_gettime");
+
+static thread_local bool t_cached = false;
+static thread_local uint64_t t_now_us = 0;
+static thread_local time_t t_now_sec = 0;
+
+static time_t ReadSec() {
+  // 日志只要秒 COARSE版本只读一个变量 比time()还便宜
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+  return ts.tv_sec;
+}
+
+#ifdef SPADGER_HAVE_TSC
+// TSC换算成微秒: us = base_us + (tsc - base_tsc) * mult >> 32
+// 校准时和CLOCK_MONOTONIC对齐 所以两种读法得到的时间可以混着比较
+// 校准误差大约十万分之一 所以默认不开
+struct TscClock {
+  std::atomic<bool> enabled = {false};
+  bool calibrated = false;
+  uint64_t baseTsc = 0;
+  uint64_t baseUS = 0;
+  uint64_t mult = 0;
+
+  static bool Invariant() {
+    unsigned int a, b, c, d;
+    if (!__get_cpuid(0x80000007, &a, &b, &c, &d)) {
+      return false;
+    }
+    return d & (1u << 8);
+  }
+
+  // 同一时刻的TSC和CLOCK_MONOTONIC 两次rdtsc夹住clock_gettime
+  // 中间被切走了(隔得太久)就重来 取中点
+  static uint64_t Sample(uint64_t &tsc) {
+    uint64_t best = ~0ull;
+    uint64_t us = 0;
+    for (int i = 0; i < 10; ++i) {
+      uint64_t before = __rdtsc();
+      uint64_t now = getMonotonicUS();
+      uint64_t after = __rdtsc();
+      if (after - before < best) {
+        best = after - before;
+        tsc = before + (after - before) / 2;
+        us = now;
+      }
+    }
+    return us;
+  }
+
+  bool calibrate() {
+    if (calibrated) {
+      return true;
+    }
+    if (!Invariant()) {
+      SPADGER_LOG_WARN(g_logger) << "clock.tsc: cpu has no invariant tsc";
+      return false;
+    }
+    // 忙等50ms 不用sleep 调用的线程可能被hook了
+    uint64_t tsc0 = 0;
+    uint64_t us0 = Sample(tsc0);
+    uint64_t tsc1 = 0;
+    uint64_t us1 = us0;
+    while (us1 - us0 < 50000) {
+      us1 = Sample(tsc1);
+    }
+    if (tsc1 <= tsc0) {
+      return false;
+    }
+    mult = ((us1 - us0) << 32) / (tsc1 - tsc0);
+    baseTsc = tsc1;
+    baseUS = us1;
+    calibrated = true;
+    SPADGER_LOG_INFO(g_logger) << "clock.tsc: " << (tsc1 - tsc0) / (us1 - us0)
+                               << " ticks/us";
+    return true;
+  }
+
+  uint64_t read() const {
+    uint64_t tsc = __rdtsc();
+    if (tsc < baseTsc) {
+      return baseUS;
+    }
+    return baseUS + (uint64_t)(((unsigned __int128)(tsc - baseTsc) * mult) >> 32);
+  }
+};
+
+static TscClock s_tsc;
+static Mutex s_tsc_mutex;
+
+static void SetTsc(bool on) {
+  Mutex::Lock lock(s_tsc_mutex);
+  // release: 别的线程看到enabled时 calibrate()写的baseTsc/baseUS/mult也可见
+  s_tsc.enabled.store(on && s_tsc.calibrate(), std::memory_order_release);
+}
+
+struct _ClockIniter {
+  _ClockIniter() {
+    if (g_clock_tsc->getValue()) {
+      SetTsc(true);
+    }
+    g_clock_tsc->addListener(
+        [](const bool &old_val, const bool &new_val) { SetTsc(new_val); });
+  }
+};
+static _ClockIniter s_clock_initer;
+#endif
+
+uint64_t Clock::ReadUS() {
+#ifdef SPADGER_HAVE_TSC
+  if (s_tsc.enabled.load(std::memory_order_acquire)) {
+    return s_tsc.read();
+  }
+#endif
+  return getMonotonicUS();
+}
+
+bool Clock::IsTsc() {
+#ifdef SPADGER_HAVE_TSC
+  return s_tsc.enabled.load(std::memory_order_acquire);
+#else
+  return false;
+#endif
+}
+
+uint64_t Clock::NowUS() { return t_cached ? t_now_us : ReadUS(); }
+
+time_t Clock::NowSec() { return t_cached ? t_now_sec : ReadSec(); }
+
+void Clock::Update() {
+  t_now_us = ReadUS();
+  t_now_sec = ReadSec();
+  t_cached = true;
+}
+
+void Clock::Refresh() {
+  if (t_cached) {
+    t_now_us = ReadUS();
+  }
+}
+
+void Clock::Stop() { t_cached = false; }
+
+} // namespace spadger
@@ -0,0 +1,47 @@
+/*
+ * @Author: lxk
+ * @Date: 2022-10-30 14:20:16
+ * @LastEditors: lxk
+ * @LastEditTime: 2022-10-30 18:05:41
+ */
+
+#ifndef __SPADGER_CLOCK_H__
+#define __SPADGER_CLOCK_H__
+
+#include <stdint.h>
+#include <time.h>
+
+namespace spadger {
+
+// ================================================================
+// ======================   Clock  ================================
+// ================================================================
+
+// 便宜的时钟: 调度线程每取一个任务/idle每醒一次刷新一下自己的缓存
+// 定时器和日志读缓存 同一轮里不用反复读时钟
+// 不在调度的线程(比如main)没有缓存 直接读时钟
+// 注意: 一个任务跑了很久的话 它读到的还是开始时的时间
+class Clock {
+public:
+  // 单调时钟(微秒)
+  static uint64_t NowUS();
+  // 墙上时间(秒) 日志用
+  static time_t NowSec();
+
+  // 刷新当前线程的缓存 调用之后当前线程开始使用缓存
+  static void Update();
+  // 当前线程在用缓存的话刷新一下 没在用就什么也不做
+  // sleep之类的要从此刻算起 不能早醒
+  static void Refresh();
+  // 当前线程不再使用缓存(退出调度时)
+  static void Stop();
+
+  // 不走缓存直接读 配置了clock.tsc并且CPU支持时读TSC
+  static uint64_t ReadUS();
+  // 是否正在用TSC
+  static bool IsTsc();
+};
+
+} // namespace spadger
+
+#endif
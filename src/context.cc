@@ -0,0 +1,120 @@
+/*
+ * @Author: lxk
+ * @Date: 2022-10-24 10:20:47
+ * @LastEditors: lxk
+ * @LastEditTime: 2022-10-24 16:41:22
+ */
+#include "context.h"
+#include "util.h"
+#include <stdint.h>
+
+namespace spadger {
+
+// ================================================================
+// ======================   UContext  =============================
+// ================================================================
+
+void UContext::initMain() {
+  if (getcontext(&m_ctx)) {
+    SPADGER_ASSERT2(false, "getcontext");
+  }
+}
+
+void UContext::init(void *stack, size_t size, EntryFunc fn) {
+  if (getcontext(&m_ctx)) {
+    SPADGER_ASSERT2(false, "getcontext");
+  }
+  m_ctx.uc_stack.ss_sp = stack;
+  m_ctx.uc_stack.ss_size = size;
+  m_ctx.uc_link = nullptr;
+  makecontext(&m_ctx, fn, 0);
+}
+
+void UContext::Swap(UContext &from, UContext &to) {
+  if (swapcontext(&from.m_ctx, &to.m_ctx)) {
+    SPADGER_ASSERT2(false, "swapcontext");
+  }
+}
+
+void *UContext::sp() const {
+#if defined(__x86_64__)
+  return (void *)m_ctx.uc_mcontext.gregs[REG_RSP];
+#elif defined(__aarch64__)
+  return (void *)m_ctx.uc_mcontext.sp;
+#else
+  return nullptr;
+#endif
+}
+
+#if defined(__x86_64__)
+// ================================================================
+// ======================   AsmContext  ===========================
+// ================================================================
+
+// void spadger_swap_context(void **from_sp, void *to_sp)
+//   rdi = 保存当前sp的位置, rsi = 要恢复的sp
+// 栈上的布局(低地址->高地址): mxcsr|fpucw, r12, r13, r14, r15, rbx, rbp, ret
+extern "C" __attribute__((visibility("hidden"))) void
+spadger_swap_context(void **from_sp, void *to_sp);
+
+asm(R"(
+  .text
+  .globl spadger_swap_context
+  .hidden spadger_swap_context
+  .type spadger_swap_context, @function
+  .align 16
+spadger_swap_context:
+  pushq %rbp
+  pushq %rbx
+  pushq %r15
+  pushq %r14
+  pushq %r13
+  pushq %r12
+  subq $8, %rsp
+  stmxcsr (%rsp)
+  fnstcw 4(%rsp)
+  movq %rsp, (%rdi)
+  movq %rsi, %rsp
+  ldmxcsr (%rsp)
+  fldcw 4(%rsp)
+  addq $8, %rsp
+  popq %r12
+  popq %r13
+  popq %r14
+  popq %r15
+  popq %rbx
+  popq %rbp
+  ret
+  .size spadger_swap_context, .-spadger_swap_context
+)");
+
+void AsmContext::init(void *stack, size_t size, EntryFunc fn) {
+  // 栈顶16字节对齐, 保证ret进入fn时 rsp % 16 == 8 (和正常call一样)
+  uintptr_t top = ((uintptr_t)stack + size) & ~(uintptr_t)15;
+  uint64_t *sp = (uint64_t *)top;
+  *--sp = 0;              // fn的返回地址, fn不会返回
+  *--sp = (uintptr_t)fn;  // spadger_swap_context最后的ret跳到这里
+  for (int i = 0; i < 6; ++i) {
+    *--sp = 0;            // rbp rbx r15 r14 r13 r12
+  }
+  --sp;
+  uint32_t *ctrl = (uint32_t *)sp;
+  ctrl[0] = 0x1F80;       // mxcsr 默认值
+  ctrl[1] = 0x037F;       // x87控制字 默认值
+  m_sp = sp;
+}
+
+void AsmContext::Swap(AsmContext &from, AsmContext &to) {
+  spadger_swap_context(&from.m_sp, to.m_sp);
+}
+#endif
+
+const char *ContextBackendName() {
+#ifdef SPADGER_FIBER_UCONTEXT
+  return "ucontext";
+#else
+  return "asm";
+#endif
+}
+
+} // namespace spadger
@@ -0,0 +1,77 @@
+/*
+ * @Author: lxk
+ * @Date: 2022-10-24 10:12:31
+ * @LastEditors: lxk
+ * @LastEditTime: 2022-10-24 16:40:05
+ */
+
+#ifndef __SPADGER_CONTEXT_H__
+#define __SPADGER_CONTEXT_H__
+
+#include <stddef.h>
+#include <ucontext.h>
+
+// 非x86-64平台没有汇编实现 只能使用ucontext
+#if !defined(__x86_64__) && !defined(SPADGER_FIBER_UCONTEXT)
+#define SPADGER_FIBER_UCONTEXT
+#endif
+
+namespace spadger {
+
+// ================================================================
+// 协程上下文: 两种实现接口一致, 编译期(SPADGER_FIBER_UCONTEXT)选择
+//   init(): 在给定的栈上准备好入口函数, 第一次切入时执行fn
+//   Swap(): 保存当前上下文到from, 恢复to
+//   sp():   切出之后保存下来的栈顶, 恢复时用到的栈都在它上面
+// ================================================================
+
+// ucontext实现: swapcontext每次都要rt_sigprocmask系统调用保存信号掩码
+class UContext {
+public:
+  typedef void (*EntryFunc)();
+
+  // 主协程只需要getcontext
+  void initMain();
+  void init(void *stack, size_t size, EntryFunc fn);
+
+  static void Swap(UContext &from, UContext &to);
+
+  // 取mcontext里保存的sp 不认识的平台返回nullptr(只能当整个栈都在用)
+  void *sp() const;
+
+private:
+  ucontext_t m_ctx;
+};
+
+#if defined(__x86_64__)
+// 汇编实现: 只保存System V ABI规定的callee-saved寄存器
+// (rbp rbx r12-r15 以及mxcsr/x87控制字), 不经过内核
+class AsmContext {
+public:
+  typedef void (*EntryFunc)();
+
+  // 主协程的sp在第一次Swap出去时保存, 不需要初始化
+  void initMain() {}
+  void init(void *stack, size_t size, EntryFunc fn);
+
+  static void Swap(AsmContext &from, AsmContext &to);
+
+  void *sp() const { return m_sp; }
+
+private:
+  void *m_sp = nullptr; // 切出时的栈顶, 寄存器都保存在栈上
+};
+#endif
+
+#ifdef SPADGER_FIBER_UCONTEXT
+typedef UContext Context;
+#else
+typedef AsmContext Context;
+#endif
+
+// 当前编译使用的后端名称, 用于日志和benchmark
+const char *ContextBackendName();
+
+} // namespace spadger
+
+#endif
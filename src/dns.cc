@@ -0,0 +1,653 @@
+/*
+ * @Author: lxk
+ * @Date: 2022-11-08 14:20:51
+ * @LastEditors: lxk
+ * @LastEditTime: 2022-11-09 21:37:16
+ */
+#include "dns.h"
+#include "clock.h"
+#include "config.h"
+#include "fiber.h"
+#include "hook.h"
+#include "iomanager.h"
+#include "log.h"
+#include "offload.h"
+#include "socket.h"
+#include "util.h"
+#include <algorithm>
+#include <arpa/inet.h>
+#include <arpa/nameser.h>
+#include <fstream>
+#include <functional>
+#include <sstream>
+#include <string.h>
+#include <sys/random.h>
+#include <sys/stat.h>
+
+namespace spadger {
+
+static Logger::ptr g_logger = SPADGER_LOG_NAME("system");
+
+static ConfigVar<bool>::ptr g_dns_enable = Config::Lookup<bool>(
+    "dns.enable", true,
+    "resolve names in fibers with the built-in async dns client");
+static ConfigVar<std::vector<std::string>>::ptr g_dns_servers =
+    Config::Lookup<std::vector<std::string>>(
+        "dns.servers", std::vector<std::string>(),
+        "dns servers ip[:port], empty means /etc/resolv.conf");
+static ConfigVar<uint32_t>::ptr g_dns_timeout = Config::Lookup<uint32_t>(
+    "dns.timeout", 0, "dns query timeout(ms) per try, 0 means resolv.conf");
+static ConfigVar<uint32_t>::ptr g_dns_attempts = Config::Lookup<uint32_t>(
+    "dns.attempts", 0,
+    "dns query rounds over all servers, 0 means resolv.conf");
+static ConfigVar<uint32_t>::ptr g_dns_min_ttl =
+    Config::Lookup<uint32_t>("dns.cache.min_ttl", 0, "dns cache min ttl(s)");
+static ConfigVar<uint32_t>::ptr g_dns_max_ttl =
+    Config::Lookup<uint32_t>("dns.cache.max_ttl", 3600, "dns cache max ttl(s)");
+static ConfigVar<uint32_t>::ptr g_dns_negative_ttl = Config::Lookup<uint32_t>(
+    "dns.cache.negative_ttl", 5, "ttl(s) of NXDOMAIN/NODATA answers");
+static ConfigVar<uint32_t>::ptr g_dns_max_entries = Config::Lookup<uint32_t>(
+    "dns.cache.max_entries", 4096, "max cached answers (split over shards)");
+
+// 直接调getaddrinfo 结果转成Address
+static int SysLookup(const char *node, const char *service,
+                     const addrinfo &hints, std::vector<Address::ptr> &result) {
+  addrinfo *results = nullptr;
+  int error = getaddrinfo(node, service, &hints, &results);
+  if (error) {
+    return error;
+  }
+  for (addrinfo *next = results; next; next = next->ai_next) {
+    result.push_back(Address::Create(next->ai_addr, next->ai_addrlen));
+  }
+  freeaddrinfo(results);
+  return 0;
+}
+
+static bool IsNumericHost(const std::string &node) {
+  char buf[sizeof(in6_addr)];
+  return inet_pton(AF_INET, node.c_str(), buf) == 1 ||
+         inet_pton(AF_INET6, node.c_str(), buf) == 1;
+}
+
+// "ip" "ip:port" "[ipv6]:port"
+static Address::ptr ParseServer(const std::string &str) {
+  std::string ip = str;
+  uint16_t port = 53;
+  size_t pos = std::string::npos;
+  if (!str.empty() && str[0] == '[') {
+    pos = str.find(']');
+    if (pos == std::string::npos) {
+      return nullptr;
+    }
+    ip = str.substr(1, pos - 1);
+    pos = str.find(':', pos);
+  } else if (std::count(str.begin(), str.end(), ':') == 1) {
+    pos = str.find(':');
+    ip = str.substr(0, pos);
+  }
+  if (pos != std::string::npos) {
+    port = (uint16_t)atoi(str.c_str() + pos + 1);
+  }
+  if (!IsNumericHost(ip)) {
+    return nullptr;
+  }
+  return IPAddress::Create(ip.c_str(), port);
+}
+
+static std::string ToLower(const std::string &str) {
+  std::string rt = str;
+  std::transform(rt.begin(), rt.end(), rt.begin(), ::tolower);
+  return rt;
+}
+
+// ============================ 报文 ================================
+
+// 事务id 猜得到的话伪造的回包就能被当成答案(缓存投毒)
+// 所以取系统的随机数 一次取一批 每个线程各自用
+static uint16_t RandomId() {
+  static thread_local uint16_t s_ids[64];
+  static thread_local size_t s_next = 64;
+  if (s_next == 64) {
+    ssize_t n = getrandom(s_ids, sizeof(s_ids), GRND_NONBLOCK);
+    if (n != (ssize_t)sizeof(s_ids)) {
+      // 开机早期熵池还没准备好(EAGAIN) 退而用urandom
+      std::ifstream urandom("/dev/urandom", std::ios::binary);
+      urandom.read((char *)s_ids, sizeof(s_ids));
+      SPADGER_ASSERT(urandom);
+    }
+    s_next = 0;
+  }
+  return s_ids[s_next++];
+}
+
+// 查询报文: 头 + 一个问题 RD置位
+static bool BuildQuery(const std::string &name, int qtype, uint16_t id,
+                       std::string &out) {
+  if (name.empty() || name.size() > 253) {
+    return false;
+  }
+  out.clear();
+  uint8_t header[NS_HFIXEDSZ] = {0};
+  header[0] = id >> 8;
+  header[1] = id & 0xff;
+  header[2] = 0x01; // RD
+  header[5] = 1;    // QDCOUNT
+  out.append((const char *)header, sizeof(header));
+  size_t begin = 0;
+  while (begin < name.size()) {
+    size_t end = name.find('.', begin);
+    if (end == std::string::npos) {
+      end = name.size();
+    }
+    size_t len = end - begin;
+    if (len == 0 || len > 63) {
+      return false;
+    }
+    out.push_back((char)len);
+    out.append(name, begin, len);
+    begin = end + 1;
+  }
+  out.push_back(0);
+  out.push_back((char)(qtype >> 8));
+  out.push_back((char)(qtype & 0xff));
+  out.push_back(0);
+  out.push_back(ns_c_in);
+  return true;
+}
+
+/**
+ * @brief 从off开始读一个名字(处理压缩指针) 结果是小写的点分形式
+ * @param[out] next 名字后面的位置
+ * @return 格式不对/指针成环返回false
+ */
+static bool ReadName(const uint8_t *msg, size_t len, size_t off,
+                     std::string &name, size_t &next) {
+  name.clear();
+  bool jumped = false;
+  int hops = 0;
+  while (true) {
+    if (off >= len) {
+      return false;
+    }
+    uint8_t c = msg[off];
+    if ((c & 0xc0) == 0xc0) {
+      if (off + 1 >= len || ++hops > 64) {
+        return false;
+      }
+      if (!jumped) {
+        next = off + 2;
+        jumped = true;
+      }
+      off = ((c & 0x3f) << 8) | msg[off + 1];
+      continue;
+    }
+    if (c & 0xc0) {
+      return false;
+    }
+    if (c == 0) {
+      if (!jumped) {
+        next = off + 1;
+      }
+      return true;
+    }
+    if (off + 1 + c > len || name.size() + c > 254) {
+      return false;
+    }
+    if (!name.empty()) {
+      name.push_back('.');
+    }
+    for (int i = 0; i < c; ++i) {
+      name.push_back((char)tolower(msg[off + 1 + i]));
+    }
+    off += 1 + c;
+  }
+}
+
+static uint16_t Read16(const uint8_t *p) { return (p[0] << 8) | p[1]; }
+static uint32_t Read32(const uint8_t *p) {
+  return ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+struct Record {
+  std::string owner;
+  uint16_t type;
+  uint32_t ttl;
+  std::string data; // A/AAAA: 数字地址 CNAME: 目标名字
+};
+
+enum ParseResult {
+  PARSE_OK,
+  PARSE_BAD,       // 不是这个请求的回包 丢掉继续等
+  PARSE_SERVFAIL,  // 服务器出错 换下一个
+  PARSE_NXDOMAIN,
+  PARSE_TRUNCATED
+};
+
+static ParseResult ParseResponse(const uint8_t *msg, size_t len, uint16_t id,
+                                 const std::string &name, int qtype,
+                                 std::vector<Record> &records) {
+  if (len < NS_HFIXEDSZ || Read16(msg) != id || !(msg[2] & 0x80)) {
+    return PARSE_BAD;
+  }
+  uint16_t qdcount = Read16(msg + 4);
+  uint16_t ancount = Read16(msg + 6);
+  if (qdcount != 1) {
+    return PARSE_BAD;
+  }
+  std::string owner;
+  size_t off = NS_HFIXEDSZ;
+  if (!ReadName(msg, len, off, owner, off) || owner != name ||
+      off + 4 > len || Read16(msg + off) != qtype) {
+    return PARSE_BAD;
+  }
+  off += 4;
+  if (msg[2] & 0x02) {
+    return PARSE_TRUNCATED;
+  }
+  int rcode = msg[3] & 0x0f;
+  if (rcode == ns_r_nxdomain) {
+    return PARSE_NXDOMAIN;
+  }
+  if (rcode != ns_r_noerror) {
+    return PARSE_SERVFAIL;
+  }
+  for (int i = 0; i < ancount; ++i) {
+    Record rec;
+    if (!ReadName(msg, len, off, rec.owner, off) ||
+        off + NS_RRFIXEDSZ > len) {
+      return PARSE_SERVFAIL;
+    }
+    rec.type = Read16(msg + off);
+    uint16_t cls = Read16(msg + off + 2);
+    rec.ttl = Read32(msg + off + 4);
+    uint16_t rdlen = Read16(msg + off + 8);
+    off += NS_RRFIXEDSZ;
+    if (off + rdlen > len) {
+      return PARSE_SERVFAIL;
+    }
+    if (cls == ns_c_in) {
+      char buf[INET6_ADDRSTRLEN];
+      if (rec.type == ns_t_a && rdlen == 4) {
+        rec.data = inet_ntop(AF_INET, msg + off, buf, sizeof(buf));
+        records.push_back(std::move(rec));
+      } else if (rec.type == ns_t_aaaa && rdlen == 16) {
+        rec.data = inet_ntop(AF_INET6, msg + off, buf, sizeof(buf));
+        records.push_back(std::move(rec));
+      } else if (rec.type == ns_t_cname) {
+        size_t end;
+        if (!ReadName(msg, len, off, rec.data, end)) {
+          return PARSE_SERVFAIL;
+        }
+        records.push_back(std::move(rec));
+      }
+    }
+    off += rdlen;
+  }
+  return PARSE_OK;
+}
+
+// ============================ Resolver ================================
+
+Resolver::Resolver() {
+  std::ifstream resolv("/etc/resolv.conf");
+  std::string line;
+  while (std::getline(resolv, line)) {
+    std::istringstream ss(line);
+    std::string key, value;
+    ss >> key;
+    if (key == "nameserver" && ss >> value) {
+      Address::ptr addr = ParseServer(value);
+      if (addr) {
+        m_resolvServers.push_back(addr);
+      }
+    } else if (key == "options") {
+      while (ss >> value) {
+        if (!value.compare(0, 6, "ndots:")) {
+          m_ndots = atoi(value.c_str() + 6);
+        } else if (!value.compare(0, 8, "timeout:")) {
+          m_resolvTimeout = atoi(value.c_str() + 8) * 1000;
+        } else if (!value.compare(0, 9, "attempts:")) {
+          m_resolvAttempts = atoi(value.c_str() + 9);
+        }
+      }
+    }
+  }
+
+  // hosts: files dns 以外的来源我们处理不了 交给getaddrinfo
+  std::ifstream nss("/etc/nsswitch.conf");
+  bool has_dns = false;
+  while (std::getline(nss, line)) {
+    std::istringstream ss(line);
+    std::string key, value;
+    ss >> key;
+    if (key != "hosts:") {
+      continue;
+    }
+    while (ss >> value) {
+      if (value[0] == '[') {
+        continue; // [NOTFOUND=return]
+      }
+      if (value == "dns") {
+        has_dns = true;
+      } else if (value != "files") {
+        m_nssOther = true;
+      }
+    }
+  }
+  if (!has_dns) {
+    m_nssOther = true;
+  }
+
+  loadServers(g_dns_servers->getValue());
+  m_serversListener = g_dns_servers->addListener(
+      [this](const std::vector<std::string> &old_val,
+             const std::vector<std::string> &new_val) {
+        loadServers(new_val);
+        clearCache();
+      });
+}
+
+Resolver::~Resolver() {
+  g_dns_servers->delListener(m_serversListener);
+}
+
+void Resolver::loadServers(const std::vector<std::string> &conf) {
+  std::vector<Address::ptr> servers;
+  for (auto &i : conf) {
+    Address::ptr addr = ParseServer(i);
+    if (addr) {
+      servers.push_back(addr);
+    } else {
+      SPADGER_LOG_ERROR(g_logger) << "invalid dns server: " << i;
+    }
+  }
+  if (conf.empty()) {
+    servers = m_resolvServers;
+  }
+  RWMutex::WriteLock lock(m_mutex);
+  m_servers.swap(servers);
+}
+
+void Resolver::clearCache() {
+  for (auto &shard : m_shards) {
+    Mutex::Lock lock(shard.mutex);
+    shard.cache.clear();
+  }
+}
+
+void Resolver::checkHosts() {
+  uint64_t now = Clock::NowUS();
+  {
+    RWMutex::ReadLock lock(m_mutex);
+    if (now - m_hostsChecked < 1000 * 1000) {
+      return;
+    }
+  }
+  struct stat st;
+  time_t mtime = stat("/etc/hosts", &st) ? 0 : st.st_mtime;
+  RWMutex::WriteLock lock(m_mutex);
+  m_hostsChecked = now;
+  if (mtime == m_hostsMtime) {
+    return;
+  }
+  m_hostsMtime = mtime;
+  m_hosts.clear();
+  std::ifstream hosts("/etc/hosts");
+  std::string line;
+  while (std::getline(hosts, line)) {
+    line = line.substr(0, line.find('#'));
+    std::istringstream ss(line);
+    std::string name;
+    ss >> name; // 地址
+    while (ss >> name) {
+      m_hosts.insert(ToLower(name));
+    }
+  }
+}
+
+bool Resolver::needFallback(const std::string &name) {
+  checkHosts();
+  RWMutex::ReadLock lock(m_mutex);
+  if (m_nssOther || m_servers.empty() || m_hosts.count(name)) {
+    return true;
+  }
+  // 点比ndots少的名字先要拼search域 交给getaddrinfo
+  return std::count(name.begin(), name.end(), '.') < m_ndots;
+}
+
+int Resolver::fallback(const std::string &node, const char *service,
+                       const addrinfo &hints,
+                       std::vector<Address::ptr> &result) {
+  ++m_fallbacks;
+  return OffloadMgr::GetInstance()->run(
+      [&]() { return SysLookup(node.c_str(), service, hints, result); });
+}
+
+Resolver::Answer Resolver::query(const std::string &name, int qtype) {
+  Answer answer;
+  answer.error = EAI_AGAIN;
+  std::vector<Address::ptr> servers;
+  uint32_t timeout = g_dns_timeout->getValue();
+  uint32_t attempts = g_dns_attempts->getValue();
+  {
+    RWMutex::ReadLock lock(m_mutex);
+    servers = m_servers;
+    timeout = timeout ? timeout : m_resolvTimeout;
+    attempts = attempts ? attempts : m_resolvAttempts;
+  }
+  std::string request;
+  uint8_t buf[1232]; // EDNS建议的UDP上限 普通回包最多512
+  for (uint32_t round = 0; round < attempts; ++round) {
+    for (auto &server : servers) {
+      uint16_t id = RandomId();
+      if (!BuildQuery(name, qtype, id, request)) {
+        answer.error = EAI_NONAME;
+        return answer;
+      }
+      // connect之后内核只收这个服务器发来的包
+      Socket::ptr sock(new Socket(server->getFamily(), Socket::UDP, 0));
+      if (!sock->connect(server)) {
+        continue;
+      }
+      ++m_queries;
+      if (sock->send(request.data(), request.size()) != (int)request.size()) {
+        continue;
+      }
+      uint64_t deadline = Clock::ReadUS() + timeout * 1000ull;
+      ParseResult rt = PARSE_BAD;
+      std::vector<Record> records;
+      while (rt == PARSE_BAD) {
+        uint64_t now = Clock::ReadUS();
+        if (now >= deadline) {
+          break;
+        }
+        sock->setRecvTimeout((deadline - now + 999) / 1000);
+        int len = sock->recv(buf, sizeof(buf));
+        if (len <= 0) {
+          break; // 超时 或者ICMP不可达(ECONNREFUSED)
+        }
+        records.clear();
+        rt = ParseResponse(buf, len, id, name, qtype, records);
+      }
+      if (rt == PARSE_BAD || rt == PARSE_SERVFAIL) {
+        continue;
+      }
+      if (rt == PARSE_TRUNCATED) {
+        answer.truncated = true;
+        return answer;
+      }
+      uint64_t ttl = g_dns_negative_ttl->getValue();
+      if (rt == PARSE_NXDOMAIN) {
+        answer.error = EAI_NONAME;
+      } else {
+        // 顺着CNAME找到最终的名字 TTL取链上最小的
+        std::string target = name;
+        uint32_t min_ttl = (uint32_t)-1;
+        for (size_t hop = 0; hop <= records.size(); ++hop) {
+          bool next = false;
+          for (auto &rec : records) {
+            if (rec.type == ns_t_cname && rec.owner == target) {
+              target = rec.data;
+              min_ttl = std::min(min_ttl, rec.ttl);
+              next = true;
+              break;
+            }
+          }
+          if (!next) {
+            break;
+          }
+        }
+        for (auto &rec : records) {
+          if (rec.type == qtype && rec.owner == target) {
+            answer.ips.push_back(rec.data);
+            min_ttl = std::min(min_ttl, rec.ttl);
+          }
+        }
+        if (answer.ips.empty()) {
+          answer.error = EAI_NODATA;
+        } else {
+          answer.error = 0;
+          ttl = std::max<uint64_t>(min_ttl, g_dns_min_ttl->getValue());
+          ttl = std::min<uint64_t>(ttl, g_dns_max_ttl->getValue());
+        }
+      }
+      answer.expires = Clock::ReadUS() + ttl * 1000 * 1000;
+      return answer;
+    }
+  }
+  SPADGER_LOG_WARN(g_logger) << "dns query " << name << " type=" << qtype
+                             << " no answer from " << servers.size()
+                             << " servers";
+  return answer;
+}
+
+// 满了先清掉过期的 还是满的话淘汰最早过期的那个
+// 过期的条目平时只在再查到时才删 不清的话问过的名字会一直留着
+void Resolver::insertCache(Shard &shard, const std::string &key,
+                           const Answer &answer) {
+  size_t cap = std::max<size_t>(g_dns_max_entries->getValue() / SHARDS, 1);
+  if (shard.cache.size() >= cap && !shard.cache.count(key)) {
+    uint64_t now = Clock::ReadUS();
+    for (auto it = shard.cache.begin(); it != shard.cache.end();) {
+      if (it->second.expires <= now) {
+        it = shard.cache.erase(it);
+      } else {
+        ++it;
+      }
+    }
+    while (shard.cache.size() >= cap) {
+      auto oldest = shard.cache.begin();
+      for (auto it = shard.cache.begin(); it != shard.cache.end(); ++it) {
+        if (it->second.expires < oldest->second.expires) {
+          oldest = it;
+        }
+      }
+      shard.cache.erase(oldest);
+      ++m_evicted;
+    }
+  }
+  shard.cache[key] = answer;
+}
+
+Resolver::Answer Resolver::resolve(const std::string &name, int qtype) {
+  std::string key = std::to_string(qtype) + " " + name;
+  Shard &shard = m_shards[std::hash<std::string>()(key) % SHARDS];
+  std::shared_ptr<Pending> pending;
+  {
+    Mutex::Lock lock(shard.mutex);
+    auto it = shard.cache.find(key);
+    if (it != shard.cache.end()) {
+      if (it->second.expires > Clock::ReadUS()) {
+        ++m_hits;
+        return it->second;
+      }
+      shard.cache.erase(it);
+    }
+    auto pit = shard.pending.find(key);
+    if (pit != shard.pending.end()) {
+      // 已经有协程在问了 等它的结果
+      pending = pit->second;
+      pending->waiters.push_back(
+          std::make_pair(Scheduler::GetThis(), Fiber::GetThis()));
+      ++m_joined;
+    } else {
+      shard.pending[key].reset(new Pending);
+    }
+  }
+  if (pending) {
+    Fiber::YieldToHold();
+    return pending->answer;
+  }
+
+  Answer answer = query(name, qtype);
+  std::vector<std::pair<Scheduler *, Fiber::ptr>> waiters;
+  {
+    Mutex::Lock lock(shard.mutex);
+    auto pit = shard.pending.find(key);
+    pit->second->answer = answer;
+    pit->second->waiters.swap(waiters);
+    shard.pending.erase(pit);
+    if (!answer.truncated && answer.error != EAI_AGAIN) {
+      insertCache(shard, key, answer);
+    }
+  }
+  for (auto &i : waiters) {
+    i.first->schedule(std::move(i.second));
+  }
+  return answer;
+}
+
+int Resolver::getAddrInfo(const std::string &node, const char *service,
+                          const addrinfo &hints,
+                          std::vector<Address::ptr> &result) {
+  // 数字地址 带了特殊flag的 不在协程里的 和原来一样直接调getaddrinfo
+  if (node.empty() || hints.ai_flags || IsNumericHost(node) ||
+      !IOManager::GetThis() || !is_hook_enable() ||
+      (hints.ai_family != AF_UNSPEC && hints.ai_family != AF_INET &&
+       hints.ai_family != AF_INET6)) {
+    return SysLookup(node.c_str(), service, hints, result);
+  }
+  std::string name = ToLower(node);
+  if (name.back() == '.') {
+    name.pop_back();
+  }
+  if (!g_dns_enable->getValue() || needFallback(name)) {
+    return fallback(node, service, hints, result);
+  }
+
+  std::vector<std::string> ips;
+  int error = EAI_NONAME;
+  bool again = false;
+  int qtypes[] = {ns_t_a, ns_t_aaaa};
+  for (int qtype : qtypes) {
+    if ((qtype == ns_t_a && hints.ai_family == AF_INET6) ||
+        (qtype == ns_t_aaaa && hints.ai_family == AF_INET)) {
+      continue;
+    }
+    Answer answer = resolve(name, qtype);
+    if (answer.truncated) {
+      return fallback(node, service, hints, result);
+    }
+    if (answer.error == EAI_AGAIN) {
+      again = true;
+    } else if (answer.error == EAI_NODATA) {
+      error = EAI_NODATA;
+    }
+    ips.insert(ips.end(), answer.ips.begin(), answer.ips.end());
+  }
+  if (ips.empty()) {
+    return again ? EAI_AGAIN : error;
+  }
+
+  // 拿到的是数字地址 再交给getaddrinfo处理service/socktype 结果和原来一样
+  addrinfo numeric = hints;
+  numeric.ai_flags |= AI_NUMERICHOST;
+  size_t old_size = result.size();
+  for (auto &ip : ips) {
+    error = SysLookup(ip.c_str(), service, numeric, result);
+  }
+  return result.size() > old_size ? 0 : error;
+}
+
+} // namespace spadger
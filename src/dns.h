@@ -0,0 +1,123 @@
+/*
+ * @Author: lxk
+ * @Date: 2022-11-08 14:20:51
+ * @LastEditors: lxk
+ * @LastEditTime: 2022-11-09 21:37:16
+ */
+#ifndef __SPADGER_DNS_H__
+#define __SPADGER_DNS_H__
+
+#include "address.h"
+#include "mutex.h"
+#include "singleton.h"
+#include <atomic>
+#include <memory>
+#include <netdb.h>
+#include <set>
+#include <string>
+#include <sys/types.h>
+#include <unordered_map>
+#include <vector>
+
+namespace spadger {
+
+class Fiber;
+class Scheduler;
+
+/**
+ * @brief 协程里用的域名解析 Address::Lookup在协程里会走这里
+ * @details
+ *  1. 自己发UDP的DNS请求(A/AAAA) 等回包的时候只挂起协程 不阻塞线程
+ *  2. 结果按TTL缓存 域名不存在也缓存一会(dns.cache.negative_ttl)
+ *     缓存分片 每片一把锁 总条数不超过dns.cache.max_entries
+ *  3. 同一个域名同时只发一个请求 别的协程挂在这个请求上等结果
+ *  4. /etc/hosts里有的 单段的名字(要按search补全) nsswitch.conf里
+ *     hosts除了files/dns还有别的来源的 都交给OffloadPool调getaddrinfo
+ *  DNS服务器默认读/etc/resolv.conf 可以用dns.servers指定(测试时指向本地的桩)
+ */
+class Resolver {
+public:
+  Resolver();
+  ~Resolver();
+
+  /**
+   * @brief 参数和结果都和getaddrinfo一样 在协程里调用时不阻塞线程
+   * @return 0成功 否则是EAI_*错误码
+   * @attention 不在IOManager的协程里(或者没开hook)时直接调用getaddrinfo
+   */
+  int getAddrInfo(const std::string &node, const char *service,
+                  const addrinfo &hints, std::vector<Address::ptr> &result);
+
+  // 统计 测试和调优用
+  uint64_t getQueryCount() const { return m_queries; }   // 发出去的DNS请求
+  uint64_t getCacheHitCount() const { return m_hits; }   // 命中缓存
+  uint64_t getCoalescedCount() const { return m_joined; } // 等别人的请求
+  uint64_t getFallbackCount() const { return m_fallbacks; } // getaddrinfo
+  uint64_t getEvictCount() const { return m_evicted; } // 缓存满了淘汰的
+  // 清空缓存(配置变了的时候也会清)
+  void clearCache();
+
+private:
+  // 一个域名+类型的解析结果 ips是数字形式的地址
+  struct Answer {
+    int error = 0; // 0 或者EAI_NONAME/EAI_NODATA/EAI_AGAIN...
+    bool truncated = false; // 回包被截断(TC) 交给getaddrinfo走TCP
+    std::vector<std::string> ips;
+    uint64_t expires = 0; // Clock::NowUS 过期时间
+  };
+  // 正在解析的请求 后来的协程挂在waiters上
+  struct Pending {
+    std::vector<std::pair<Scheduler *, std::shared_ptr<Fiber>>> waiters;
+    Answer answer;
+  };
+  struct Shard {
+    Mutex mutex;
+    std::unordered_map<std::string, Answer> cache;
+    std::unordered_map<std::string, std::shared_ptr<Pending>> pending;
+  };
+  static const int SHARDS = 16;
+
+  // 解析一个类型(ns_t_a/ns_t_aaaa) 先查缓存 再合并/发请求
+  Answer resolve(const std::string &name, int qtype);
+  // 放进缓存 调用时持有shard.mutex
+  void insertCache(Shard &shard, const std::string &key, const Answer &answer);
+  // 向DNS服务器查询 服务器都试过了还不行返回EAI_AGAIN
+  Answer query(const std::string &name, int qtype);
+  // 这个名字要不要交给getaddrinfo
+  bool needFallback(const std::string &name);
+  // 在OffloadPool里调getaddrinfo 当前协程等它做完
+  int fallback(const std::string &node, const char *service,
+               const addrinfo &hints, std::vector<Address::ptr> &result);
+  // dns.servers为空时用/etc/resolv.conf里的
+  void loadServers(const std::vector<std::string> &conf);
+  // /etc/hosts改了就重新读
+  void checkHosts();
+
+private:
+  Shard m_shards[SHARDS];
+  RWMutex m_mutex;
+  std::vector<Address::ptr> m_servers;
+  // /etc/resolv.conf
+  std::vector<Address::ptr> m_resolvServers;
+  int m_ndots = 1;
+  uint32_t m_resolvTimeout = 5000; // ms
+  uint32_t m_resolvAttempts = 2;
+  // nsswitch.conf的hosts里有files/dns以外的来源(mdns myhostname...)
+  bool m_nssOther = false;
+  // /etc/hosts里的名字(小写)
+  std::set<std::string> m_hosts;
+  time_t m_hostsMtime = 0;
+  uint64_t m_hostsChecked = 0; // 上次stat的时间(us) 最多一秒看一次
+  uint64_t m_serversListener = 0;
+  std::atomic<uint64_t> m_queries = {0};
+  std::atomic<uint64_t> m_hits = {0};
+  std::atomic<uint64_t> m_joined = {0};
+  std::atomic<uint64_t> m_fallbacks = {0};
+  std::atomic<uint64_t> m_evicted = {0};
+};
+
+typedef Singleton<Resolver> ResolverMgr;
+
+} // namespace spadger
+
+#endif
@@ -12,16 +12,17 @@
 
 namespace spadger {
 
+static_assert(sizeof(FdCtx) <= 128, "FdCtx should fit in two cache lines");
+
 // ===================================================================
 //  ==================   FdCtx  ======================================
 // ===================================================================
 
 FdCtx::FdCtx(int fd)
     : m_isInit(false), m_isSocket(false), m_sysNonblock(false),
-      m_userNonblock(false), m_isClosed(false), m_fd(fd), m_recvTimeout(-1),
-      m_sendTimeout(-1) {
-  init();
-}
+      m_userNonblock(false), m_isClosed(false), m_isFile(false),
+      m_fileAsync(true), m_fd(fd), m_recvTimeout(-1),
+      m_sendTimeout(-1) {}
 
 FdCtx::~FdCtx() {}
 
@@ -36,10 +37,13 @@ bool FdCtx::init() {
   if (-1 == fstat(m_fd, &fd_stat)) {
     m_isInit = false;
     m_isSocket = false;
+    m_isFile = false;
   } else {
     m_isInit = true;
     m_isSocket = S_ISSOCK(fd_stat.st_mode);
+    m_isFile = S_ISREG(fd_stat.st_mode);
   }
+  m_fileAsync = true;
   if (m_isSocket) {
     int flags = fcntl_f(m_fd, F_GETFL, 0);
     if (!(flags & O_NONBLOCK)) {
@@ -73,31 +77,35 @@ uint64_t FdCtx::getTimeout(int type) {
   }
 }
 
-FdManager::FdManager() { m_datas.resize(64); }
-
-FdCtx::ptr FdManager::get(int fd, bool auto_create) {
-  RWMutexType::ReadLock lock(m_mutex);
-  if ((int)m_datas.size() <= fd) {
-    if (auto_create == false) {
-      return nullptr;
-    }
-  } else {
-    if (m_datas[fd] || !auto_create) {
-      return m_datas[fd];
-    }
+FdCtx *FdManager::get(int fd, bool auto_create) {
+  FdCtx *ctx = m_datas.get(fd, auto_create);
+  if (!ctx) {
+    return nullptr;
   }
-  lock.unlock();
-
-  RWMutexType::WriteLock lock2(m_mutex);
-  FdCtx::ptr ctx(new FdCtx(fd));
-  m_datas[fd] = ctx;
-  return m_datas[fd];
+  if (ctx->m_used.load(std::memory_order_acquire)) {
+    return ctx;
+  }
+  if (!auto_create) {
+    return nullptr;
+  }
+  // 同一个fd号只有刚拿到它的线程会来创建(socket/accept) 不会并发
+  ctx->m_isInit = false;
+  ctx->init();
+  ctx->m_used.store(true, std::memory_order_release);
+  return ctx;
 }
 void FdManager::del(int fd) {
-  RWMutexType::WriteLock lock(m_mutex);
-  if ((int)m_datas.size() <= fd) {
+  FdCtx *ctx = m_datas.get(fd);
+  if (!ctx) {
     return;
   }
-  m_datas[fd].reset(); // 设置为nullptr
+  // 之前拿到指针的还在用的话 看到的是关掉的fd
+  Spinlock::Lock lock(ctx->m_mutex);
+  ctx->m_isClosed = true;
+  ctx->m_gen.fetch_add(1, std::memory_order_release);
+  // 内核在close时会把fd从epoll里去掉 下一个同号的fd要重新注册
+  ctx->m_registered = 0;
+  ctx->m_ready = 0;
+  ctx->m_used.store(false, std::memory_order_release);
 }
 } // namespace spadger
\ No newline at end of file
@@ -7,58 +7,118 @@
 #ifndef __FD_MANAGER_H__
 #define __FD_MANAGER_H__
 
+#include "fd_table.h"
+#include "fiber.h"
+#include "mutex.h"
 #include "singleton.h"
-#include "thread.h"
-#include <memory>
-#include <vector>
+#include <atomic>
 
 namespace spadger {
-class FdCtx : public std::enable_shared_from_this<FdCtx> {
-public:
-  typedef std::shared_ptr<FdCtx> ptr;
 
-  FdCtx(int fd);
+class Scheduler;
+
+/**
+ * @brief 每个fd一条记录 放在FdManager的表里 fd关了之后被同号的新fd复用
+ * @details hook层(非阻塞/超时)和IOManager(等待的事件和等待者)共用
+ *          一次查表两边都够用 整条记录对齐到缓存行 不超过两行
+ */
+class alignas(64) FdCtx {
+  friend class FdManager;
+  friend class IOManager;
+
+public:
+  explicit FdCtx(int fd);
   ~FdCtx();
 
   bool init();
-  bool isInit() const { return m_isInit; };
-  bool isSocket() const { return m_isSocket; }
-  bool isClose() const { return m_isClosed; }
+  bool isInit() const { return m_isInit.load(std::memory_order_relaxed); };
+  bool isSocket() const { return m_isSocket.load(std::memory_order_relaxed); }
+  // 普通文件 读写会交给io_uring/OffloadPool(见hook.cc file_io)
+  bool isFile() const { return m_isFile.load(std::memory_order_relaxed); }
+  bool isClose() const { return m_isClosed.load(std::memory_order_relaxed); }
   bool close();
 
-  void setUserNonblock(bool v) { m_userNonblock = v; }
-  bool getUserNonblock() const { return m_userNonblock; }
-
-  void setSysNonblock(bool v) { m_sysNonblock = v; }
-  bool getSysNonblock() const { return m_sysNonblock; }
+  void setUserNonblock(bool v) {
+    m_userNonblock.store(v, std::memory_order_relaxed);
+  }
+  bool getUserNonblock() const {
+    return m_userNonblock.load(std::memory_order_relaxed);
+  }
+
+  void setSysNonblock(bool v) {
+    m_sysNonblock.store(v, std::memory_order_relaxed);
+  }
+  bool getSysNonblock() const {
+    return m_sysNonblock.load(std::memory_order_relaxed);
+  }
+
+  // 普通文件在协程里的读写是否异步做 默认是(hook.file.async)
+  // 设成false之后这个fd直接在当前线程上调用(比如很小的读写 或者O_DIRECT自己管)
+  void setFileAsync(bool v) { m_fileAsync.store(v, std::memory_order_relaxed); }
+  bool getFileAsync() const {
+    return m_fileAsync.load(std::memory_order_relaxed);
+  }
 
   void setTimeout(int type, uint64_t v);
   uint64_t getTimeout(int type);
 
+  // fd每关一次加1 之后再等待/超时/epoll事件带着旧的编号 就知道是上一个fd的
+  uint32_t getGeneration() const {
+    return m_gen.load(std::memory_order_acquire);
+  }
+
 private:
-  bool m_isInit : 1;
-  bool m_isSocket : 1;
-  bool m_sysNonblock : 1;
-  bool m_userNonblock : 1;
-  bool m_isClosed : 1;
+  // 各占一个字节: 不同线程会同时改不同的标志(close和fcntl之类)
+  // 位域会读改写同一个字节 互相覆盖
+  std::atomic<bool> m_isInit;
+  std::atomic<bool> m_isSocket;
+  std::atomic<bool> m_sysNonblock;
+  std::atomic<bool> m_userNonblock;
+  std::atomic<bool> m_isClosed;
+  std::atomic<bool> m_isFile;
+  std::atomic<bool> m_fileAsync;
   int m_fd;
+  // 是否有打开的fd在用 由FdManager设置 不加锁读
+  std::atomic<bool> m_used = {false};
 
   uint64_t m_recvTimeout;
   uint64_t m_sendTimeout;
+
+  // ---------------- 下面由IOManager使用 m_mutex保护 ----------------
+  // 等在一个事件上的协程(或者回调 很少用 单独分配)
+  struct EventContext {
+    Scheduler *scheduler = nullptr; // 事件执行的scheduler
+    Fiber::ptr fiber;               // 事件的协程
+    std::unique_ptr<Task> cb;
+  };
+  Spinlock m_mutex;
+  uint8_t m_events = 0; // 正在等待的事件(IOManager::Event)
+  uint8_t m_ready = 0;  // 边沿通知过 但是还没有被等待者消费的事件
+  // persistent模式: fd第一次等待时以ET方式注册读写 一直到close
+  // 记的是注册到的IOManager的编号 0是没有注册
+  uint32_t m_registered = 0;
+  // 持有m_mutex时修改 所以持锁比较一次就知道fd有没有被关掉重开过
+  std::atomic<uint32_t> m_gen = {0};
+  EventContext m_read;  // 读事件如何处理
+  EventContext m_write; // 写事件如何处理
 };
 
 class FdManager {
 public:
-  typedef RWMutex RWMutexType;
-
-  FdManager();
-
-  FdCtx::ptr get(int fd, bool auto_create = false);
+  /**
+   * @brief 取fd的FdCtx 不加锁
+   * @param[in] auto_create fd还没有FdCtx时是否创建(socket/accept之后)
+   * @return 没有返回nullptr 返回的指针一直有效 fd关了之后isClose()为true
+   */
+  FdCtx *get(int fd, bool auto_create = false);
   void del(int fd);
+  // 不管fd是不是经过hook打开的 取它的记录(IOManager等事件用) 一直有效
+  FdCtx *getRecord(int fd, bool auto_create = false) {
+    return m_datas.get(fd, auto_create);
+  }
 
 private:
-  RWMutexType m_mutex;
-  std::vector<FdCtx::ptr> m_datas;
+  FdTable<FdCtx> m_datas;
 };
 
 typedef Singleton<FdManager> FdMgr;
@@ -0,0 +1,118 @@
+/*
+ * @Author: lxk
+ * @Date: 2022-11-06 10:21:37
+ * @LastEditors: lxk
+ * @LastEditTime: 2022-11-06 16:02:15
+ */
+#ifndef __SPADGER_FD_TABLE_H__
+#define __SPADGER_FD_TABLE_H__
+
+#include "noncopyable.h"
+#include <atomic>
+#include <new>
+#include <stddef.h>
+#include <stdlib.h>
+
+namespace spadger {
+
+/**
+ * @brief 按fd下标的表 只增长不收缩 读不加锁
+ * @details 分段存放: 第0段[0, 64) 第k段[64 << (k-1), 64 << k)
+ *          每段第一次用到时才分配 分配好就不再移动/释放(直到表析构)
+ *          所以拿到的T*一直有效 查找只要一次原子读(段指针)
+ *          两个线程同时分配同一段时CAS失败的那个把自己的释放掉
+ * @attention T要有T(int fd)的构造函数 表里的T会被复用(fd关了又被打开)
+ *            T自己负责内部状态的同步
+ */
+template <class T> class FdTable : Noncopyable {
+public:
+  FdTable() {
+    for (int i = 0; i < SEGMENTS; ++i) {
+      m_segments[i] = nullptr;
+    }
+  }
+  ~FdTable() {
+    for (int i = 0; i < SEGMENTS; ++i) {
+      T *seg = m_segments[i].load(std::memory_order_relaxed);
+      if (seg) {
+        freeSegment(seg, segmentSize(i));
+      }
+    }
+  }
+
+  /**
+   * @brief 取fd对应的元素
+   * @param[in] auto_create 所在段还没分配的话是否分配
+   * @return fd<0 或者没分配并且不自动分配时返回nullptr
+   */
+  T *get(int fd, bool auto_create = false) {
+    if (fd < 0) {
+      return nullptr;
+    }
+    int index = segmentIndex(fd);
+    T *seg = m_segments[index].load(std::memory_order_acquire);
+    if (!seg) {
+      if (!auto_create) {
+        return nullptr;
+      }
+      seg = allocSegment(index);
+    }
+    return seg + (fd - segmentBase(index));
+  }
+
+private:
+  static const int FIRST_BITS = 6; // 第0段64个
+  // fd是int 最多到2^31 需要1 + (31 - 6)段
+  static const int SEGMENTS = 32 - FIRST_BITS;
+
+  static int segmentIndex(int fd) {
+    if (fd < (1 << FIRST_BITS)) {
+      return 0;
+    }
+    // fd最高位是第b位(b >= FIRST_BITS)的在第b - FIRST_BITS + 1段
+    return 31 - __builtin_clz(fd) - FIRST_BITS + 1;
+  }
+  static int segmentBase(int index) {
+    return index ? 1 << (index + FIRST_BITS - 1) : 0;
+  }
+  static size_t segmentSize(int index) {
+    return index ? 1u << (index + FIRST_BITS - 1) : 1u << FIRST_BITS;
+  }
+
+  T *allocSegment(int index) {
+    size_t size = segmentSize(index);
+    int base = segmentBase(index);
+    // C++11的new不管超过max_align_t的对齐 按T要求的对齐自己分配
+    void *mem = nullptr;
+    size_t align = alignof(T) < sizeof(void *) ? sizeof(void *) : alignof(T);
+    if (posix_memalign(&mem, align, sizeof(T) * size)) {
+      throw std::bad_alloc();
+    }
+    T *seg = static_cast<T *>(mem);
+    for (size_t i = 0; i < size; ++i) {
+      new (seg + i) T(base + (int)i);
+    }
+    T *expected = nullptr;
+    if (!m_segments[index].compare_exchange_strong(
+            expected, seg, std::memory_order_acq_rel,
+            std::memory_order_acquire)) {
+      // 别的线程先分配好了
+      freeSegment(seg, size);
+      return expected;
+    }
+    return seg;
+  }
+  static void freeSegment(T *seg, size_t size) {
+    for (size_t i = 0; i < size; ++i) {
+      seg[i].~T();
+    }
+    free(seg);
+  }
+
+private:
+  std::atomic<T *> m_segments[SEGMENTS];
+};
+
+} // namespace spadger
+
+#endif
@@ -9,6 +9,10 @@
 #include "scheduler.h"
 #include "util.h"
 #include <atomic>
+#include <map>
+#include <string.h>
+#include <sys/mman.h>
+#include <vector>
 
 namespace spadger {
 
@@ -26,6 +30,10 @@ static thread_local Fiber::ptr t_threadFiber = nullptr;
 static ConfigVar<uint32_t>::ptr g_fiber_stack_size = Config::Lookup<uint32_t>(
     "fiber.stack_size", 1024 * 1024, "fiber stack size");
 
+static ConfigVar<uint32_t>::ptr g_fiber_stack_pool_max =
+    Config::Lookup<uint32_t>("fiber.stack_pool.max_cached", 1024,
+                             "max cached fiber stacks of all threads");
+
 class MllocStackAllocator {
 public:
   static void *Alloc(size_t size) { return malloc(size); }
@@ -34,8 +42,148 @@ public:
   }
 };
 
+// mmap分配栈, 栈底(低地址)多映射一页PROT_NONE作为guard page
+// 栈溢出时直接SIGSEGV, 而不是悄悄写坏相邻的堆内存
+class MmapStackAllocator {
+public:
+  static size_t PageSize() {
+    static size_t s_page = sysconf(_SC_PAGESIZE);
+    return s_page;
+  }
+  static size_t MapSize(size_t size) {
+    size_t page = PageSize();
+    return (size + page - 1) / page * page + page;
+  }
+
+  static void *Alloc(size_t size) {
+    size_t len = MapSize(size);
+    void *base = mmap(nullptr, len, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+    SPADGER_ASSERT2(base != MAP_FAILED, "mmap fiber stack");
+    if (mprotect(base, PageSize(), PROT_NONE)) {
+      SPADGER_ASSERT2(false, "mprotect guard page");
+    }
+    return (char *)base + PageSize();
+  }
+  static void Dealloc(void *vp, size_t size) {
+    munmap((char *)vp - PageSize(), MapSize(size));
+  }
+};
+
+// 全局缓存上限, 配置变化时通过listener更新, 避免热路径上读配置加锁
+static std::atomic<size_t> s_stack_pool_max{0};
+// 所有线程缓存的栈总数
+static std::atomic<size_t> s_stack_pool_cached{0};
+
+struct _StackPoolIniter {
+  _StackPoolIniter() {
+    s_stack_pool_max = g_fiber_stack_pool_max->getValue();
+    g_fiber_stack_pool_max->addListener(
+        [](const uint32_t &old_val, const uint32_t &new_val) {
+          s_stack_pool_max = new_val;
+        });
+  }
+};
+static _StackPoolIniter s_stack_pool_initer;
+
+// 协程栈池: 每个线程一份按大小分类的空闲链表, 协程析构时栈放回当前线程,
+// 下次构造直接复用, 不需要再mmap/munmap. 超过全局上限才真正释放
+class PooledStackAllocator {
+public:
+  static void *Alloc(size_t size) {
+    if (t_cacheGone) {
+      return MmapStackAllocator::Alloc(size);
+    }
+    auto &lst = t_cache.free[size];
+    if (!lst.empty()) {
+      void *vp = lst.back();
+      lst.pop_back();
+      --s_stack_pool_cached;
+      return vp;
+    }
+    return MmapStackAllocator::Alloc(size);
+  }
+  static void Dealloc(void *vp, size_t size) {
+    // 别的thread_local(比如t_threadFiber)比缓存析构得晚 这时候直接还给系统
+    if (t_cacheGone) {
+      MmapStackAllocator::Dealloc(vp, size);
+      return;
+    }
+    if (++s_stack_pool_cached > s_stack_pool_max) {
+      --s_stack_pool_cached;
+      MmapStackAllocator::Dealloc(vp, size);
+      return;
+    }
+    t_cache.free[size].push_back(vp);
+  }
+
+private:
+  // 线程退出时把自己缓存的栈还给系统
+  struct Cache {
+    ~Cache() {
+      t_cacheGone = true;
+      for (auto &i : free) {
+        for (auto vp : i.second) {
+          MmapStackAllocator::Dealloc(vp, i.first);
+          --s_stack_pool_cached;
+        }
+      }
+    }
+    std::map<size_t, std::vector<void *>> free;
+  };
+  static thread_local Cache t_cache;
+  // 静态初始化 t_cache析构之后还能读
+  static thread_local bool t_cacheGone;
+};
+thread_local PooledStackAllocator::Cache PooledStackAllocator::t_cache;
+thread_local bool PooledStackAllocator::t_cacheGone = false;
+
 // 可以切换其他的栈内存分配方式
-using StackAllocator = MllocStackAllocator;
+using StackAllocator = PooledStackAllocator;
+
+// ================================================================
+// ======================   SharedStack  ==========================
+// ================================================================
+
+static ConfigVar<uint32_t>::ptr g_fiber_shared_stack_count =
+    Config::Lookup<uint32_t>("fiber.shared_stack.count", 4,
+                             "shared stacks per thread");
+static ConfigVar<uint32_t>::ptr g_fiber_shared_stack_size =
+    Config::Lookup<uint32_t>("fiber.shared_stack.size", 1024 * 1024,
+                             "size of each shared stack");
+
+// 一块共享栈, 同一时刻只有occupant的内容在上面
+// occupant持有引用, 保证被挤出时对象还在(可能已经TERM, 挤出时直接丢弃)
+struct SharedStack {
+  char *stack = nullptr;
+  size_t size = 0;
+  Fiber::ptr occupant;
+};
+
+// 每个线程自己的一组共享栈, 第一次使用时按配置创建
+struct SharedStackGroup {
+  SharedStackGroup() {
+    tid = GetThreadId();
+    stacks.resize(std::max(1u, g_fiber_shared_stack_count->getValue()));
+    size_t size = g_fiber_shared_stack_size->getValue();
+    for (auto &i : stacks) {
+      i.stack = (char *)StackAllocator::Alloc(size);
+      i.size = size;
+    }
+  }
+  ~SharedStackGroup() {
+    for (auto &i : stacks) {
+      i.occupant.reset();
+      StackAllocator::Dealloc(i.stack, i.size);
+    }
+  }
+  SharedStack *next() { return &stacks[idx++ % stacks.size()]; }
+
+  pid_t tid;
+  size_t idx = 0;
+  std::vector<SharedStack> stacks;
+};
+static thread_local std::unique_ptr<SharedStackGroup> t_sharedStacks;
 
 uint64_t Fiber::GetFiberId() {
   // 如果使用GetThis 的话在没有协程时就会构造main fiber，没必要
@@ -50,39 +198,40 @@ Fiber::Fiber() {
   m_state = EXEC;
   SetThis(this); // 将当前fiber 放入thread_local fiber object
 
-  // ucontext 线程主协程初始化
-  if (getcontext(&m_ctx)) {
-    SPADGER_ASSERT2(false, "getcontext");
-  }
+  // 线程主协程初始化(ucontext需要getcontext, asm什么都不用做)
+  m_ctx.initMain();
   ++s_fiber_count;
 
   SPADGER_LOG_DEBUG(g_logger) << "Fiber::Fiber main";
 }
 
 // 非main Fiber 需要分配栈空间 和 cb
-Fiber::Fiber(std::function<void()> cb, size_t stacksize, bool use_caller)
-    : m_id(++s_fiber_id), m_cb(cb) {
+Fiber::Fiber(Task cb, size_t stacksize, bool use_caller, bool shared_stack)
+    : m_id(++s_fiber_id), m_cb(std::move(cb)), m_sharedStack(shared_stack),
+      m_useCaller(use_caller) {
   ++s_fiber_count;
+  if (m_sharedStack) {
+    // 栈在第一次运行时才确定 上下文到时候再初始化
+    SPADGER_LOG_DEBUG(g_logger) << "Fiber::Fiber shared id=" << m_id;
+    return;
+  }
   m_stacksize = stacksize ? stacksize : g_fiber_stack_size->getValue();
   m_stack = StackAllocator::Alloc(m_stacksize);
 
-  if (getcontext(&m_ctx)) {
-    SPADGER_ASSERT2(false, "getcontext");
-  }
-  m_ctx.uc_stack.ss_sp = m_stack;
-  m_ctx.uc_stack.ss_size = m_stacksize;
-  m_ctx.uc_link = nullptr;
-
   if (!use_caller) {
-    makecontext(&m_ctx, &Fiber::MainFunc, 0);
+    m_ctx.init(m_stack, m_stacksize, &Fiber::MainFunc);
   } else {
-    makecontext(&m_ctx, &Fiber::CallerMainFunc, 0);
+    m_ctx.init(m_stack, m_stacksize, &Fiber::CallerMainFunc);
   }
   SPADGER_LOG_DEBUG(g_logger) << "Fiber::Fiber id=" << m_id;
 }
 Fiber::~Fiber() {
   --s_fiber_count;
-  if (m_stack) {
+  if (m_sharedStack) {
+    // 在共享栈上时occupant持有引用 不会走到这里
+    SPADGER_ASSERT(m_state == TERM || m_state == INIT || m_state == EXCEPT);
+    free(m_saveBuf);
+  } else if (m_stack) {
     // 不是主协程
     SPADGER_ASSERT(m_state == TERM || m_state == INIT || m_state == EXCEPT);
     StackAllocator::Dealloc(m_stack, m_stacksize);
@@ -101,23 +250,23 @@ Fiber::~Fiber() {
 }
 
 // 重置协程函数和协程状态
-void Fiber::reset(std::function<void()> cb) {
+void Fiber::reset(Task cb) {
   // 成为新的协程
-  SPADGER_ASSERT(m_stack); // 非主协程 有栈才可以
+  SPADGER_ASSERT(m_stack || m_sharedStack); // 非主协程 有栈才可以
   SPADGER_ASSERT(m_state == TERM || m_state == INIT ||
                  m_state == EXCEPT); // 运行或者ready或者HOLD肯定不行
 
-  m_cb = cb;
-  if (getcontext(&m_ctx)) {
-    SPADGER_ASSERT2(false, "getcontext");
+  m_cb = std::move(cb);
+  if (m_sharedStack) {
+    // 之前的栈内容作废 从栈顶重新开始
+    // 上下文在下次切入时重新初始化
+    m_saveSize = 0;
+    m_useCaller = false;
+    m_state = INIT;
+    return;
   }
-
-  m_ctx.uc_link = nullptr; // 为什么不设置为main fiber
-  m_ctx.uc_stack.ss_size = m_stacksize;
-  m_ctx.uc_stack.ss_sp = m_stack;
-
-  makecontext(&m_ctx, &Fiber::MainFunc,
-              0); // 这里因为function<void()> 所以成员函数不行 只能是static函数
+  // 这里因为function<void()> 所以成员函数不行 只能是static函数
+  m_ctx.init(m_stack, m_stacksize, &Fiber::MainFunc);
   m_state = INIT;
 }
 
@@ -131,18 +280,17 @@ void Fiber::reset(std::function<void()> cb) {
 
 void Fiber::call() {
   SetThis(this);
-  m_state = EXEC;
-  if (swapcontext(&t_threadFiber->m_ctx, &m_ctx)) {
-    SPADGER_ASSERT2(false, "swapcontext");
+  if (m_sharedStack) {
+    loadSharedStack();
   }
+  m_state = EXEC;
+  Context::Swap(t_threadFiber->m_ctx, m_ctx);
 }
 
 // back
 void Fiber::back() {
   SetThis(t_threadFiber.get());
-  if (swapcontext(&m_ctx, &t_threadFiber->m_ctx)) {
-    SPADGER_ASSERT2(false, "swapcontext");
-  }
+  Context::Swap(m_ctx, t_threadFiber->m_ctx);
 }
 
 // ================================================================
@@ -151,18 +299,74 @@ void Fiber::back() {
 void Fiber::swapIn() {
   SetThis(this); // 操作时一定是主协程的
   SPADGER_ASSERT(m_state != EXEC);
-  m_state = EXEC;
-  if (swapcontext(&Scheduler::GetMainFiber()->m_ctx,
-                  &m_ctx)) { // 搞清楚从哪到哪 左到右 old->new
-    SPADGER_ASSERT2(false, "swapcontext");
+  if (m_sharedStack) {
+    loadSharedStack();
   }
+  m_state = EXEC;
+  // 搞清楚从哪到哪 左到右 old->new
+  Context::Swap(Scheduler::GetMainFiber()->m_ctx, m_ctx);
 }
 // 当前非主协程切换到后台执行
 void Fiber::swapOut() {
   SetThis(Scheduler::GetMainFiber());
-  if (swapcontext(&m_ctx, &Scheduler::GetMainFiber()->m_ctx)) {
-    SPADGER_ASSERT2(false, "swapcontext");
+  Context::Swap(m_ctx, Scheduler::GetMainFiber()->m_ctx);
+}
+
+// -----------------------------------------------------------------
+// 共享栈: 切入时如果栈上是别的协程, 先把它用到的部分拷走, 再把自己的拷回来
+// 只会在绑定的线程上执行(由Scheduler保证), 所以不需要加锁
+void Fiber::loadSharedStack() {
+  if (!m_shared) {
+    // 第一次运行 绑定到当前线程的一块共享栈上
+    if (!t_sharedStacks) {
+      t_sharedStacks.reset(new SharedStackGroup);
+    }
+    m_shared = t_sharedStacks->next();
+    m_boundThread = t_sharedStacks->tid;
+  }
+  SPADGER_ASSERT2(m_boundThread == t_sharedStacks->tid,
+                  "shared stack fiber resumed on another thread");
+
+  // 还没运行过(或者reset过)的协程 栈上没有自己的东西 需要重新初始化上下文
+  bool fresh = m_state == INIT;
+  Fiber *occupant = m_shared->occupant.get();
+  if (occupant != this) {
+    // 必须先把原来的内容拷走 初始化上下文也会写栈顶
+    if (occupant) {
+      occupant->saveSharedStack();
+    }
+    if (!fresh && m_saveSize) {
+      memcpy(m_shared->stack + m_shared->size - m_saveSize, m_saveBuf,
+             m_saveSize);
+    }
+    m_shared->occupant = shared_from_this();
+  }
+  if (fresh) {
+    m_ctx.init(m_shared->stack, m_shared->size,
+               m_useCaller ? &Fiber::CallerMainFunc : &Fiber::MainFunc);
+  }
+}
+
+void Fiber::saveSharedStack() {
+  if (m_state == TERM || m_state == EXCEPT || m_state == INIT) {
+    // 已经结束或者还没运行过 栈上没有需要保留的东西
+    m_saveSize = 0;
+    return;
+  }
+  // 切出时上下文保存的sp 恢复需要的寄存器和调用帧都在它上面
+  char *top = m_shared->stack + m_shared->size;
+  char *low = (char *)m_ctx.sp();
+  if (low < m_shared->stack || low > top) {
+    low = m_shared->stack;
   }
+  size_t size = top - low;
+  if (size != m_saveSize) {
+    // 按实际大小申请 缩小也重新申请 保证空闲时占用的内存最少
+    free(m_saveBuf);
+    m_saveBuf = (char *)malloc(size);
+  }
+  memcpy(m_saveBuf, low, size);
+  m_saveSize = size;
 }
 
 // -----------------------------------------------------------------
@@ -202,6 +406,9 @@ uint64_t Fiber::TotalFibers() {
   // 此处应该加锁
   return s_fiber_count;
 }
+
+uint64_t Fiber::CachedStacks() { return s_stack_pool_cached; }
+uint32_t Fiber::DefaultStackSize() { return g_fiber_stack_size->getValue(); }
 // ============================================================================
 
 void Fiber::MainFunc() {
@@ -8,13 +8,16 @@
 #ifndef __SPADGER_FIBER_H__
 #define __SPADGER_FIBER_H__
 
+#include "context.h"
+#include "task.h"
 #include <functional>
 #include <memory>
-#include <ucontext.h>
 
 namespace spadger {
 
 class Scheduler;
+struct SharedStack;
+struct IoWait; // 见hook.cc
 
 class Fiber : public std::enable_shared_from_this<Fiber> {
   friend class Scheduler;
@@ -36,12 +39,18 @@ private:
   Fiber();
 
 public:
-  Fiber(std::function<void()> cb, size_t stacksize = 0,
-        bool use_caller = false);
+  /**
+   * @param[in] shared_stack 共享栈模式: 不分配独立的栈, 运行在线程的共享栈上,
+   *            切换时只把用到的部分拷贝到堆上. 适合大量长期空闲的协程,
+   *            此时stacksize无效(使用fiber.shared_stack.size),
+   *            并且第一次运行后只能在该线程上调度
+   */
+  Fiber(Task cb, size_t stacksize = 0,
+        bool use_caller = false, bool shared_stack = false);
   ~Fiber();
 
   // 重置协程函数和协程状态
-  void reset(std::function<void()> cb);
+  void reset(Task cb);
 
   // 切换到前台执行
   void swapIn();
@@ -62,6 +71,14 @@ public:
   void back();
 
   uint64_t getId() const { return m_id; }
+  // 共享栈协程为0
+  uint32_t getStackSize() const { return m_stacksize; }
+  bool isSharedStack() const { return m_sharedStack; }
+  // 共享栈协程运行过之后绑定的线程, 其余情况为-1
+  int getBoundThread() const { return m_boundThread; }
+  // hook里带超时的阻塞IO用的等待状态 第一次用到时创建
+  // 之后一直跟着协程(协程池里复用时也不释放)
+  std::shared_ptr<IoWait> &getIoWait() { return m_ioWait; }
 
   State getState() { return m_state; }
   void setState(State state) { m_state = state; }
@@ -77,6 +94,10 @@ public:
   static void YieldToHold();
 
   static uint64_t TotalFibers();
+  // 所有线程的栈池里缓存着的栈(fiber.stack_pool.max_cached是上限)
+  static uint64_t CachedStacks();
+  // fiber.stack_size 不指定stacksize时用的栈大小
+  static uint32_t DefaultStackSize();
 
   static void MainFunc();
 
@@ -84,15 +105,29 @@ public:
 
   static void CallerMainFunc();
 
+private:
+  // 切入前把共享栈换成自己的内容
+  void loadSharedStack();
+  // 被别的协程挤出共享栈时 保存自己用到的那部分栈
+  void saveSharedStack();
+
 private:
   uint64_t m_id = 0;
   uint32_t m_stacksize = 0;
   State m_state = INIT;
 
-  ucontext_t m_ctx;
+  Context m_ctx;          // 上下文实现见context.h(asm或ucontext)
   void *m_stack = nullptr; // 自己在函数实现栈的reload和save
 
-  std::function<void()> m_cb;
+  Task m_cb;
+
+  bool m_sharedStack = false;
+  bool m_useCaller = false;
+  int m_boundThread = -1;
+  SharedStack *m_shared = nullptr; // 所在的共享栈
+  char *m_saveBuf = nullptr;       // 保存下来的栈内容
+  size_t m_saveSize = 0;
+  std::shared_ptr<IoWait> m_ioWait;
 };
 
 } // namespace spadger
@@ -5,18 +5,33 @@
  * @LastEditTime: 2022-10-22 19:43:02
  */
 #include "hook.h"
+#include "clock.h"
 #include "config.h"
 #include "fd_manager.h"
 #include "fiber.h"
 #include "iomanager.h"
 #include "log.h"
+#include "offload.h"
+#include <algorithm>
+#include <climits>
 #include <dlfcn.h>
+#include <stdarg.h>
+#include <vector>
 
 spadger::Logger::ptr g_logger = SPADGER_LOG_NAME("system");
 namespace spadger {
 
 static spadger::ConfigVar<int>::ptr g_tcp_connect_timeout =
     spadger::Config::Lookup("tcp.connect.timeout", 5000, "tcp connect timeout");
+static spadger::ConfigVar<int>::ptr g_tcp_timeout_slack =
+    spadger::Config::Lookup("tcp.timeout.slack", 0,
+                            "max ms a socket io/connect timeout may fire late "
+                            "so that nearby timeouts expire together "
+                            "(0: exact, servers with many timeouts opt in)");
+static spadger::ConfigVar<bool>::ptr g_hook_file_async =
+    spadger::Config::Lookup("hook.file.async", true,
+                            "run regular-file io from fibers on io_uring or "
+                            "the offload pool instead of blocking the thread");
 
 static thread_local bool t_hook_enable = false;
 
@@ -27,17 +42,32 @@ static thread_local bool t_hook_enable = false;
   XX(socket)                                                                   \
   XX(connect)                                                                  \
   XX(accept)                                                                   \
+  XX(accept4)                                                                  \
   XX(read)                                                                     \
   XX(readv)                                                                    \
   XX(recv)                                                                     \
   XX(recvfrom)                                                                 \
   XX(recvmsg)                                                                  \
+  XX(recvmmsg)                                                                 \
   XX(write)                                                                    \
   XX(writev)                                                                   \
   XX(send)                                                                     \
   XX(sendto)                                                                   \
   XX(sendmsg)                                                                  \
+  XX(sendmmsg)                                                                 \
+  XX(sendfile)                                                                 \
+  XX(splice)                                                                   \
+  XX(tee)                                                                      \
   XX(close)                                                                    \
+  XX(open)                                                                     \
+  XX(openat)                                                                   \
+  XX(pread)                                                                    \
+  XX(pwrite)                                                                   \
+  XX(fsync)                                                                    \
+  XX(fdatasync)                                                                \
+  XX(poll)                                                                     \
+  XX(select)                                                                   \
+  XX(epoll_wait)                                                               \
   XX(fcntl)                                                                    \
   XX(ioctl)                                                                    \
   XX(setsockopt)                                                               \
@@ -57,10 +87,13 @@ void hook_init() {
 
 // 在main之前执行
 static uint64_t s_connect_timeout = -1;
+static uint64_t s_timeout_slack = 0;
+static bool s_file_async = true;
 struct _HookIniter {
   _HookIniter() {
     hook_init();
     s_connect_timeout = g_tcp_connect_timeout->getValue();
+    s_timeout_slack = g_tcp_timeout_slack->getValue();
 
     g_tcp_connect_timeout->addListener(
         [](const int &old_val, const int &new_val) {
@@ -68,6 +101,15 @@ struct _HookIniter {
           SPADGER_LOG_INFO(g_logger) << "tcp connect timeout changed from "
                                      << old_val << " to " << new_val;
         });
+    g_tcp_timeout_slack->addListener(
+        [](const int &old_val, const int &new_val) {
+          s_timeout_slack = new_val;
+        });
+    s_file_async = g_hook_file_async->getValue();
+    g_hook_file_async->addListener(
+        [](const bool &old_val, const bool &new_val) {
+          s_file_async = new_val;
+        });
   }
 };
 static _HookIniter s_hook_initer;
@@ -76,19 +118,228 @@ bool is_hook_enable() { return t_hook_enable; }
 
 void set_hook_enable(bool flag) { t_hook_enable = flag; }
 
+// 普通文件调用的统计 每类一份
+struct FileIoCounter {
+  std::atomic<uint64_t> calls = {0};
+  std::atomic<uint64_t> uring = {0};
+  std::atomic<uint64_t> offload = {0};
+  std::atomic<uint64_t> errors = {0};
+  std::atomic<uint64_t> bytes = {0};
+  std::atomic<uint64_t> totalUS = {0};
+  std::atomic<uint64_t> maxUS = {0};
+};
+static FileIoCounter s_file_io[FILE_IO_OP_COUNT];
+
+FileIoStats get_file_io_stats(FileIoOp op) {
+  FileIoCounter &counter = s_file_io[op];
+  FileIoStats stats;
+  stats.calls = counter.calls;
+  stats.uring = counter.uring;
+  stats.offload = counter.offload;
+  stats.errors = counter.errors;
+  stats.bytes = counter.bytes;
+  stats.totalUS = counter.totalUS;
+  stats.maxUS = counter.maxUS;
+  return stats;
+}
+
+std::ostream &dump_file_io_stats(std::ostream &os) {
+  static const char *names[FILE_IO_OP_COUNT] = {"open", "read", "write",
+                                                "sync"};
+  os << "[FileIo";
+  for (int i = 0; i < FILE_IO_OP_COUNT; ++i) {
+    FileIoStats stats = get_file_io_stats((FileIoOp)i);
+    os << " " << names[i] << "={calls=" << stats.calls
+       << " uring=" << stats.uring << " offload=" << stats.offload
+       << " errors=" << stats.errors << " bytes=" << stats.bytes
+       << " avg_us=" << (stats.calls ? stats.totalUS / stats.calls : 0)
+       << " max_us=" << stats.maxUS << "}";
+  }
+  os << " ]";
+  return os;
+}
+
 } // namespace spadger
 
-struct timer_info {
-  int cancelled = 0;
+namespace spadger {
+// 协程带超时阻塞在fd上时的等待状态 跟着协程复用 定时器也复用
+// 每次阻塞seq+1 超时回调只认自己那一次的seq 过期的回调什么也不做
+struct IoWait {
+  std::atomic<uint64_t> seq = {0};
+  std::atomic<uint64_t> timedout = {0}; // 超时的那一次的seq
+  Timer::ptr timer;
 };
+} // namespace spadger
+
+// 配了tcp.timeout.slack的话IO超时可以晚一点 最多晚min(slack, 超时的1/10)
+// 差不多同时到期的超时合并到一次唤醒里处理 默认0 和SO_RCVTIMEO一样准
+static uint64_t timeout_slack(uint64_t timeout_ms) {
+  return std::min<uint64_t>(spadger::s_timeout_slack, timeout_ms / 10);
+}
+
+// errno是线程局部的 协程Yield回来的时候可能已经换了一个线程
+// 但__errno_location()声明成了const函数 编译器会把Yield之前取到的地址接着用
+// 写到别的线程的errno上 所以Yield之后都通过这个函数读写errno
+static int &fiber_errno() __attribute__((noinline));
+static int &fiber_errno() {
+  int *p = &errno;
+  asm volatile("" : "+r"(p)); // 不让编译器把这个函数也当成const的
+  return *p;
+}
+
+// 阻塞之前启动超时定时器: 超时了取消fd上的event 把协程叫回来
+// 返回这次阻塞的seq 醒来之后交给wait_timedout()
+// 定时器只记fd的代数 到期时fd已经关掉(可能又被别人打开)了就什么也不做
+static uint64_t wait_timeout(spadger::IOManager *iom, spadger::FdCtx *ctx,
+                             int fd, spadger::IOManager::Event event,
+                             uint64_t timeout_ms) {
+  std::shared_ptr<spadger::IoWait> &wait =
+      spadger::Fiber::GetThis()->getIoWait();
+  if (!wait) {
+    wait = std::make_shared<spadger::IoWait>();
+  }
+  uint64_t seq = ++wait->seq;
+  std::shared_ptr<spadger::IoWait> w = wait;
+  uint32_t gen = ctx->getGeneration();
+  auto cb = [w, seq, fd, gen, iom, event]() {
+    if (w->seq != seq) {
+      return; // 协程已经不在等这一次了
+    }
+    w->timedout = seq;
+    iom->cancelEvent(fd, event, gen);
+  };
+  uint64_t slack = timeout_slack(timeout_ms);
+  // 和sleep一样从现在算起 缓存的时间可能已经旧了 超时会提前
+  spadger::Clock::Refresh();
+  if (!wait->timer || !iom->restartTimer(wait->timer, timeout_ms, cb, slack)) {
+    wait->timer = iom->addTimer(timeout_ms, cb, false, slack);
+  }
+  return seq;
+}
+
+// 醒来之后: 停掉定时器 返回是不是超时了
+static bool wait_timedout(uint64_t seq) {
+  spadger::IoWait &wait = *spadger::Fiber::GetThis()->getIoWait();
+  wait.timer->cancel();
+  return wait.timedout == seq;
+}
+
+static spadger::UringIo uring_io(uint8_t opcode, const void *addr, size_t len,
+                                 int flags) {
+  spadger::UringIo io;
+  io.opcode = opcode;
+  io.addr = addr;
+  io.len = len;
+  io.op_flags = flags;
+  return io;
+}
+
+// io_uring的结果转成系统调用的返回值
+static ssize_t uring_result(int res) {
+  if (res < 0) {
+    // close()取消掉的操作 和在关闭的fd上做同步IO一样返回EBADF
+    fiber_errno() = res == -ECANCELED ? EBADF : -res;
+    return -1;
+  }
+  return res;
+}
 
+// 协程里要异步做的普通文件 其它的返回nullptr
+static spadger::FdCtx *file_ctx(int fd) {
+  if (!spadger::t_hook_enable || !spadger::s_file_async) {
+    return nullptr;
+  }
+  spadger::FdCtx *ctx = spadger::FdMgr::GetInstance()->get(fd);
+  if (!ctx || ctx->isClose() || !ctx->isFile() || !ctx->getFileAsync()) {
+    return nullptr;
+  }
+  return ctx;
+}
+
+static spadger::FileIoOp file_io_op(uint8_t opcode) {
+  switch (opcode) {
+  case IORING_OP_OPENAT:
+    return spadger::FILE_IO_OPEN;
+  case IORING_OP_READ:
+  case IORING_OP_READV:
+    return spadger::FILE_IO_READ;
+  case IORING_OP_WRITE:
+  case IORING_OP_WRITEV:
+    return spadger::FILE_IO_WRITE;
+  default:
+    return spadger::FILE_IO_SYNC;
+  }
+}
+
+/**
+ * @brief 普通文件的IO 磁盘没有"就绪"可等 epoll帮不上忙
+ *        IOManager开了io_uring就交给io_uring(fio) 否则在OffloadPool的线程上调fun
+ *        都不行(共享栈的协程)就直接调用
+ * @param[in] fd 交给io_uring的fd(openat是dirfd) 也是fun的第一个参数
+ */
+template <typename OriginFun, typename... Args>
+static ssize_t file_io(int fd, OriginFun fun, spadger::UringIo &fio,
+                       Args &&... args) {
+  spadger::FileIoCounter &counter = spadger::s_file_io[file_io_op(fio.opcode)];
+  uint64_t begin = spadger::Clock::ReadUS();
+  spadger::IOManager *iom = spadger::IOManager::GetThis();
+  ssize_t n = 0;
+  int res = 0;
+  // 老内核没有这个opcode时返回EINVAL 换线程池再做一次
+  if (iom && iom->hasUring() && iom->submitIo(fd, fio, -1, res) &&
+      res != -EINVAL && res != -EOPNOTSUPP) {
+    ++counter.uring;
+    n = uring_result(res);
+  } else if (spadger::OffloadPool::CanOffload()) {
+    ++counter.offload;
+    int error = 0;
+    n = spadger::OffloadMgr::GetInstance()->run([&]() {
+      ssize_t rt = fun(fd, args...);
+      error = errno; // 池里线程的errno
+      return rt;
+    });
+    if (n == -1) {
+      fiber_errno() = error;
+    }
+  } else {
+    n = fun(fd, std::forward<Args>(args)...);
+  }
+
+  uint64_t used = spadger::Clock::ReadUS() - begin;
+  ++counter.calls;
+  counter.totalUS += used;
+  uint64_t max = counter.maxUS;
+  while (used > max && !counter.maxUS.compare_exchange_weak(max, used)) {
+  }
+  if (n < 0) {
+    ++counter.errors;
+  } else if (fio.opcode != IORING_OP_OPENAT && fio.opcode != IORING_OP_FSYNC) {
+    counter.bytes += n;
+  }
+  return n;
+}
+
+// 新拿到的fd(socket/accept/open...) 同号的旧记录一定是过期的
+// (比如close绕过了hook) 先作废再建 不然会沿用旧的epoll注册状态
+static spadger::FdCtx *new_fd_ctx(int fd) {
+  spadger::FdMgr::GetInstance()->del(fd);
+  return spadger::FdMgr::GetInstance()->get(fd, true);
+}
+
+/**
+ * @param[in] uio 不为空并且IOManager开了io_uring的时候,
+ *            EAGAIN之后不再等epoll通知再重试 而是把uio交给io_uring完成
+ * @param[in] fio fd是普通文件时用的io_uring操作(见file_io)
+ *            为空的话普通文件还是直接调用
+ */
 template <typename OriginFun, typename... Args>
 static ssize_t do_io(int fd, OriginFun fun, const char *hook_fun_name,
-                     uint32_t event, int timeout_so, Args &&... args) {
+                     uint32_t event, int timeout_so, spadger::UringIo *uio,
+                     spadger::UringIo *fio, Args &&... args) {
   if (!spadger::t_hook_enable) {
     return fun(fd, std::forward<Args>(args)...);
   }
-  spadger::FdCtx::ptr ctx = spadger::FdMgr::GetInstance()->get(fd);
+  spadger::FdCtx *ctx = spadger::FdMgr::GetInstance()->get(fd);
   if (!ctx) {
     return fun(fd, std::forward<Args>(args)...);
   }
@@ -96,51 +347,49 @@ static ssize_t do_io(int fd, OriginFun fun, const char *hook_fun_name,
     errno = EBADF;
     return -1;
   }
-  if (!ctx->isSocket() || ctx->getUserNonblock()) {
+  if (!ctx->isSocket()) {
+    if (fio && ctx->isFile() && ctx->getFileAsync() && spadger::s_file_async) {
+      return file_io(fd, fun, *fio, std::forward<Args>(args)...);
+    }
+    return fun(fd, std::forward<Args>(args)...);
+  }
+  if (ctx->getUserNonblock()) {
     return fun(fd, std::forward<Args>(args)...);
   }
 
   uint64_t to = ctx->getTimeout(timeout_so);
-  std::shared_ptr<timer_info> tinfo(new timer_info);
 
 retry:
   // 尝试做原版同步的IO操作
   ssize_t n = fun(fd, std::forward<Args>(args)...);
   //   SPADGER_LOG_DEBUG(g_logger) << hook_fun_name << " n:" << n;
-  while (n == -1 && errno == EINTR) {
+  while (n == -1 && fiber_errno() == EINTR) {
     n = fun(fd, std::forward<Args>(args)...);
   }
   // 如果原版的IO操作结果为EAGAIN，说明需要使用异步操作
   // 也就是iom->addEvent，这样不至于阻塞当前线程
-  if (n == -1 && errno == EAGAIN) {
-    SPADGER_LOG_INFO(g_logger) << "di_io<" << hook_fun_name << ">";
+  if (n == -1 && fiber_errno() == EAGAIN) {
     spadger::IOManager *iom = spadger::IOManager::GetThis();
-    spadger::Timer::ptr timer;
-    std::weak_ptr<timer_info> winfo(tinfo);
-
+    if (uio && iom->hasUring()) {
+      int res = 0;
+      if (iom->submitIo(fd, *uio, to, res)) {
+        return uring_result(res);
+      }
+    }
     // 如果有超时选项，那么在fd没有遇到event的时候可能会超时，
     // 所以需要addTimer(行为是在超时之后取消cancelEvent)
+    // 定时器和等待状态都是协程上复用的 不用每次分配
+    uint64_t seq = 0;
     if (to != (uint64_t)-1) {
-      timer = iom->addConditionTimer(
-          to,
-          [winfo, fd, iom, event]() {
-            auto t = winfo.lock();
-            if (!t || t->cancelled) {
-              return;
-            }
-            t->cancelled = ETIMEDOUT;
-            iom->cancelEvent(fd, (spadger::IOManager::Event)event);
-          },
-          winfo);
+      seq = wait_timeout(iom, ctx, fd, (spadger::IOManager::Event)event, to);
     }
     // 为fd添加event事件 使其成为异步事件
-    // std::cout << "fd:" << fd << std::endl;
     int rt = iom->addEvent(fd, (spadger::IOManager::Event)(event));
     if (rt) {
       SPADGER_LOG_ERROR(g_logger)
           << hook_fun_name << " addEvent(" << fd << ", " << event << ")";
-      if (timer) {
-        timer->cancel();
+      if (seq) {
+        wait_timedout(seq);
       }
       return -1;
     } else {
@@ -150,13 +399,8 @@ retry:
       // 1. 正常返回: event事件发生 所以返回
       // 2. 超时
       // 如果定时器存在 就cancel，因为没用了
-
-      if (timer) {
-        timer->cancel();
-      }
-      // 如果异常 需要return -1
-      if (tinfo->cancelled) {
-        errno = tinfo->cancelled;
+      if (seq && wait_timedout(seq)) {
+        fiber_errno() = ETIMEDOUT;
         return -1;
       }
       // 如果正常，retry继续fun(fd)) 因为fd已经准备好了
@@ -166,6 +410,105 @@ retry:
   return n;
 }
 
+// 协程让出 等fd上的event 最多timeout_ms(-1一直等)
+// 返回1等到了(可能是假唤醒) 0超时 -1没法等(调用者退回阻塞的原版调用)
+static int wait_event(spadger::IOManager *iom, int fd,
+                      spadger::IOManager::Event event, int timeout_ms) {
+  spadger::FdCtx *ctx = spadger::FdMgr::GetInstance()->get(fd, true);
+  if (!ctx) {
+    return -1;
+  }
+  uint64_t seq = 0;
+  if (timeout_ms >= 0) {
+    seq = wait_timeout(iom, ctx, fd, event, timeout_ms);
+  }
+  if (iom->addEvent(fd, event)) {
+    if (seq) {
+      wait_timedout(seq);
+    }
+    return -1;
+  }
+  spadger::Fiber::YieldToHold();
+  return seq && wait_timedout(seq) ? 0 : 1;
+}
+
+// fd是不是用户要的非阻塞 socket看userNonblock 管道没hook fcntl 看真实的标志
+static bool user_nonblock(spadger::FdCtx *ctx, int fd) {
+  if (ctx->isSocket()) {
+    return ctx->getUserNonblock();
+  }
+  return fcntl_f(fd, F_GETFL, 0) & O_NONBLOCK;
+}
+
+// fd是不是hook接管的阻塞socket(do_io会让出等待的那种)
+static bool hooked_blocking(int fd) {
+  if (!spadger::t_hook_enable) {
+    return false;
+  }
+  spadger::FdCtx *ctx = spadger::FdMgr::GetInstance()->get(fd);
+  return ctx && !ctx->isClose() && ctx->isSocket() && !ctx->getUserNonblock();
+}
+
+/**
+ * @brief splice/tee: 两头至少有一个是管道 管道没有设置成非阻塞
+ *        所以带上SPLICE_F_NONBLOCK调用 EAGAIN了看是哪一头没就绪 等那一头
+ *        超时用socket那一头的SO_RCVTIMEO(读)/SO_SNDTIMEO(写) 都是管道就一直等
+ * @param[in] fun fun(flags)做一次原版调用
+ */
+template <typename Fun>
+static ssize_t do_splice(int fd_in, int fd_out, unsigned int flags,
+                         const char *hook_fun_name, Fun fun) {
+  spadger::IOManager *iom = spadger::IOManager::GetThis();
+  if (!spadger::t_hook_enable || !iom || (flags & SPLICE_F_NONBLOCK)) {
+    return fun(flags);
+  }
+  spadger::FdCtx *in = spadger::FdMgr::GetInstance()->get(fd_in, true);
+  spadger::FdCtx *out = spadger::FdMgr::GetInstance()->get(fd_out, true);
+  if (!in || !out) {
+    return fun(flags);
+  }
+  if (in->isClose() || out->isClose()) {
+    errno = EBADF;
+    return -1;
+  }
+  uint64_t to = in->isSocket()    ? in->getTimeout(SO_RCVTIMEO)
+                : out->isSocket() ? out->getTimeout(SO_SNDTIMEO)
+                                  : (uint64_t)-1;
+  int timeout_ms =
+      to == (uint64_t)-1 ? -1 : (int)std::min(to, (uint64_t)INT_MAX);
+
+  while (true) {
+    ssize_t n = fun(flags | SPLICE_F_NONBLOCK);
+    while (n == -1 && fiber_errno() == EINTR) {
+      n = fun(flags | SPLICE_F_NONBLOCK);
+    }
+    if (n != -1 || fiber_errno() != EAGAIN) {
+      return n;
+    }
+    // 输入有数据了就是输出满了
+    pollfd fds[2] = {{fd_in, POLLIN, 0}, {fd_out, POLLOUT, 0}};
+    poll_f(fds, 2, 0);
+    int fd = fds[0].revents ? fd_out : fd_in;
+    spadger::FdCtx *ctx = fds[0].revents ? out : in;
+    if (user_nonblock(ctx, fd)) {
+      fiber_errno() = EAGAIN;
+      return -1;
+    }
+    int rt = wait_event(iom, fd,
+                        fds[0].revents ? spadger::IOManager::WRITE
+                                       : spadger::IOManager::READ,
+                        timeout_ms);
+    if (rt < 0) {
+      SPADGER_LOG_ERROR(g_logger)
+          << hook_fun_name << " addEvent(" << fd << ")";
+      return -1;
+    } else if (rt == 0) {
+      fiber_errno() = ETIMEDOUT;
+      return -1;
+    }
+  }
+}
+
 extern "C" {
 #define XX(name) name##_fun name##_f = nullptr;
 HOOK_FUN(XX);
@@ -180,13 +523,10 @@ unsigned int sleep(unsigned int seconds) {
   // 以泡面店为例，每个线程都是一个工作人员，如果使用标准库的sleep，
   // 工作人员一次只能泡一份泡面，只能干等着，但是使用定时器的方式可以同时操作多份
   // 定时器到时会通知工作人员，工作人员对泡好的泡面做下一步动作即可，没必要干等着
+  spadger::Clock::Refresh(); // 缓存的时间可能是任务开始时的 从现在算
   spadger::Fiber::ptr fiber = spadger::Fiber::GetThis();
   spadger::IOManager *iom = spadger::IOManager::GetThis();
-  iom->addTimer(seconds * 1000,
-                std::bind((void (spadger::IOManager::*)(spadger::Fiber::ptr,
-                                                        int thread)) &
-                              spadger::IOManager::schedule,
-                          iom, fiber, -1));
+  iom->addTimer(seconds * 1000, [iom, fiber]() { iom->schedule(fiber); });
   spadger::Fiber::YieldToHold();
   return 0;
 }
@@ -195,12 +535,11 @@ int usleep(useconds_t usec) {
   if (!spadger::t_hook_enable) {
     return usleep_f(usec);
   }
+  // 按微秒加定时器 usleep(500)不会变成0
+  spadger::Clock::Refresh();
   spadger::Fiber::ptr fiber = spadger::Fiber::GetThis();
   spadger::IOManager *iom = spadger::IOManager::GetThis();
-  iom->addTimer(usec / 1000, std::bind((void (spadger::IOManager::*)(
-                                           spadger::Fiber::ptr, int thread)) &
-                                           spadger::IOManager::schedule,
-                                       iom, fiber, -1));
+  iom->addTimerUS(usec, [iom, fiber]() { iom->schedule(fiber); });
   spadger::Fiber::YieldToHold();
   return 0;
 }
@@ -209,11 +548,16 @@ int nanosleep(const struct timespec *req, struct timespec *rem) {
   if (!spadger::t_hook_enable) {
     return nanosleep_f(req, rem);
   }
-  // 计算毫秒数
-  uint64_t timeout_ms = req->tv_sec * 1000 + req->tv_nsec / 1000 * 1000;
+  if (req->tv_sec < 0 || req->tv_nsec < 0 || req->tv_nsec >= 1000000000) {
+    errno = EINVAL;
+    return -1;
+  }
+  // 计算微秒数 不足1us的向上取整 不能睡得比要求的短
+  uint64_t timeout_us = req->tv_sec * 1000000ull + (req->tv_nsec + 999) / 1000;
+  spadger::Clock::Refresh();
   spadger::Fiber::ptr fiber = spadger::Fiber::GetThis();
   spadger::IOManager *iom = spadger::IOManager::GetThis();
-  iom->addTimer(timeout_ms, [iom, fiber]() { iom->schedule(fiber); });
+  iom->addTimerUS(timeout_us, [iom, fiber]() { iom->schedule(fiber); });
   spadger::Fiber::YieldToHold();
   return 0;
 }
@@ -227,7 +571,7 @@ int socket(int domain, int type, int protocol) {
     return fd;
   }
   // 下面设置fd的属性(比如有么有timeout isSocket) 方便之后使用啊
-  spadger::FdMgr::GetInstance()->get(fd, true);
+  new_fd_ctx(fd);
   return fd;
 }
 
@@ -236,7 +580,7 @@ int connect_with_timeout(int fd, const struct sockaddr *addr, socklen_t addrlen,
   if (!spadger::t_hook_enable) {
     return connect_f(fd, addr, addrlen);
   }
-  spadger::FdCtx::ptr ctx = spadger::FdMgr::GetInstance()->get(fd);
+  spadger::FdCtx *ctx = spadger::FdMgr::GetInstance()->get(fd);
   if (!ctx || ctx->isClose()) {
     errno = EBADF;
     return -1;
@@ -250,6 +594,17 @@ int connect_with_timeout(int fd, const struct sockaddr *addr, socklen_t addrlen,
     return connect_f(fd, addr, addrlen);
   }
 
+  spadger::IOManager *iom = spadger::IOManager::GetThis();
+  // io_uring可以把发起连接和等待连接完成合成一次提交
+  if (iom->hasUring()) {
+    spadger::UringIo uio = uring_io(IORING_OP_CONNECT, addr, 0, 0);
+    uio.off = addrlen;
+    int res = 0;
+    if (iom->submitIo(fd, uio, timeout_ms, res)) {
+      return uring_result(res);
+    }
+  }
+
   // 开始连接
   int n = connect_f(fd, addr, addrlen);
   // 如果连接成功直接返回
@@ -262,38 +617,21 @@ int connect_with_timeout(int fd, const struct sockaddr *addr, socklen_t addrlen,
   // 之后Tield让出线程 干别的事情去吧
   // 1. 如果有事件发生 说明连接成功 回到这里检查返回
   // 2. 如果超时 timer会通知你的 需要返回-1 (超时是真没办法了)
-  spadger::IOManager *iom = spadger::IOManager::GetThis();
-  spadger::Timer::ptr timer;
-  std::shared_ptr<timer_info> tinfo(new timer_info);
-  std::weak_ptr<timer_info> winfo(tinfo);
-
+  uint64_t seq = 0;
   if (timeout_ms != (uint64_t)-1) {
-    timer = iom->addConditionTimer(
-        timeout_ms,
-        [winfo, fd, iom]() {
-          auto t = winfo.lock();
-          if (!t || t->cancelled) {
-            return;
-          }
-          t->cancelled = ETIMEDOUT;
-          iom->cancelEvent(fd, spadger::IOManager::WRITE);
-        },
-        winfo);
+    seq = wait_timeout(iom, ctx, fd, spadger::IOManager::WRITE, timeout_ms);
   }
 
   int rt = iom->addEvent(fd, spadger::IOManager::WRITE);
   if (rt == 0) {
     spadger::Fiber::YieldToHold();
-    if (timer) {
-      timer->cancel();
-    }
-    if (tinfo->cancelled) {
-      errno = tinfo->cancelled;
+    if (seq && wait_timedout(seq)) {
+      fiber_errno() = ETIMEDOUT;
       return -1;
     }
   } else {
-    if (timer) {
-      timer->cancel();
+    if (seq) {
+      wait_timedout(seq);
     }
     SPADGER_LOG_ERROR(g_logger)
         << "connect addEvent(" << fd << ", WRITE) error";
@@ -307,7 +645,7 @@ int connect_with_timeout(int fd, const struct sockaddr *addr, socklen_t addrlen,
   if (!error) {
     return 0;
   } else {
-    errno = error;
+    fiber_errno() = error;
     return -1;
   }
 }
@@ -318,81 +656,470 @@ int connect(int sockfd, const struct sockaddr *addr, socklen_t addrlen) {
 }
 
 int accept(int sockfd, struct sockaddr *addr, socklen_t *addrlen) {
+  spadger::UringIo uio = uring_io(IORING_OP_ACCEPT, addr, 0, 0);
+  uio.off = (uint64_t)addrlen;
   int fd = do_io(sockfd, accept_f, "accept", spadger::IOManager::READ,
-                 SO_RCVTIMEO, addr, addrlen); // addr addrlen原有参数不变
+                 SO_RCVTIMEO, &uio, nullptr, addr, addrlen); // addr addrlen原有参数不变
+  if (fd >= 0) {
+    new_fd_ctx(fd);
+  }
+  return fd;
+}
+
+int accept4(int sockfd, struct sockaddr *addr, socklen_t *addrlen, int flags) {
+  spadger::UringIo uio = uring_io(IORING_OP_ACCEPT, addr, 0, flags);
+  uio.off = (uint64_t)addrlen;
+  int fd = do_io(sockfd, accept4_f, "accept4", spadger::IOManager::READ,
+                 SO_RCVTIMEO, &uio, nullptr, addr, addrlen, flags);
   if (fd >= 0) {
-    spadger::FdMgr::GetInstance()->get(fd, true);
+    spadger::FdCtx *ctx = new_fd_ctx(fd);
+    if (ctx && (flags & SOCK_NONBLOCK)) {
+      ctx->setUserNonblock(true);
+    }
   }
   return fd;
 }
 
 ssize_t read(int fd, void *buf, size_t count) {
-  return do_io(fd, read_f, "read", spadger::IOManager::READ, SO_RCVTIMEO, buf,
-               count);
+  // socket用RECV 普通文件从当前位置READ(off=-1)
+  spadger::UringIo uio = uring_io(IORING_OP_RECV, buf, count, 0);
+  spadger::UringIo fio = uring_io(IORING_OP_READ, buf, count, 0);
+  fio.off = -1;
+  return do_io(fd, read_f, "read", spadger::IOManager::READ, SO_RCVTIMEO, &uio,
+               &fio, buf, count);
 }
 
 ssize_t readv(int fd, const struct iovec *iov, int iovcnt) {
-  return do_io(fd, readv_f, "readv", spadger::IOManager::READ, SO_RCVTIMEO, iov,
-               iovcnt);
+  msghdr msg = {};
+  msg.msg_iov = (iovec *)iov;
+  msg.msg_iovlen = iovcnt;
+  spadger::UringIo uio = uring_io(IORING_OP_RECVMSG, &msg, 1, 0);
+  spadger::UringIo fio = uring_io(IORING_OP_READV, iov, iovcnt, 0);
+  fio.off = -1;
+  return do_io(fd, readv_f, "readv", spadger::IOManager::READ, SO_RCVTIMEO,
+               &uio, &fio, iov, iovcnt);
 }
 
 ssize_t recv(int sockfd, void *buf, size_t len, int flags) {
-  //   return recv_f(sockfd, buf, len, flags);
+  spadger::UringIo uio = uring_io(IORING_OP_RECV, buf, len, flags);
   return do_io(sockfd, recv_f, "recv", spadger::IOManager::READ, SO_RCVTIMEO,
-               buf, len, flags);
+               &uio, nullptr, buf, len, flags);
 }
 
 ssize_t recvfrom(int sockfd, void *buf, size_t len, int flags,
                  struct sockaddr *src_addr, socklen_t *addrlen) {
-  return do_io(sockfd, recvfrom_f, "recvfrom", spadger::IOManager::READ,
-               SO_RCVTIMEO, buf, len, flags, src_addr, addrlen);
+  iovec iov = {buf, len};
+  msghdr msg = {};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  if (src_addr && addrlen) {
+    msg.msg_name = src_addr;
+    msg.msg_namelen = *addrlen;
+  }
+  spadger::UringIo uio = uring_io(IORING_OP_RECVMSG, &msg, 1, flags);
+  ssize_t n = do_io(sockfd, recvfrom_f, "recvfrom", spadger::IOManager::READ,
+                    SO_RCVTIMEO, &uio, nullptr, buf, len, flags, src_addr,
+                    addrlen);
+  if (n >= 0 && uio.used && src_addr && addrlen) {
+    *addrlen = msg.msg_namelen;
+  }
+  return n;
 }
 
 ssize_t recvmsg(int sockfd, struct msghdr *msg, int flags) {
+  spadger::UringIo uio = uring_io(IORING_OP_RECVMSG, msg, 1, flags);
   return do_io(sockfd, recvmsg_f, "recvmsg", spadger::IOManager::READ,
-               SO_RCVTIMEO, msg, flags);
+               SO_RCVTIMEO, &uio, nullptr, msg, flags);
 }
+
+/**
+ * @brief 一次收多个报文 至少收到一个才返回(没有就让出等)
+ *        和原版一样 没有MSG_WAITFORONE时要收满vlen个 timeout在每收到一个之后检查
+ */
+int recvmmsg(int sockfd, struct mmsghdr *msgvec, unsigned int vlen, int flags,
+             struct timespec *timeout) {
+  // 原版的timeout只在收到报文之后检查 这里自己算 不交给内核
+  int n = do_io(sockfd, recvmmsg_f, "recvmmsg", spadger::IOManager::READ,
+                SO_RCVTIMEO, nullptr, nullptr, msgvec, vlen, flags,
+                (struct timespec *)nullptr);
+  if (n <= 0 || (unsigned int)n >= vlen ||
+      (flags & (MSG_WAITFORONE | MSG_DONTWAIT)) || !hooked_blocking(sockfd)) {
+    return n;
+  }
+  uint64_t deadline = 0;
+  if (timeout) {
+    deadline = spadger::Clock::ReadUS() + timeout->tv_sec * 1000000ull +
+               timeout->tv_nsec / 1000;
+  }
+  while ((unsigned int)n < vlen &&
+         (!timeout || spadger::Clock::ReadUS() < deadline)) {
+    int rt = do_io(sockfd, recvmmsg_f, "recvmmsg", spadger::IOManager::READ,
+                   SO_RCVTIMEO, nullptr, nullptr, msgvec + n, vlen - n, flags,
+                   (struct timespec *)nullptr);
+    if (rt <= 0) {
+      break; // 已经收到的先返回 错误留给下一次调用
+    }
+    n += rt;
+  }
+  if (timeout) {
+    uint64_t now = spadger::Clock::ReadUS();
+    uint64_t left = now >= deadline ? 0 : deadline - now;
+    timeout->tv_sec = left / 1000000;
+    timeout->tv_nsec = left % 1000000 * 1000;
+  }
+  return n;
+}
+
 ssize_t write(int fd, const void *buf, size_t count) {
+  spadger::UringIo uio = uring_io(IORING_OP_SEND, buf, count, 0);
+  spadger::UringIo fio = uring_io(IORING_OP_WRITE, buf, count, 0);
+  fio.off = -1;
   return do_io(fd, write_f, "write", spadger::IOManager::WRITE, SO_SNDTIMEO,
-               buf, count);
+               &uio, &fio, buf, count);
 }
 
 ssize_t writev(int fd, const struct iovec *iov, int iovcnt) {
+  msghdr msg = {};
+  msg.msg_iov = (iovec *)iov;
+  msg.msg_iovlen = iovcnt;
+  spadger::UringIo uio = uring_io(IORING_OP_SENDMSG, &msg, 1, 0);
+  spadger::UringIo fio = uring_io(IORING_OP_WRITEV, iov, iovcnt, 0);
+  fio.off = -1;
   return do_io(fd, writev_f, "writev", spadger::IOManager::WRITE, SO_SNDTIMEO,
-               iov, iovcnt);
+               &uio, &fio, iov, iovcnt);
 }
 
 ssize_t send(int s, const void *msg, size_t len, int flags) {
-  return do_io(s, send_f, "send", spadger::IOManager::WRITE, SO_SNDTIMEO, msg,
-               len, flags);
+  spadger::UringIo uio = uring_io(IORING_OP_SEND, msg, len, flags);
+  return do_io(s, send_f, "send", spadger::IOManager::WRITE, SO_SNDTIMEO, &uio,
+               nullptr, msg, len, flags);
 }
 
 ssize_t sendto(int s, const void *msg, size_t len, int flags,
                const struct sockaddr *to, socklen_t tolen) {
+  iovec iov = {(void *)msg, len};
+  msghdr hdr = {};
+  hdr.msg_iov = &iov;
+  hdr.msg_iovlen = 1;
+  hdr.msg_name = (void *)to;
+  hdr.msg_namelen = to ? tolen : 0;
+  spadger::UringIo uio = uring_io(IORING_OP_SENDMSG, &hdr, 1, flags);
   return do_io(s, sendto_f, "sendto", spadger::IOManager::WRITE, SO_SNDTIMEO,
-               msg, len, flags, to, tolen);
+               &uio, nullptr, msg, len, flags, to, tolen);
 }
 
 ssize_t sendmsg(int s, const struct msghdr *msg, int flags) {
+  spadger::UringIo uio = uring_io(IORING_OP_SENDMSG, msg, 1, flags);
   return do_io(s, sendmsg_f, "sendmsg", spadger::IOManager::WRITE, SO_SNDTIMEO,
-               msg, flags);
+               &uio, nullptr, msg, flags);
 }
-int close(int fd) {
-  if (!spadger::t_hook_enable) {
-    return close_f(fd);
+
+// 一次发多个报文 和阻塞的原版一样全部发完才返回 中途出错返回已经发了的个数
+int sendmmsg(int s, struct mmsghdr *msgvec, unsigned int vlen, int flags) {
+  int n = do_io(s, sendmmsg_f, "sendmmsg", spadger::IOManager::WRITE,
+                SO_SNDTIMEO, nullptr, nullptr, msgvec, vlen, flags);
+  if (n <= 0 || (flags & MSG_DONTWAIT) || !hooked_blocking(s)) {
+    return n;
+  }
+  while ((unsigned int)n < vlen) {
+    int rt = do_io(s, sendmmsg_f, "sendmmsg", spadger::IOManager::WRITE,
+                   SO_SNDTIMEO, nullptr, nullptr, msgvec + n, vlen - n, flags);
+    if (rt <= 0) {
+      break;
+    }
+    n += rt;
   }
+  return n;
+}
+
+// ========================  零拷贝 ===========================
+
+// out_fd是socket的时候发不动就让出 in_fd(普通文件)还是直接读
+ssize_t sendfile(int out_fd, int in_fd, off_t *offset, size_t count) {
+  return do_io(out_fd, sendfile_f, "sendfile", spadger::IOManager::WRITE,
+               SO_SNDTIMEO, nullptr, nullptr, in_fd, offset, count);
+}
+
+ssize_t splice(int fd_in, loff_t *off_in, int fd_out, loff_t *off_out,
+               size_t len, unsigned int flags) {
+  return do_splice(fd_in, fd_out, flags, "splice", [=](unsigned int f) {
+    return splice_f(fd_in, off_in, fd_out, off_out, len, f);
+  });
+}
+
+ssize_t tee(int fd_in, int fd_out, size_t len, unsigned int flags) {
+  return do_splice(fd_in, fd_out, flags, "tee", [=](unsigned int f) {
+    return tee_f(fd_in, fd_out, len, f);
+  });
+}
+
+int close(int fd) {
   // 先取消iom的设置和FdManager中的设置
-  spadger::FdCtx::ptr ctx = spadger::FdMgr::GetInstance()->get(fd);
+  // hook关着(比如main线程里析构Socket)也要做 不然同号的新fd拿到的是旧记录
+  spadger::FdCtx *ctx = spadger::FdMgr::GetInstance()->get(fd);
   if (ctx) {
     auto iom = spadger::IOManager::GetThis();
     if (iom) {
       iom->cancelAll(fd);
+      iom->cancelIo(fd);
     }
     spadger::FdMgr::GetInstance()->del(fd);
   }
   return close_f(fd);
 }
 
+// open/openat: 打开之后建FdCtx 之后的读写才知道是普通文件
+static int do_openat(int dirfd, const char *pathname, int flags, mode_t mode) {
+  spadger::UringIo fio = uring_io(IORING_OP_OPENAT, pathname, mode, flags);
+  int fd = file_io(dirfd, openat_f, fio, pathname, flags, mode);
+  if (fd >= 0) {
+    new_fd_ctx(fd);
+  }
+  return fd;
+}
+
+// O_CREAT/O_TMPFILE时才有第三个参数
+static mode_t open_mode(int flags, va_list va) {
+  if ((flags & O_CREAT) || (flags & O_TMPFILE) == O_TMPFILE) {
+    return va_arg(va, mode_t);
+  }
+  return 0;
+}
+
+int open(const char *pathname, int flags, ...) {
+  va_list va;
+  va_start(va, flags);
+  mode_t mode = open_mode(flags, va);
+  va_end(va);
+  if (!spadger::t_hook_enable || !spadger::s_file_async) {
+    return open_f(pathname, flags, mode);
+  }
+  return do_openat(AT_FDCWD, pathname, flags, mode);
+}
+
+int openat(int dirfd, const char *pathname, int flags, ...) {
+  va_list va;
+  va_start(va, flags);
+  mode_t mode = open_mode(flags, va);
+  va_end(va);
+  if (!spadger::t_hook_enable || !spadger::s_file_async) {
+    return openat_f(dirfd, pathname, flags, mode);
+  }
+  return do_openat(dirfd, pathname, flags, mode);
+}
+
+ssize_t pread(int fd, void *buf, size_t count, off_t offset) {
+  if (!file_ctx(fd)) {
+    return pread_f(fd, buf, count, offset);
+  }
+  spadger::UringIo fio = uring_io(IORING_OP_READ, buf, count, 0);
+  fio.off = offset;
+  return file_io(fd, pread_f, fio, buf, count, offset);
+}
+
+ssize_t pwrite(int fd, const void *buf, size_t count, off_t offset) {
+  if (!file_ctx(fd)) {
+    return pwrite_f(fd, buf, count, offset);
+  }
+  spadger::UringIo fio = uring_io(IORING_OP_WRITE, buf, count, 0);
+  fio.off = offset;
+  return file_io(fd, pwrite_f, fio, buf, count, offset);
+}
+
+int fsync(int fd) {
+  if (!file_ctx(fd)) {
+    return fsync_f(fd);
+  }
+  spadger::UringIo fio = uring_io(IORING_OP_FSYNC, nullptr, 0, 0);
+  return file_io(fd, fsync_f, fio);
+}
+
+int fdatasync(int fd) {
+  if (!file_ctx(fd)) {
+    return fdatasync_f(fd);
+  }
+  spadger::UringIo fio =
+      uring_io(IORING_OP_FSYNC, nullptr, 0, IORING_FSYNC_DATASYNC);
+  return file_io(fd, fdatasync_f, fio);
+}
+
+// 还剩多少毫秒 timeout_ms < 0 一直等
+static int remain_ms(int timeout_ms, uint64_t begin) {
+  if (timeout_ms < 0) {
+    return -1;
+  }
+  uint64_t used = (spadger::Clock::ReadUS() - begin) / 1000;
+  return used >= (uint64_t)timeout_ms ? 0 : timeout_ms - (int)used;
+}
+
+/**
+ * @brief 协程里的poll: 先不等看一次 没有就绪的话把这些fd放进一个临时的epoll
+ *        IOManager等这个epoll fd可读(或者超时) 醒来再poll一次拿结果
+ *        用单独的epoll 不会和别的协程在同一个fd上的等待冲突 什么fd都能等
+ */
+int poll(struct pollfd *fds, nfds_t nfds, int timeout) {
+  spadger::IOManager *iom = spadger::IOManager::GetThis();
+  if (!spadger::t_hook_enable || !iom || timeout == 0) {
+    return poll_f(fds, nfds, timeout);
+  }
+  int n = poll_f(fds, nfds, 0);
+  if (n != 0) {
+    return n;
+  }
+  int epfd = epoll_create1(EPOLL_CLOEXEC);
+  if (epfd < 0) {
+    return poll_f(fds, nfds, timeout);
+  }
+  new_fd_ctx(epfd);
+  for (nfds_t i = 0; i < nfds; ++i) {
+    if (fds[i].fd < 0) {
+      continue;
+    }
+    // POLLxx和EPOLLxx的值是一样的
+    const short mask = POLLIN | POLLPRI | POLLOUT | POLLRDNORM | POLLRDBAND |
+                       POLLWRNORM | POLLWRBAND | POLLRDHUP;
+    epoll_event event;
+    event.events = fds[i].events & mask;
+    event.data.u64 = i;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, fds[i].fd, &event) &&
+        errno == EEXIST) {
+      // 同一个fd出现了多次 合并前面几项要的事件
+      // 不能多等 否则没人要的事件就绪会让epfd一直可读 poll结果却是0 空转
+      for (nfds_t j = 0; j < i; ++j) {
+        if (fds[j].fd == fds[i].fd) {
+          event.events |= fds[j].events & mask;
+        }
+      }
+      epoll_ctl(epfd, EPOLL_CTL_MOD, fds[i].fd, &event);
+    }
+  }
+  uint64_t begin = spadger::Clock::ReadUS();
+  while (true) {
+    int rt = wait_event(iom, epfd, spadger::IOManager::READ,
+                        remain_ms(timeout, begin));
+    if (rt < 0) {
+      n = poll_f(fds, nfds, remain_ms(timeout, begin));
+      break;
+    }
+    n = poll_f(fds, nfds, 0);
+    if (n != 0 || rt == 0 || remain_ms(timeout, begin) == 0) {
+      break;
+    }
+  }
+  int error = fiber_errno();
+  close(epfd);
+  fiber_errno() = error;
+  return n;
+}
+
+int select(int nfds, fd_set *readfds, fd_set *writefds, fd_set *exceptfds,
+           struct timeval *timeout) {
+  spadger::IOManager *iom = spadger::IOManager::GetThis();
+  if (!spadger::t_hook_enable || !iom || nfds < 0 || nfds > FD_SETSIZE ||
+      (timeout && !timeout->tv_sec && !timeout->tv_usec)) {
+    return select_f(nfds, readfds, writefds, exceptfds, timeout);
+  }
+  if (timeout && (timeout->tv_sec < 0 || timeout->tv_usec < 0)) {
+    errno = EINVAL;
+    return -1;
+  }
+  // 转成pollfd 同样的等待方式
+  std::vector<pollfd> fds;
+  for (int fd = 0; fd < nfds; ++fd) {
+    short events = 0;
+    if (readfds && FD_ISSET(fd, readfds)) {
+      events |= POLLIN;
+    }
+    if (writefds && FD_ISSET(fd, writefds)) {
+      events |= POLLOUT;
+    }
+    if (exceptfds && FD_ISSET(fd, exceptfds)) {
+      events |= POLLPRI;
+    }
+    if (events) {
+      pollfd pfd = {fd, events, 0};
+      fds.push_back(pfd);
+    }
+  }
+  int timeout_ms = -1;
+  uint64_t begin = spadger::Clock::ReadUS();
+  if (timeout) {
+    uint64_t ms = timeout->tv_sec * 1000ull + (timeout->tv_usec + 999) / 1000;
+    timeout_ms = (int)std::min(ms, (uint64_t)INT_MAX);
+  }
+  int n = poll(fds.data(), fds.size(), timeout_ms);
+  if (n < 0) {
+    return n;
+  }
+  // 和select一样: 有无效的fd返回EBADF 否则把集合改成就绪的那些
+  for (auto &pfd : fds) {
+    if (pfd.revents & POLLNVAL) {
+      fiber_errno() = EBADF;
+      return -1;
+    }
+  }
+  n = 0;
+  for (auto &pfd : fds) {
+    if (readfds && FD_ISSET(pfd.fd, readfds)) {
+      if (pfd.revents & (POLLIN | POLLHUP | POLLERR)) {
+        ++n;
+      } else {
+        FD_CLR(pfd.fd, readfds);
+      }
+    }
+    if (writefds && FD_ISSET(pfd.fd, writefds)) {
+      if (pfd.revents & (POLLOUT | POLLERR)) {
+        ++n;
+      } else {
+        FD_CLR(pfd.fd, writefds);
+      }
+    }
+    if (exceptfds && FD_ISSET(pfd.fd, exceptfds)) {
+      if (pfd.revents & POLLPRI) {
+        ++n;
+      } else {
+        FD_CLR(pfd.fd, exceptfds);
+      }
+    }
+  }
+  // Linux的select会把timeout改成剩下的时间
+  if (timeout) {
+    uint64_t used = spadger::Clock::ReadUS() - begin;
+    uint64_t total = timeout->tv_sec * 1000000ull + timeout->tv_usec;
+    uint64_t left = used >= total ? 0 : total - used;
+    timeout->tv_sec = left / 1000000;
+    timeout->tv_usec = left % 1000000;
+  }
+  return n;
+}
+
+// 用户自己的epoll fd: 让IOManager等它可读 醒来再不等地取一次
+int epoll_wait(int epfd, struct epoll_event *events, int maxevents,
+               int timeout) {
+  spadger::IOManager *iom = spadger::IOManager::GetThis();
+  if (!spadger::t_hook_enable || !iom || timeout == 0) {
+    return epoll_wait_f(epfd, events, maxevents, timeout);
+  }
+  uint64_t begin = spadger::Clock::ReadUS();
+  while (true) {
+    int n = epoll_wait_f(epfd, events, maxevents, 0);
+    if (n != 0) {
+      return n;
+    }
+    int left = remain_ms(timeout, begin);
+    if (left == 0) {
+      return 0;
+    }
+    int rt = wait_event(iom, epfd, spadger::IOManager::READ, left);
+    if (rt < 0) {
+      return epoll_wait_f(epfd, events, maxevents, remain_ms(timeout, begin));
+    }
+    if (rt == 0) {
+      return epoll_wait_f(epfd, events, maxevents, 0);
+    }
+  }
+}
+
 int fcntl(int fd, int cmd, ... /* arg */) {
   if (!spadger::t_hook_enable) {
     return fcntl_f(fd, cmd);
@@ -404,7 +1131,7 @@ int fcntl(int fd, int cmd, ... /* arg */) {
   case F_SETFL: {
     int arg = va_arg(va, int);
     va_end(va);
-    spadger::FdCtx::ptr ctx = spadger::FdMgr::GetInstance()->get(fd);
+    spadger::FdCtx *ctx = spadger::FdMgr::GetInstance()->get(fd);
     if (!ctx || ctx->isClose() || !ctx->isSocket()) {
       return fcntl_f(fd, cmd, arg);
     }
@@ -422,7 +1149,7 @@ int fcntl(int fd, int cmd, ... /* arg */) {
   case F_GETFL: {
     va_end(va);
     int arg = fcntl_f(fd, cmd);
-    spadger::FdCtx::ptr ctx = spadger::FdMgr::GetInstance()->get(fd);
+    spadger::FdCtx *ctx = spadger::FdMgr::GetInstance()->get(fd);
     if (!ctx || ctx->isClose() || !ctx->isSocket()) {
       return arg;
     }
@@ -482,7 +1209,7 @@ int ioctl(int fd, unsigned long request, ...) {
 
   if (request == FIONBIO) {
     bool user_nonblock = !!*(int *)arg; // 转变为0/1
-    spadger::FdCtx::ptr ctx = spadger::FdMgr::GetInstance()->get(fd);
+    spadger::FdCtx *ctx = spadger::FdMgr::GetInstance()->get(fd);
     if (!ctx || ctx->isClose() || !ctx->isSocket()) {
       return ioctl_f(fd, request, arg);
     }
@@ -503,7 +1230,7 @@ int setsockopt(int sockfd, int level, int optname, const void *optval,
   // 我们只负责socket的设置
   if (level == SOL_SOCKET) {
     if (optname == SO_RCVTIMEO || optname == SO_SNDTIMEO) {
-      spadger::FdCtx::ptr ctx = spadger::FdMgr::GetInstance()->get(sockfd);
+      spadger::FdCtx *ctx = spadger::FdMgr::GetInstance()->get(sockfd);
       if (ctx) {
         const timeval *tv = (const timeval *)optval;
         ctx->setTimeout(optname, tv->tv_sec * 1000 + tv->tv_usec / 1000);
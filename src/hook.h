@@ -7,8 +7,13 @@
 #ifndef __SPADGER_HOOK_H__
 #define __SPADGER_HOOK_H__
 #include <fcntl.h>
+#include <ostream>
+#include <poll.h>
 #include <stdint.h>
+#include <sys/epoll.h>
 #include <sys/ioctl.h>
+#include <sys/select.h>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <unistd.h>
@@ -16,6 +21,29 @@
 namespace spadger {
 bool is_hook_enable();
 void set_hook_enable(bool flag);
+
+// 协程里普通文件的调用(open/read/write/fsync...)交给io_uring
+// 没有io_uring时交给OffloadPool 不占着IOManager的线程等磁盘
+// 下面是每类调用的统计 用来看文件IO有多慢 有多少走了哪条路
+// 单个fd不想异步: FdMgr::GetInstance()->get(fd)->setFileAsync(false)
+enum FileIoOp {
+  FILE_IO_OPEN = 0,
+  FILE_IO_READ,  // read readv pread
+  FILE_IO_WRITE, // write writev pwrite
+  FILE_IO_SYNC,  // fsync fdatasync
+  FILE_IO_OP_COUNT
+};
+struct FileIoStats {
+  uint64_t calls = 0;
+  uint64_t uring = 0;   // 走io_uring的次数
+  uint64_t offload = 0; // 走OffloadPool的次数 剩下的是直接调用的
+  uint64_t errors = 0;
+  uint64_t bytes = 0;   // 读写的字节数
+  uint64_t totalUS = 0; // 调用总耗时(包括排队)
+  uint64_t maxUS = 0;
+};
+FileIoStats get_file_io_stats(FileIoOp op);
+std::ostream &dump_file_io_stats(std::ostream &os);
 } // namespace spadger
 
 extern "C" {
@@ -45,6 +73,10 @@ typedef int (*accept_fun)(int sockfd, struct sockaddr *addr,
                           socklen_t *addrlen);
 extern accept_fun accept_f;
 
+typedef int (*accept4_fun)(int sockfd, struct sockaddr *addr,
+                           socklen_t *addrlen, int flags);
+extern accept4_fun accept4_f;
+
 typedef ssize_t (*read_fun)(int fd, void *buf, size_t count);
 extern read_fun read_f;
 
@@ -61,6 +93,11 @@ extern recvfrom_fun recvfrom_f;
 typedef ssize_t (*recvmsg_fun)(int sockfd, struct msghdr *msg, int flags);
 extern recvmsg_fun recvmsg_f;
 
+typedef int (*recvmmsg_fun)(int sockfd, struct mmsghdr *msgvec,
+                            unsigned int vlen, int flags,
+                            struct timespec *timeout);
+extern recvmmsg_fun recvmmsg_f;
+
 typedef ssize_t (*write_fun)(int fd, const void *buf, size_t count);
 extern write_fun write_f;
 
@@ -78,9 +115,62 @@ extern sendto_fun sendto_f;
 typedef ssize_t (*sendmsg_fun)(int sockfd, const struct msghdr *msg, int flags);
 extern sendmsg_fun sendmsg_f;
 
+typedef int (*sendmmsg_fun)(int sockfd, struct mmsghdr *msgvec,
+                            unsigned int vlen, int flags);
+extern sendmmsg_fun sendmmsg_f;
+
+// 零拷贝: 至少有一头是socket或者管道
+typedef ssize_t (*sendfile_fun)(int out_fd, int in_fd, off_t *offset,
+                                size_t count);
+extern sendfile_fun sendfile_f;
+
+typedef ssize_t (*splice_fun)(int fd_in, loff_t *off_in, int fd_out,
+                              loff_t *off_out, size_t len, unsigned int flags);
+extern splice_fun splice_f;
+
+typedef ssize_t (*tee_fun)(int fd_in, int fd_out, size_t len,
+                           unsigned int flags);
+extern tee_fun tee_f;
+
 typedef int (*close_fun)(int fd);
 extern close_fun close_f;
 
+// ========================  普通文件 ===========================
+
+typedef int (*open_fun)(const char *pathname, int flags, ...);
+extern open_fun open_f;
+
+typedef int (*openat_fun)(int dirfd, const char *pathname, int flags, ...);
+extern openat_fun openat_f;
+
+typedef ssize_t (*pread_fun)(int fd, void *buf, size_t count, off_t offset);
+extern pread_fun pread_f;
+
+typedef ssize_t (*pwrite_fun)(int fd, const void *buf, size_t count,
+                              off_t offset);
+extern pwrite_fun pwrite_f;
+
+typedef int (*fsync_fun)(int fd);
+extern fsync_fun fsync_f;
+
+typedef int (*fdatasync_fun)(int fd);
+extern fdatasync_fun fdatasync_f;
+
+// ========================  多路复用 ===========================
+// 第三方库(数据库/缓存的客户端)自己poll它的socket 在协程里改成让出等待
+// IOManager内部等事件必须用下面的_f版本
+
+typedef int (*poll_fun)(struct pollfd *fds, nfds_t nfds, int timeout);
+extern poll_fun poll_f;
+
+typedef int (*select_fun)(int nfds, fd_set *readfds, fd_set *writefds,
+                          fd_set *exceptfds, struct timeval *timeout);
+extern select_fun select_f;
+
+typedef int (*epoll_wait_fun)(int epfd, struct epoll_event *events,
+                              int maxevents, int timeout);
+extern epoll_wait_fun epoll_wait_f;
+
 typedef int (*fcntl_fun)(int fd, int cmd, ... /* arg */);
 extern fcntl_fun fcntl_f;
 
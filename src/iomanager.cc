@@ -1,38 +1,92 @@
 #include "iomanager.h"
+#include "clock.h"
+#include "config.h"
+#include "hook.h"
 #include "log.h"
+#include <algorithm>
 #include <errno.h>
 #include <fcntl.h>
 #include <string.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
 #include <unistd.h>
 namespace spadger {
 
 static spadger::Logger::ptr g_logger = SPADGER_LOG_NAME("system");
 
-IOManager::FdContext::EventContext &
-IOManager::FdContext::getContext(IOManager::Event event) {
+static ConfigVar<std::string>::ptr g_iomanager_backend =
+    Config::Lookup<std::string>("iomanager.backend", "epoll",
+                                "io backend: epoll or io_uring");
+static ConfigVar<bool>::ptr g_epoll_persistent = Config::Lookup<bool>(
+    "iomanager.epoll.persistent", false,
+    "keep fds registered (edge-triggered) in epoll until close");
+static ConfigVar<uint32_t>::ptr g_uring_entries = Config::Lookup<uint32_t>(
+    "iomanager.uring.entries", 256, "io_uring submission queue size");
+static ConfigVar<bool>::ptr g_uring_cancel_fd = Config::Lookup<bool>(
+    "iomanager.uring.cancel_fd", true,
+    "cancel by fd on close when the kernel supports it (5.19+), "
+    "otherwise cancel each tracked request");
+
+// poller最多睡多久(us) 停着的线程有定时器时也一样
+static const uint64_t MAX_TIMEOUT = 3000 * 1000;
+static std::atomic<uint32_t> s_iomanager_id = {0};
+
+#ifndef SYS_epoll_pwait2
+#define SYS_epoll_pwait2 441
+#endif
+
+// epoll_wait等timeout_us微秒(~0ull一直等)
+// epoll_wait被hook了 这里要用原版的 不然poller自己会让出
+// 内核支持epoll_pwait2(5.11以后)就精确到微秒 否则向上取整到毫秒
+static int EpollWait(int epfd, epoll_event *events, int maxevents,
+                     uint64_t timeout_us) {
+  // 所有工作线程都会读写 不支持时只会从true变成false 不需要更强的顺序
+  static std::atomic<bool> s_pwait2 = {true};
+  if (timeout_us == ~0ull) {
+    return epoll_wait_f(epfd, events, maxevents, -1);
+  }
+  if (timeout_us % 1000 && s_pwait2.load(std::memory_order_relaxed)) {
+    struct timespec ts;
+    ts.tv_sec = timeout_us / 1000000;
+    ts.tv_nsec = timeout_us % 1000000 * 1000;
+    int rt = syscall(SYS_epoll_pwait2, epfd, events, maxevents, &ts, nullptr, 0);
+    if (rt >= 0 || errno != ENOSYS) {
+      return rt;
+    }
+    s_pwait2.store(false, std::memory_order_relaxed);
+  }
+  return epoll_wait_f(epfd, events, maxevents,
+                      (int)((timeout_us + 999) / 1000));
+}
+
+FdCtx::EventContext &IOManager::getContext(FdCtx *fd_ctx, Event event) {
   switch (event) {
   case IOManager::READ:
-    return read;
+    return fd_ctx->m_read;
   case IOManager::WRITE:
-    return write;
+    return fd_ctx->m_write;
   default:
     SPADGER_ASSERT2(false, "getContext");
   }
   throw std::invalid_argument("getContext invalid event");
 }
-void IOManager::FdContext::resetContext(
-    IOManager::FdContext::EventContext &ctx) {
+uint64_t IOManager::EpollData(FdCtx *fd_ctx) {
+  return (uint64_t)fd_ctx->getGeneration() << 32 | (uint32_t)fd_ctx->m_fd;
+}
+
+void IOManager::resetContext(FdCtx::EventContext &ctx) {
   ctx.scheduler = nullptr;
   ctx.fiber.reset();
-  ctx.cb = nullptr;
+  ctx.cb.reset();
 }
 
-void IOManager::FdContext::triggerEvent(Event event) {
-  SPADGER_ASSERT(events & event); // 确保设置了这个事件
-  events = (Event)(events & ~event);
-  EventContext &ctx = getContext(event);
+void IOManager::triggerEvent(FdCtx *fd_ctx, Event event) {
+  SPADGER_ASSERT(fd_ctx->m_events & event); // 确保设置了这个事件
+  fd_ctx->m_events &= ~event;
+  FdCtx::EventContext &ctx = getContext(fd_ctx, event);
   if (ctx.cb) {
-    ctx.scheduler->schedule(&ctx.cb);
+    ctx.scheduler->schedule(ctx.cb.get());
+    ctx.cb.reset();
   } else {
     ctx.scheduler->schedule(&ctx.fiber);
   }
@@ -41,102 +95,123 @@ void IOManager::FdContext::triggerEvent(Event event) {
 }
 
 IOManager::IOManager(size_t threads, bool use_caller, const std::string &name)
-    : Scheduler(threads, use_caller, name) {
+    : Scheduler(threads, use_caller, name),
+      TimerManager(getWorkerCount()),
+      m_persistent(g_epoll_persistent->getValue()), m_id(++s_iomanager_id) {
   m_epfd = epoll_create(5000);
   SPADGER_ASSERT(m_epfd > 0);
 
-  int rt = pipe(m_tickleFds); // return 0 if successful
-  SPADGER_ASSERT(rt == 0);
+  m_tickleFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  SPADGER_ASSERT(m_tickleFd >= 0);
 
   epoll_event event;
   memset(&event, 0, sizeof(epoll_event));
   event.events = EPOLLIN | EPOLLET; // 边沿触发
-  event.data.fd = m_tickleFds[0];
+  event.data.fd = m_tickleFd;
 
-  rt = fcntl(m_tickleFds[0], F_SETFL, O_NONBLOCK);
-  SPADGER_ASSERT(rt == 0);
-  rt = epoll_ctl(m_epfd, EPOLL_CTL_ADD, m_tickleFds[0], &event);
+  int rt = epoll_ctl(m_epfd, EPOLL_CTL_ADD, m_tickleFd, &event);
   SPADGER_ASSERT(rt == 0);
 
-  contextResize(32);
+  // io_uring的完成事件也通过epoll通知 定时器/唤醒的逻辑不用变
+  if (g_iomanager_backend->getValue() == "io_uring") {
+    m_uring.reset(new IoUring);
+    if (m_uring->init(g_uring_entries->getValue())) {
+      memset(&event, 0, sizeof(epoll_event));
+      event.events = EPOLLIN | EPOLLET;
+      event.data.fd = m_uring->getFd();
+      rt = epoll_ctl(m_epfd, EPOLL_CTL_ADD, m_uring->getFd(), &event);
+      SPADGER_ASSERT(rt == 0);
+      m_uringCancelFd =
+          m_uring->canCancelFd() && g_uring_cancel_fd->getValue();
+    } else {
+      SPADGER_LOG_WARN(g_logger) << "name=" << name
+                                 << " io_uring unavailable, fallback to epoll";
+      m_uring.reset();
+    }
+  }
+
+  for (size_t i = 0; i < getWorkerCount(); ++i) {
+    Waker *waker = new Waker;
+    waker->evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    SPADGER_ASSERT(waker->evfd >= 0);
+    waker->epfd = epoll_create1(EPOLL_CLOEXEC);
+    SPADGER_ASSERT(waker->epfd >= 0);
+    memset(&event, 0, sizeof(epoll_event));
+    event.events = EPOLLIN;
+    event.data.fd = waker->evfd;
+    rt = epoll_ctl(waker->epfd, EPOLL_CTL_ADD, waker->evfd, &event);
+    SPADGER_ASSERT(rt == 0);
+    m_wakers.emplace_back(waker);
+  }
+
   start();
 }
 
 IOManager::~IOManager() {
   stop();
   close(m_epfd);
-  close(m_tickleFds[0]);
-  close(m_tickleFds[1]);
-  for (size_t i = 0; i < m_fdContexts.size(); i++) {
-    if (m_fdContexts[i]) {
-      delete m_fdContexts[i];
-    }
-  }
-}
-
-// =================================================
-// IOManager cibtextResize
-// =================================================
-void IOManager::contextResize(size_t size) {
-  m_fdContexts.resize(size);
-  for (size_t i = 0; i < m_fdContexts.size(); i++) {
-    if (!m_fdContexts[i]) {
-      m_fdContexts[i] = new FdContext;
-      m_fdContexts[i]->fd = i;
-    }
+  close(m_tickleFd);
+  for (auto &waker : m_wakers) {
+    close(waker->evfd);
+    close(waker->epfd);
   }
 }
 
 // =================================================
 // IOManager addEvent
 // =================================================
-int IOManager::addEvent(int fd, Event event, std::function<void()> cb) {
-  FdContext *fd_ctx = nullptr;
-  RWMutexType::ReadLock lock(m_mutex);
-  if (fd < (int)m_fdContexts.size()) {
-    fd_ctx = m_fdContexts[fd];
-    lock.unlock();
-  } else {
-    // need to resize
-    lock.unlock();
-    RWMutexType::WriteLock lock2(m_mutex);
-    contextResize(fd * 1.5);
-    fd_ctx = m_fdContexts[fd];
+int IOManager::addEvent(int fd, Event event, Task cb) {
+  FdCtx *fd_ctx = FdMgr::GetInstance()->getRecord(fd, true);
+  if (!fd_ctx) {
+    return -1;
   }
 
-  FdContext::MutexType::Lock lock2(fd_ctx->mutex);
-  if (fd_ctx->events & event) { // unlikely
+  Spinlock::Lock lock2(fd_ctx->m_mutex);
+  if (fd_ctx->m_events & event) { // unlikely
     SPADGER_LOG_ERROR(g_logger)
         << "addEvent assert fd=" << fd << " event=" << event
-        << " fd_ctx.event=" << fd_ctx->events;
-    SPADGER_ASSERT(!(fd_ctx->events & event));
+        << " fd_ctx.event=" << (int)fd_ctx->m_events;
+    SPADGER_ASSERT(!(fd_ctx->m_events & event));
   }
 
-  int op = fd_ctx->events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
-  epoll_event ep_event;
-  ep_event.data.ptr = fd_ctx; // 第一次使用 随你放什么指针
-  ep_event.events = EPOLLET | fd_ctx->events | event;
-  int rt = epoll_ctl(m_epfd, op, fd, &ep_event);
-  if (rt) { // return 0 if successful
-    SPADGER_LOG_ERROR(g_logger)
-        << "epoll_ctl(" << m_epfd << ", " << op << "," << fd << ","
-        << ep_event.events << "):" << rt << " (" << errno << ") ("
-        << strerror(errno) << ")";
-    return -1;
-    ;
+  // persistent模式下只有第一次需要epoll_ctl 之后的等待只改fd_ctx
+  if (fd_ctx->m_registered != m_id) {
+    int op = fd_ctx->m_events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+    epoll_event ep_event;
+    ep_event.data.u64 = EpollData(fd_ctx);
+    ep_event.events = EPOLLET | fd_ctx->m_events | event;
+    if (m_persistent) {
+      op = EPOLL_CTL_ADD;
+      ep_event.events = EPOLLET | EPOLLIN | EPOLLOUT | EPOLLRDHUP;
+    }
+    int rt = epoll_ctl(m_epfd, op, fd, &ep_event);
+    if (rt) { // return 0 if successful
+      SPADGER_LOG_ERROR(g_logger)
+          << "epoll_ctl(" << m_epfd << ", " << op << "," << fd << ","
+          << ep_event.events << "):" << rt << " (" << errno << ") ("
+          << strerror(errno) << ")";
+      return -1;
+    }
+    fd_ctx->m_registered = m_persistent ? m_id : 0;
   }
   ++m_pendingEventCount;
   // 修改fd_ctx的event
-  fd_ctx->events = Event(fd_ctx->events | event);
-  FdContext::EventContext &event_ctx = fd_ctx->getContext(event);
+  fd_ctx->m_events = Event(fd_ctx->m_events | event);
+  FdCtx::EventContext &event_ctx = getContext(fd_ctx, event);
   SPADGER_ASSERT(!event_ctx.scheduler && !event_ctx.fiber && !event_ctx.cb);
   event_ctx.scheduler = Scheduler::GetThis();
   if (cb) {
-    event_ctx.cb.swap(cb);
+    event_ctx.cb.reset(new Task(std::move(cb)));
   } else {
     event_ctx.fiber = Fiber::GetThis();
     SPADGER_ASSERT(event_ctx.fiber->getState() == Fiber::EXEC);
   }
+  // 边沿已经来过了 不会再通知 直接触发
+  if (fd_ctx->m_ready & event) {
+    fd_ctx->m_ready = (Event)(fd_ctx->m_ready & ~event);
+    triggerEvent(fd_ctx, event);
+    --m_pendingEventCount;
+  }
   return 0;
 }
 
@@ -144,36 +219,36 @@ int IOManager::addEvent(int fd, Event event, std::function<void()> cb) {
 // IOManager delEvent
 // =================================================
 bool IOManager::delEvent(int fd, Event event) {
-  RWMutexType::ReadLock lock(m_mutex);
-  if (fd >= static_cast<int>(m_fdContexts.size())) {
+  FdCtx *fd_ctx = FdMgr::GetInstance()->getRecord(fd);
+  if (!fd_ctx) {
     return false;
   }
-  FdContext *fd_ctx = m_fdContexts[fd];
-  lock.unlock();
 
-  FdContext::MutexType::Lock lock1(fd_ctx->mutex);
-  if (!(fd_ctx->events & event)) { // unlikely
+  Spinlock::Lock lock1(fd_ctx->m_mutex);
+  if (!(fd_ctx->m_events & event)) { // unlikely
     return false;
   }
 
-  Event new_events = (Event)(fd_ctx->events & ~event);
-  epoll_event ep_event;
-  ep_event.events = new_events | EPOLLET;
-  ep_event.data.ptr = fd_ctx;
-  int op = new_events ? EPOLL_CTL_MOD : EPOLL_CTL_DEL;
-  int rt = epoll_ctl(m_epfd, op, fd, &ep_event);
-  if (rt) {
-    SPADGER_LOG_ERROR(g_logger)
-        << "epoll_ctl(" << m_epfd << ", " << op << "," << fd << ","
-        << ep_event.events << "):" << rt << " (" << errno << ") ("
-        << strerror(errno) << ")";
-    return false;
+  Event new_events = (Event)(fd_ctx->m_events & ~event);
+  if (fd_ctx->m_registered != m_id) {
+    epoll_event ep_event;
+    ep_event.events = new_events | EPOLLET;
+    ep_event.data.u64 = EpollData(fd_ctx);
+    int op = new_events ? EPOLL_CTL_MOD : EPOLL_CTL_DEL;
+    int rt = epoll_ctl(m_epfd, op, fd, &ep_event);
+    if (rt) {
+      SPADGER_LOG_ERROR(g_logger)
+          << "epoll_ctl(" << m_epfd << ", " << op << "," << fd << ","
+          << ep_event.events << "):" << rt << " (" << errno << ") ("
+          << strerror(errno) << ")";
+      return false;
+    }
   }
   --m_pendingEventCount;
   // cancel直接就去除了，没有像cancel那样还要trigger
-  fd_ctx->events = new_events;
-  FdContext::EventContext &event_ctx = fd_ctx->getContext(event);
-  fd_ctx->resetContext(event_ctx); // 直接置为空即可
+  fd_ctx->m_events = new_events;
+  FdCtx::EventContext &event_ctx = getContext(fd_ctx, event);
+  resetContext(event_ctx); // 直接置为空即可
   return true;
 }
 
@@ -181,46 +256,60 @@ bool IOManager::delEvent(int fd, Event event) {
 // IOManager cancelEvent
 // =================================================
 bool IOManager::cancelEvent(int fd, Event event) {
-  RWMutexType::ReadLock lock(m_mutex);
-  if (fd >= static_cast<int>(m_fdContexts.size())) {
+  FdCtx *fd_ctx = FdMgr::GetInstance()->getRecord(fd);
+  if (!fd_ctx) {
     return false;
   }
-  FdContext *fd_ctx = m_fdContexts[fd];
-  lock.unlock();
-  FdContext::MutexType::Lock lock1(fd_ctx->mutex);
-  if (!(fd_ctx->events & event)) { // ulikely
+  Spinlock::Lock lock1(fd_ctx->m_mutex);
+  return cancelEvent(fd_ctx, event);
+}
+
+bool IOManager::cancelEvent(int fd, Event event, uint32_t gen) {
+  FdCtx *fd_ctx = FdMgr::GetInstance()->getRecord(fd);
+  if (!fd_ctx) {
     return false;
   }
-  Event new_events = (Event)(fd_ctx->events & ~event);
-  epoll_event ep_event;
-  ep_event.data.ptr = fd_ctx;
-  ep_event.events = new_events | EPOLLET;
-  int op = new_events ? EPOLL_CTL_MOD : EPOLL_CTL_DEL;
-  int rt = epoll_ctl(m_epfd, op, fd, &ep_event);
-  if (rt) {
-    SPADGER_LOG_ERROR(g_logger)
-        << "epoll_ctl(" << m_epfd << ", " << op << "," << fd << ","
-        << ep_event.events << "):" << rt << " (" << errno << ") ("
-        << strerror(errno) << ")";
+  Spinlock::Lock lock1(fd_ctx->m_mutex);
+  if (fd_ctx->m_gen.load(std::memory_order_relaxed) != gen) {
+    return false; // fd已经关了 可能又被别人打开了 不能动
+  }
+  return cancelEvent(fd_ctx, event);
+}
+
+bool IOManager::cancelEvent(FdCtx *fd_ctx, Event event) {
+  if (!(fd_ctx->m_events & event)) { // ulikely
     return false;
   }
-  fd_ctx->triggerEvent(event);
+  Event new_events = (Event)(fd_ctx->m_events & ~event);
+  if (fd_ctx->m_registered != m_id) {
+    epoll_event ep_event;
+    ep_event.data.u64 = EpollData(fd_ctx);
+    ep_event.events = new_events | EPOLLET;
+    int op = new_events ? EPOLL_CTL_MOD : EPOLL_CTL_DEL;
+    int rt = epoll_ctl(m_epfd, op, fd_ctx->m_fd, &ep_event);
+    if (rt) {
+      SPADGER_LOG_ERROR(g_logger)
+          << "epoll_ctl(" << m_epfd << ", " << op << "," << fd_ctx->m_fd
+          << "," << ep_event.events << "):" << rt << " (" << errno << ") ("
+          << strerror(errno) << ")";
+      return false;
+    }
+  }
+  triggerEvent(fd_ctx, event);
   --m_pendingEventCount;
   return true;
 }
 
 // =================================================
-// IOManager 删除所有event (从m_epfd 和 fd_ctx->events)
+// IOManager 删除所有event (从m_epfd 和 fd_ctx->m_events)
 // =================================================
 bool IOManager::cancelAll(int fd) {
-  RWMutexType::ReadLock lock(m_mutex);
-  if (fd >= static_cast<int>(m_fdContexts.size())) {
+  FdCtx *fd_ctx = FdMgr::GetInstance()->getRecord(fd);
+  if (!fd_ctx) {
     return false;
   }
-  FdContext *fd_ctx = m_fdContexts[fd];
-  lock.unlock();
-  FdContext::MutexType::Lock lock1(fd_ctx->mutex);
-  if (!fd_ctx->events) {
+  Spinlock::Lock lock1(fd_ctx->m_mutex);
+  if (!fd_ctx->m_events && !fd_ctx->m_registered) {
     return false;
   }
 
@@ -228,9 +317,12 @@ bool IOManager::cancelAll(int fd) {
   // 正常的流程也是epoll_wait之后去除m_epfd中的event，并且schedule
   int op = EPOLL_CTL_DEL;
   epoll_event ep_event;
-  ep_event.data.ptr = fd_ctx;
+  ep_event.data.u64 = EpollData(fd_ctx);
   ep_event.events = 0;
   int rt = epoll_ctl(m_epfd, op, fd, &ep_event);
+  // fd马上要关了(或者已经关了) 不管DEL成功没有 下一个同号的fd都要重新注册
+  fd_ctx->m_registered = 0;
+  fd_ctx->m_ready = NONE;
   if (rt) {
     SPADGER_LOG_ERROR(g_logger)
         << "epoll_ctl(" << m_epfd << ", " << op << "," << fd << ","
@@ -238,16 +330,16 @@ bool IOManager::cancelAll(int fd) {
         << strerror(errno) << ")";
     return false;
   }
-  // fd_ctx triggeEvent在schedule之后也从fd_ctx->events删除event了
-  if (fd_ctx->events & READ) {
-    fd_ctx->triggerEvent(READ);
+  // fd_ctx triggeEvent在schedule之后也从fd_ctx->m_events删除event了
+  if (fd_ctx->m_events & READ) {
+    triggerEvent(fd_ctx, READ);
     --m_pendingEventCount;
   }
-  if (fd_ctx->events & WRITE) {
-    fd_ctx->triggerEvent(WRITE);
+  if (fd_ctx->m_events & WRITE) {
+    triggerEvent(fd_ctx, WRITE);
     --m_pendingEventCount;
   }
-  SPADGER_ASSERT(fd_ctx->events == 0);
+  SPADGER_ASSERT(fd_ctx->m_events == 0);
   return true;
 }
 IOManager *IOManager::GetThis() { // static function return
@@ -261,21 +353,208 @@ void IOManager::tickle() {
   if (!hasIdleThreads()) {
     return;
   }
-  int rt = write(m_tickleFds[1], "1", 1);
-  SPADGER_ASSERT(rt == 1); // 返回长度为1
+  // 只叫醒一个: 优先停着的线程, 没有的话打断poller
+  if (!wakeIdleWorker()) {
+    interruptPoller();
+  }
+}
+
+void IOManager::tickleWorker(int worker) { wakeWorker(worker); }
+
+void IOManager::tickleAll() {
+  for (size_t i = 0; i < m_wakers.size(); ++i) {
+    wakeWorker(i);
+  }
+  interruptPoller();
+}
+
+void IOManager::interruptPoller() {
+  int rt = eventfd_write(m_tickleFd, 1);
+  SPADGER_ASSERT(rt == 0);
+}
+
+bool IOManager::wakeIdleWorker() {
+  int worker = -1;
+  {
+    Spinlock::Lock lock(m_idleMutex);
+    if (m_idleWorkers.empty()) {
+      return false;
+    }
+    worker = m_idleWorkers.back();
+    m_idleWorkers.pop_back();
+    m_wakers[worker]->parked = false;
+  }
+  int rt = eventfd_write(m_wakers[worker]->evfd, 1);
+  SPADGER_ASSERT(rt == 0);
+  return true;
+}
+
+void IOManager::wakeWorker(int worker) {
+  Waker &waker = *m_wakers[worker];
+  {
+    Spinlock::Lock lock(m_idleMutex);
+    if (waker.parked) {
+      m_idleWorkers.erase(
+          std::find(m_idleWorkers.begin(), m_idleWorkers.end(), worker));
+      waker.parked = false;
+    }
+  }
+  // 先记在eventfd上 再看它是不是正在epoll_wait
+  // 和becomePoller()的顺序相反 两边至少有一边能看到对方
+  int rt = eventfd_write(waker.evfd, 1);
+  SPADGER_ASSERT(rt == 0);
+  if (m_poller == worker) {
+    interruptPoller();
+  }
+}
+
+bool IOManager::becomePoller(int worker) {
+  int expected = -1;
+  if (!m_poller.compare_exchange_strong(expected, worker)) {
+    return false;
+  }
+  // 成为poller之前已经有人叫过自己了 直接回去执行任务
+  eventfd_t value;
+  if (eventfd_read(m_wakers[worker]->evfd, &value) == 0) {
+    m_poller = -1;
+    return false;
+  }
+  return true;
+}
+
+void IOManager::park(int worker, uint64_t timeout) {
+  Waker &waker = *m_wakers[worker];
+  // 自己分片的定时器到了也要醒
+  if (timeout != ~0ull) {
+    timeout = std::min(timeout, MAX_TIMEOUT);
+  }
+  {
+    Spinlock::Lock lock(m_idleMutex);
+    m_idleWorkers.push_back(worker);
+    waker.parked = true;
+  }
+  eventfd_t value;
+  while (eventfd_read(waker.evfd, &value) != 0) {
+    // poller刚好走了 没有人在epoll_wait 自己回去当poller
+    if (m_poller == -1) {
+      break;
+    }
+    epoll_event event;
+    if (EpollWait(waker.epfd, &event, 1, timeout) == 0) {
+      break;
+    }
+  }
+  Spinlock::Lock lock(m_idleMutex);
+  if (waker.parked) {
+    m_idleWorkers.erase(
+        std::find(m_idleWorkers.begin(), m_idleWorkers.end(), worker));
+    waker.parked = false;
+  }
+}
+
+// =================================================
+// io_uring
+// =================================================
+bool IOManager::submitIo(int fd, UringIo &io, uint64_t timeout_ms, int &res) {
+  if (!m_uring) {
+    return false;
+  }
+  Fiber::ptr fiber = Fiber::GetThis();
+  if (fiber->isSharedStack()) {
+    return false;
+  }
+  UringWait wait;
+  wait.fiber = std::move(fiber);
+  wait.scheduler = Scheduler::GetThis();
+  wait.pending = timeout_ms != (uint64_t)-1 ? 2 : 1;
+  std::unordered_multimap<int, UringWait *>::iterator it;
+  if (!m_uringCancelFd) {
+    Spinlock::Lock lock(m_uringMutex);
+    it = m_uringWaits.emplace(fd, &wait);
+  }
+  ++m_pendingEventCount;
+  int rt = m_uring->submit(fd, io, (uint64_t)&wait, timeout_ms, &wait.ts);
+  if (!rt) {
+    io.used = true;
+    Fiber::YieldToHold(); // reapIo()里schedule回来
+  } else {
+    --m_pendingEventCount;
+  }
+  if (!m_uringCancelFd) {
+    Spinlock::Lock lock(m_uringMutex);
+    m_uringWaits.erase(it);
+  }
+  if (rt) {
+    return false;
+  }
+  res = wait.res;
+  if (wait.timedout && res == -ECANCELED) {
+    res = -ETIMEDOUT;
+  }
+  return true;
+}
+
+void IOManager::cancelIo(int fd) {
+  if (!m_uring) {
+    return;
+  }
+  if (m_uringCancelFd) {
+    m_uring->cancelFd(fd);
+    return;
+  }
+  // 只提交取消 不碰wait本身 它由等待的协程醒来后摘掉
+  Spinlock::Lock lock(m_uringMutex);
+  auto range = m_uringWaits.equal_range(fd);
+  for (auto it = range.first; it != range.second; ++it) {
+    m_uring->cancel((uint64_t)it->second);
+  }
+}
+
+void IOManager::reapIo() {
+  m_uring->reap([this](uint64_t user_data, int res) {
+    if (!user_data) {
+      // 取消操作自己的完成事件 找不到(已经完成了)是正常的
+      if (res == -EINVAL) {
+        SPADGER_LOG_ERROR(g_logger) << "io_uring cancel rejected";
+      }
+      return;
+    }
+    UringWait *wait = (UringWait *)(user_data & ~(uint64_t)1);
+    if (user_data & 1) {
+      wait->timedout = res == -ETIME;
+    } else {
+      wait->res = res;
+    }
+    if (--wait->pending == 0) {
+      // schedule之后wait所在的栈随时可能没了 先把要用的拿出来
+      Fiber::ptr fiber;
+      fiber.swap(wait->fiber);
+      Scheduler *scheduler = wait->scheduler;
+      scheduler->schedule(std::move(fiber));
+      --m_pendingEventCount;
+    }
+  });
 }
 
 // =================================================
 // IOManager 是否停止
 // =================================================
 bool IOManager::stopping(uint64_t &timeout) {
-  timeout = getNextTimer();
-  return timeout == ~0ull && m_pendingEventCount == 0 && Scheduler::stopping();
+  // 只等自己分片的定时器 别的分片由各自的线程等
+  timeout = getNextTimerUS(getTimerShard());
+  return stopping();
 }
 
 bool IOManager::stopping() {
-  uint64_t timeout = 0;
-  return stopping(timeout);
+  return !hasTimer() && m_pendingEventCount == 0 && Scheduler::stopping();
+}
+
+int IOManager::getTimerShard() {
+  int worker = GetWorkerIndex();
+  if (Scheduler::GetThis() != this || worker < 0) {
+    return 0; // 不是自己的工作线程
+  }
+  return worker;
 }
 
 // =================================================
@@ -283,27 +562,60 @@ bool IOManager::stopping() {
 // =================================================
 void IOManager::idle() {
   // 初始化epoll_event数组用于存放epoll_wait结果
+  int worker = GetWorkerIndex();
+  int shard = getTimerShard();
+  std::vector<int> busy; // 在跑任务的线程 poller替它们处理定时器
   epoll_event *events = new epoll_event[64]();
   std::shared_ptr<epoll_event> shared_events(
       events, [](epoll_event *ptr) { delete[] ptr; });
   while (true) {
+    Clock::Update();
     uint64_t next_timeout = 0;
     if (stopping(next_timeout)) {
       SPADGER_LOG_INFO(g_logger)
           << "name=" << getName() << " idle stopping exit.";
+      // 最后一个任务结束时别的线程可能还在等 叫醒它们也退出
+      tickleAll();
       break;
     }
+    // 已经有线程在epoll_wait了 就停在自己的eventfd上 等着被单独叫醒
+    if (worker >= 0 && !becomePoller(worker)) {
+      park(worker, next_timeout);
+      Clock::Update();
+      std::vector<Task> cbs;
+      listExpiredCb(cbs, shard);
+      if (!cbs.empty()) {
+        schedule(cbs.begin(), cbs.end());
+      }
+      Fiber::GetThis()->swapOut(); // 回去看任务队列
+      continue;
+    }
+    // 在跑任务的线程回到idle之前看不到自己分片的定时器 poller替它们等着
+    busy.clear();
+    {
+      Spinlock::Lock lock(m_idleMutex);
+      for (int i = 0; i < (int)m_wakers.size(); ++i) {
+        if (i != shard && !m_wakers[i]->parked) {
+          busy.push_back(i);
+        }
+      }
+    }
+    uint64_t now = 0;
+    for (int i : busy) {
+      uint64_t deadline = getTimerDeadline(i);
+      if (deadline == ~0ull) {
+        continue;
+      }
+      if (!now) {
+        now = Clock::NowUS();
+      }
+      next_timeout = std::min(next_timeout, deadline > now ? deadline - now : 0);
+    }
     int rt = 0;
     do {
       // 通过控制时间来达到timer和IO event合并的目的
-      static const int MAX_TIMEOUT = 3000;
-      if (next_timeout == ~0ull) {
-        next_timeout = MAX_TIMEOUT;
-      } else {
-        next_timeout =
-            (int)next_timeout > MAX_TIMEOUT ? MAX_TIMEOUT : next_timeout;
-      }
-      rt = epoll_wait(m_epfd, events, 64, int(next_timeout));
+      next_timeout = std::min(next_timeout, MAX_TIMEOUT);
+      rt = EpollWait(m_epfd, events, 64, next_timeout);
       if (rt < 0 && errno == EINTR) {
         // 如果是因为中断的就继续
       } else {
@@ -315,9 +627,21 @@ void IOManager::idle() {
       }
     } while (true);
 
+    Clock::Update();
+    if (worker >= 0) {
+      // 这个线程要回去执行任务了 叫醒一个停着的线程接着epoll_wait
+      m_poller = -1;
+      eventfd_t value;
+      eventfd_read(m_wakers[worker]->evfd, &value); // 可能是被单独叫醒的
+      wakeIdleWorker();
+    }
+
     // 1. 首先获取定时器列表中的过期cbs并执行
-    std::vector<std::function<void()>> cbs;
-    listExpiredCb(cbs);
+    std::vector<Task> cbs;
+    listExpiredCb(cbs, shard);
+    for (int i : busy) {
+      listExpiredCb(cbs, i); // 没到期的话不加锁直接返回
+    }
     if (!cbs.empty()) {
       schedule(cbs.begin(), cbs.end());
       cbs.clear();
@@ -326,22 +650,48 @@ void IOManager::idle() {
     // 2. 之后是IO evnet的处理
     for (int i = 0; i < rt; i++) {
       epoll_event &event = events[i];
-      // 1. 首先判断是否是tickleFds[0]
-      if (event.data.fd == m_tickleFds[0]) {
-        uint8_t dummy[256];
-        int r;
-        int flag = fcntl(m_tickleFds[0], F_GETFL) | O_NONBLOCK;
-        fcntl(m_tickleFds[0], F_SETFL, flag);
-        while ((r = read(m_tickleFds[0], dummy, sizeof(dummy))) > 0) {
-          //   std::cout << r << " " << dummy << std::endl;
-        }
+      // 1. 首先判断是否是tickleFd
+      if (event.data.fd == m_tickleFd) {
+        eventfd_t dummy;
+        eventfd_read(m_tickleFd, &dummy);
         continue; // 如果是通知的话，知道就行了
       }
+      if (m_uring && event.data.fd == m_uring->getFd()) {
+        reapIo();
+        continue;
+      }
 
-      FdContext *fd_ctx = (FdContext *)(event.data.ptr);
-      FdContext::MutexType::Lock lock(fd_ctx->mutex);
+      // 低32位是fd 高32位是注册时fd的代数
+      // 取到事件之前fd关掉又打开了的话 是上一个fd的事件 丢掉
+      FdCtx *fd_ctx = FdMgr::GetInstance()->getRecord((int)event.data.u64);
+      Spinlock::Lock lock(fd_ctx->m_mutex);
+      if (fd_ctx->m_gen.load(std::memory_order_relaxed) !=
+          (uint32_t)(event.data.u64 >> 32)) {
+        continue;
+      }
+      if (fd_ctx->m_registered == m_id) {
+        // persistent: 不改epoll 只记下就绪 有人等就交给它
+        int ready = NONE;
+        if (event.events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+          ready |= READ;
+        }
+        if (event.events & (EPOLLOUT | EPOLLHUP | EPOLLERR)) {
+          ready |= WRITE;
+        }
+        int fire = ready & fd_ctx->m_events;
+        fd_ctx->m_ready = (Event)((fd_ctx->m_ready | ready) & ~fire);
+        if (fire & READ) {
+          triggerEvent(fd_ctx, READ);
+          --m_pendingEventCount;
+        }
+        if (fire & WRITE) {
+          triggerEvent(fd_ctx, WRITE);
+          --m_pendingEventCount;
+        }
+        continue;
+      }
       if (event.events & (EPOLLHUP | EPOLLERR)) {
-        event.events |= (EPOLLIN | EPOLLOUT) & fd_ctx->events;
+        event.events |= (EPOLLIN | EPOLLOUT) & fd_ctx->m_events;
       }
       // 转化 EPOLLXX -> READ WRITE
       int real_events = NONE;
@@ -351,28 +701,28 @@ void IOManager::idle() {
       if (event.events & EPOLLOUT) {
         real_events |= WRITE;
       }
-      if ((Event)(real_events & fd_ctx->events) == NONE) { // 与等待的事件不对应
+      if ((Event)(real_events & fd_ctx->m_events) == NONE) { // 与等待的事件不对应
         continue;
       }
-      int left_events = (fd_ctx->events & ~real_events);
+      int left_events = (fd_ctx->m_events & ~real_events);
       int op = left_events ? EPOLL_CTL_MOD : EPOLL_CTL_DEL;
       event.events = EPOLLET | left_events;
 
-      int rt2 = epoll_ctl(m_epfd, op, fd_ctx->fd, &event);
+      int rt2 = epoll_ctl(m_epfd, op, fd_ctx->m_fd, &event);
       if (rt2) {
         SPADGER_LOG_ERROR(g_logger)
-            << "epoll_ctl(" << m_epfd << ", " << op << "," << fd_ctx->fd << ","
-            << event.events << "):" << rt << " (" << errno << ") ("
+            << "epoll_ctl(" << m_epfd << ", " << op << "," << fd_ctx->m_fd << ","
+            << event.events << "):" << rt2 << " (" << errno << ") ("
             << strerror(errno) << ")";
         continue;
       }
 
       if (real_events & READ) {
-        fd_ctx->triggerEvent(READ);
+        triggerEvent(fd_ctx, READ);
         --m_pendingEventCount;
       }
       if (real_events & WRITE) {
-        fd_ctx->triggerEvent(WRITE);
+        triggerEvent(fd_ctx, WRITE);
         --m_pendingEventCount;
       }
     }
@@ -384,8 +734,22 @@ void IOManager::idle() {
   }
 }
 
-void IOManager::onTimerInsertedAtFront() {
-  tickle(); // 唤醒
+void IOManager::onTimerInsertedAtFront(int shard) {
+  if (!hasIdleThreads()) {
+    return;
+  }
+  // 分片的线程停着就叫醒它自己 否则它在忙(或者就是poller)
+  // 由poller重新算超时 替它处理
+  bool parked = false;
+  {
+    Spinlock::Lock lock(m_idleMutex);
+    parked = m_wakers[shard]->parked;
+  }
+  if (parked) {
+    wakeWorker(shard);
+  } else {
+    interruptPoller();
+  }
 }
 
 } // namespace spadger
\ No newline at end of file
@@ -7,10 +7,13 @@
 
 #ifndef __SPADGER_IOMANAGER_H__
 #define __SPADGER_IOMANAGER_H__
+#include "fd_manager.h"
 #include "scheduler.h"
 #include "timer.h"
+#include "uring.h"
 #include <atomic>
 #include <sys/epoll.h>
+#include <unordered_map>
 
 namespace spadger {
 class IOManager : public Scheduler, public TimerManager {
@@ -20,55 +23,102 @@ public:
 
   enum Event { NONE = 0x0, READ = 0x1, WRITE = 0x4 };
 
-private:
-  struct FdContext {
-    typedef Mutex MutexType;
-    struct EventContext {
-      Scheduler *scheduler = nullptr; // 事件执行的scheduler
-      Fiber::ptr fiber;               // 事件的协程
-      std::function<void()> cb;
-    };
-
-    EventContext &getContext(Event event);
-    void resetContext(EventContext &ctx);
-    void triggerEvent(Event event);
-
-    EventContext read;   // 读事件如何处理
-    EventContext write;  // 写事件如何处理
-    int fd;              // 句柄
-    Event events = NONE; // 已经注册的事件
-    MutexType mutex;
-  };
-
 public:
   IOManager(size_t threads = 1, bool use_caller = true,
             const std::string &name = "");
   ~IOManager();
 
-  // 为fd的事件添加处理函数
-  int addEvent(int fd, Event event, std::function<void()> cb = nullptr);
+  /**
+   * @brief 为fd的事件添加处理函数(只触发一次)
+   * @attention persistent模式下fd上次通知过的事件还没被消费的话会直接触发
+   *            可能是假唤醒 调用者要重试IO(hook里的do_io就是这样)
+   */
+  int addEvent(int fd, Event event, Task cb = nullptr);
   bool delEvent(int fd, Event event);
   bool cancelEvent(int fd, Event event);
+  // 只有fd的代数还是gen(从那以后没有关过)的时候才取消 给超时的定时器用
+  bool cancelEvent(int fd, Event event, uint32_t gen);
   bool cancelAll(int fd);
   static IOManager *GetThis();
 
+  // iomanager.backend=io_uring并且内核支持的时候才有
+  bool hasUring() const { return (bool)m_uring; }
+  /**
+   * @brief 通过io_uring执行IO操作 当前协程挂起直到完成
+   * @param[out] res 操作结果 失败为-errno 超时为-ETIMEDOUT
+   * @return 没法提交(没有io_uring/共享栈协程/队列满)返回false 走epoll
+   * @attention 共享栈协程的栈会被别的协程覆盖 内核异步写会写坏 所以不支持
+   */
+  bool submitIo(int fd, UringIo &io, uint64_t timeout_ms, int &res);
+  // 取消fd上还没完成的io_uring操作(close的时候)
+  void cancelIo(int fd);
+
 protected:
   // 从Scheduler继承的虚函数
   void tickle() override;
+  void tickleWorker(int worker) override;
+  void tickleAll() override;
   void idle() override;
   bool stopping();
   bool stopping(uint64_t &timeout);
 
-  void contextResize(size_t size);
-  void onTimerInsertedAtFront() override;
+  // 定时器按工作线程分片 每个线程只等自己分片的定时器
+  void onTimerInsertedAtFront(int shard) override;
+  int getTimerShard() override;
+
+private:
+  // 空闲时只有一个线程(poller)在epoll_wait, 其余空闲线程停在自己的eventfd上
+  // 停着的线程放在一个栈里 来一个任务只叫醒栈顶一个 (最近停下的 缓存还热)
+  struct Waker {
+    int evfd = -1;       // 唤醒用的eventfd
+    int epfd = -1;       // 只监听evfd 用来阻塞等待
+    bool parked = false; // 是否在m_idleWorkers里 由m_idleMutex保护
+  };
+  // 提交io_uring操作的协程在等的东西 放在协程栈上 完成时由poller填写
+  struct UringWait {
+    Fiber::ptr fiber;
+    Scheduler *scheduler = nullptr;
+    int res = 0;
+    int pending = 1;        // 还差几个完成事件(链接了超时的话是2个)
+    bool timedout = false;
+    __kernel_timespec ts;
+  };
+  void reapIo();
+
+  // fd记录(FdManager里的FdCtx)中事件相关的部分 调用时持有fd_ctx->m_mutex
+  static FdCtx::EventContext &getContext(FdCtx *fd_ctx, Event event);
+  static void resetContext(FdCtx::EventContext &ctx);
+  static void triggerEvent(FdCtx *fd_ctx, Event event);
+  bool cancelEvent(FdCtx *fd_ctx, Event event);
+  // 注册到epoll的数据: 低32位fd 高32位fd的代数
+  static uint64_t EpollData(FdCtx *fd_ctx);
+
+  bool becomePoller(int worker);
+  // 停在自己的eventfd上 最多等timeout微秒(自己分片的下一个定时器)
+  void park(int worker, uint64_t timeout);
+  void wakeWorker(int worker);
+  // 从栈顶取一个停着的线程叫醒 没有停着的返回false
+  bool wakeIdleWorker();
+  // 打断正在epoll_wait的线程
+  void interruptPoller();
 
 private:
   int m_epfd;
-  int m_tickleFds[2]; // pair for fd to notify.
+  int m_tickleFd;    // eventfd 用来打断epoll_wait
+  bool m_persistent; // fd常驻epoll 不在每次事件后MOD/DEL
+  std::vector<std::unique_ptr<Waker>> m_wakers;
+  std::unique_ptr<IoUring> m_uring;
+  // 内核不能按fd取消时(<5.19) 记下每个fd上在等的操作 close时逐个取消
+  bool m_uringCancelFd = true;
+  Spinlock m_uringMutex;
+  std::unordered_multimap<int, UringWait *> m_uringWaits;
+  std::atomic<int> m_poller = {-1}; // 正在epoll_wait的工作线程
+  Spinlock m_idleMutex;
+  std::vector<int> m_idleWorkers; // 停着的线程 栈
 
   std::atomic<size_t> m_pendingEventCount = {0};
-  RWMutexType m_mutex;
-  std::vector<FdContext *> m_fdContexts;
+  // fd记录是全局的 persistent模式下记着注册到了哪个IOManager
+  uint32_t m_id;
 };
 
 } // namespace spadger
@@ -407,7 +407,7 @@ FileLogAppender::FileLogAppender(const std::string &filename)
 void FileLogAppender::log(std::shared_ptr<Logger> logger, LogLevel::Level level,
                           LogEvent::ptr event) {
   if (level >= m_level) {
-    uint64_t now = time(0);
+    uint64_t now = Clock::NowSec();
     if (now >= m_lastTime + 3) {
       reopen();
       m_lastTime = now;
@@ -1,6 +1,7 @@
 #ifndef __SPADGER_LOG_H__
 #define __SPADGER_LOG_H__
 
+#include "clock.h"
 #include "singleton.h"
 #include "thread.h"
 #include "util.h"
@@ -22,7 +23,8 @@
   spadger::LogEventWrap(                                                       \
       spadger::LogEvent::ptr(new spadger::LogEvent(                            \
           logger, level, __FILE__, __LINE__, 0, spadger::GetThreadId(),        \
-          spadger::GetFiberId(), time(nullptr), spadger::Thread::GetName())))  \
+          spadger::GetFiberId(), spadger::Clock::NowSec(),                    \
+          spadger::Thread::GetName())))                                        \
       .getSS()
 
 #define SPADGER_LOG_DEBUG(logger)                                              \
@@ -219,9 +219,9 @@ private:
 };
 
 class Spinlock : Noncopyable {
+public:
   typedef ScopedLockImpl<Spinlock> Lock;
 
-public:
   Spinlock() { pthread_spin_init(&m_lock, 0); }
   ~Spinlock() { pthread_spin_destroy(&m_lock); }
   void lock() { pthread_spin_lock(&m_lock); }
@@ -0,0 +1,156 @@
+/*
+ * @Author: lxk
+ * @Date: 2022-11-10 10:12:35
+ * @LastEditors: lxk
+ * @LastEditTime: 2022-11-10 20:48:19
+ */
+#include "offload.h"
+#include "clock.h"
+#include "config.h"
+#include "fiber.h"
+#include "hook.h"
+#include "log.h"
+#include "scheduler.h"
+#include <algorithm>
+
+namespace spadger {
+
+static Logger::ptr g_logger = SPADGER_LOG_NAME("system");
+
+static ConfigVar<uint32_t>::ptr g_offload_threads = Config::Lookup<uint32_t>(
+    "offload.threads", 4, "threads running blocking calls for fibers");
+
+static uint32_t s_max_threads = 4;
+struct _OffloadIniter {
+  _OffloadIniter() {
+    s_max_threads = g_offload_threads->getValue();
+    g_offload_threads->addListener(
+        [](const uint32_t &old_val, const uint32_t &new_val) {
+          SPADGER_LOG_INFO(g_logger) << "offload.threads changed from "
+                                     << old_val << " to " << new_val;
+          s_max_threads = new_val;
+        });
+  }
+};
+static _OffloadIniter s_offload_initer;
+
+struct OffloadPool::Job {
+  std::function<void()> cb;
+  std::exception_ptr error;
+  Scheduler *scheduler;
+  std::shared_ptr<Fiber> fiber;
+  uint64_t enqueued; // Clock::ReadUS
+};
+
+OffloadPool::OffloadPool() {}
+
+OffloadPool::~OffloadPool() {
+  {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_stopping = true;
+  }
+  m_cond.notify_all();
+  for (auto &i : m_threads) {
+    i->join();
+  }
+}
+
+bool OffloadPool::CanOffload() {
+  if (!Scheduler::GetThis() || !is_hook_enable()) {
+    return false;
+  }
+  return !Fiber::GetThis()->isSharedStack();
+}
+
+void OffloadPool::submit(std::function<void()> cb) {
+  std::shared_ptr<Job> job(new Job);
+  job->cb = std::move(cb);
+  job->scheduler = Scheduler::GetThis();
+  job->fiber = Fiber::GetThis();
+  job->enqueued = Clock::ReadUS();
+  {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_jobs.push_back(job);
+    ++m_stats.submitted;
+    m_stats.queued = m_jobs.size();
+    m_stats.maxQueued = std::max(m_stats.maxQueued, m_stats.queued);
+    if (m_idle < m_jobs.size() && m_threads.size() < s_max_threads) {
+      addThread();
+    }
+  }
+  m_cond.notify_one();
+  job->scheduler->addExternalWait();
+  Fiber::YieldToHold(); // worker()做完之后schedule回来
+  job->scheduler->delExternalWait();
+  if (job->error) {
+    std::rethrow_exception(job->error);
+  }
+}
+
+void OffloadPool::addThread() {
+  m_threads.emplace_back(new Thread(std::bind(&OffloadPool::worker, this),
+                                    "offload_" +
+                                        std::to_string(m_threads.size())));
+  m_stats.threads = m_threads.size();
+}
+
+void OffloadPool::worker() {
+  std::unique_lock<std::mutex> lock(m_mutex);
+  while (true) {
+    ++m_idle;
+    while (m_jobs.empty() && !m_stopping) {
+      m_cond.wait(lock);
+    }
+    --m_idle;
+    if (m_jobs.empty()) {
+      return;
+    }
+    std::shared_ptr<Job> job = std::move(m_jobs.front());
+    m_jobs.pop_front();
+    uint64_t start = Clock::ReadUS();
+    uint64_t wait = start - job->enqueued;
+    m_stats.queued = m_jobs.size();
+    m_stats.waitUS += wait;
+    m_stats.maxWaitUS = std::max(m_stats.maxWaitUS, wait);
+    ++m_stats.running;
+    lock.unlock();
+
+    try {
+      job->cb();
+    } catch (...) {
+      job->error = std::current_exception();
+    }
+    uint64_t used = Clock::ReadUS() - start;
+    // 回到原来的调度器 可能协程还没让出去 调度器会等它HOLD了再跑
+    Scheduler *scheduler = job->scheduler;
+    scheduler->schedule(std::move(job->fiber));
+    job.reset();
+
+    lock.lock();
+    --m_stats.running;
+    ++m_stats.completed;
+    m_stats.runUS += used;
+    m_stats.maxRunUS = std::max(m_stats.maxRunUS, used);
+  }
+}
+
+OffloadPool::Stats OffloadPool::getStats() {
+  std::unique_lock<std::mutex> lock(m_mutex);
+  return m_stats;
+}
+
+std::ostream &OffloadPool::dump(std::ostream &os) {
+  Stats stats = getStats();
+  uint64_t started = stats.completed + stats.running;
+  os << "[OffloadPool threads=" << stats.threads << "/" << s_max_threads
+     << " submitted=" << stats.submitted << " completed=" << stats.completed
+     << " queued=" << stats.queued << " max_queued=" << stats.maxQueued
+     << " running=" << stats.running << " avg_wait_us="
+     << (started ? stats.waitUS / started : 0)
+     << " max_wait_us=" << stats.maxWaitUS << " avg_run_us="
+     << (stats.completed ? stats.runUS / stats.completed : 0)
+     << " max_run_us=" << stats.maxRunUS << " ]";
+  return os;
+}
+
+} // namespace spadger
@@ -0,0 +1,114 @@
+/*
+ * @Author: lxk
+ * @Date: 2022-11-10 10:12:35
+ * @LastEditors: lxk
+ * @LastEditTime: 2022-11-10 20:48:19
+ */
+#ifndef __SPADGER_OFFLOAD_H__
+#define __SPADGER_OFFLOAD_H__
+
+#include "noncopyable.h"
+#include "singleton.h"
+#include "thread.h"
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <vector>
+
+namespace spadger {
+
+class Fiber;
+class Scheduler;
+
+/**
+ * @brief 阻塞调用的线程池
+ * @details hook不到的阻塞调用(普通文件的read/write/open/fsync/stat
+ *          getaddrinfo 第三方库...)放到这里的线程上跑 调用的协程挂起
+ *          做完之后由原来的调度器schedule回来 工作线程不会被卡住
+ *          线程数由offload.threads配置 用到时才创建 调大了会补线程
+ *          (调小只对之后新建的线程生效 已有的不退出)
+ */
+class OffloadPool : Noncopyable {
+public:
+  // 统计 用来调线程数
+  struct Stats {
+    uint64_t threads = 0;
+    uint64_t submitted = 0;
+    uint64_t completed = 0;
+    uint64_t queued = 0;     // 当前排队的
+    uint64_t maxQueued = 0;  // 排队最多的时候
+    uint64_t running = 0;    // 正在跑的
+    uint64_t waitUS = 0;     // 排队总时间
+    uint64_t maxWaitUS = 0;
+    uint64_t runUS = 0;      // 执行总时间
+    uint64_t maxRunUS = 0;
+  };
+
+  OffloadPool();
+  ~OffloadPool();
+
+  /**
+   * @brief 在池里的线程上执行fn 当前协程等它做完 返回fn的返回值
+   *        fn抛出的异常在调用的协程里重新抛出
+   * @attention 不在调度器的协程里(没开hook) 或者是共享栈的协程时直接执行fn
+   *            (共享栈的协程换出去之后栈上的东西会被别的协程覆盖)
+   */
+  template <class F> auto run(F fn) -> decltype(fn()) {
+    typedef decltype(fn()) R;
+    if (!CanOffload()) {
+      return fn();
+    }
+    std::shared_ptr<Result<R>> result(new Result<R>);
+    submit([fn, result]() mutable { result->set(fn); });
+    return result->get();
+  }
+
+  /**
+   * @brief 执行cb 当前协程挂起到它做完
+   * @pre CanOffload()
+   */
+  void submit(std::function<void()> cb);
+
+  // 当前协程能不能挂起等池里的线程
+  static bool CanOffload();
+
+  Stats getStats();
+  std::ostream &dump(std::ostream &os);
+
+private:
+  template <class R> struct Result {
+    std::unique_ptr<R> value;
+    template <class F> void set(F &fn) { value.reset(new R(fn())); }
+    R get() { return std::move(*value); }
+  };
+
+  struct Job;
+  void worker();
+  // 线程不够的话加一个 要拿着m_mutex
+  void addThread();
+
+private:
+  std::mutex m_mutex;
+  std::condition_variable m_cond;
+  std::deque<std::shared_ptr<Job>> m_jobs;
+  std::vector<Thread::ptr> m_threads;
+  size_t m_idle = 0;
+  bool m_stopping = false;
+  Stats m_stats;
+};
+
+template <> struct OffloadPool::Result<void> {
+  template <class F> void set(F &fn) { fn(); }
+  void get() {}
+};
+
+typedef Singleton<OffloadPool> OffloadMgr;
+
+} // namespace spadger
+
+#endif
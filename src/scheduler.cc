@@ -5,6 +5,8 @@
  * @LastEditTime: 2022-10-20 16:17:55
  */
 #include "scheduler.h"
+#include "clock.h"
+#include "config.h"
 #include "hook.h"
 #include "log.h"
 #include "mutex.h"
@@ -20,6 +22,17 @@ static spadger::Logger::ptr g_logger = SPADGER_LOG_NAME("system");
 static thread_local Scheduler *t_scheduler = nullptr;
 static thread_local Fiber *t_scheduler_fiber = nullptr;
 
+// 当前线程在调度器中的工作线程编号(对应本地队列下标) 不是工作线程时为-1
+static thread_local int t_scheduler_worker = -1;
+
+static ConfigVar<uint32_t>::ptr g_local_queue_capacity =
+    Config::Lookup<uint32_t>("scheduler.local_queue.capacity", 256,
+                             "max tasks in each worker's local queue");
+
+static ConfigVar<uint32_t>::ptr g_fiber_pool_max_size =
+    Config::Lookup<uint32_t>("scheduler.fiber_pool.max_size", 64,
+                             "max idle callback fibers kept by each worker");
+
 Scheduler::Scheduler(size_t threads, bool use_caller, const std::string &name)
     : m_name(name) {
   SPADGER_ASSERT(threads > 0);
@@ -45,6 +58,13 @@ Scheduler::Scheduler(size_t threads, bool use_caller, const std::string &name)
     m_rootThread = -1; // 没有主线程
   }
   m_threadCount = threads;
+
+  // caller线程也是一个工作线程
+  size_t workers = m_threadCount + (m_rootFiber ? 1 : 0);
+  for (size_t i = 0; i < workers; ++i) {
+    m_queues.emplace_back(new WorkerQueue);
+  }
+  m_queueCapacity = std::max(1u, g_local_queue_capacity->getValue());
 }
 
 Scheduler::~Scheduler() {
@@ -57,6 +77,8 @@ Scheduler::~Scheduler() {
 
 Scheduler *Scheduler::GetThis() { return t_scheduler; }
 
+int Scheduler::GetWorkerIndex() { return t_scheduler_worker; }
+
 Fiber *Scheduler::GetMainFiber() { return t_scheduler_fiber; }
 
 // start 函数开辟线程
@@ -67,6 +89,7 @@ void Scheduler::start() {
   }
   m_stopping = false;
   SPADGER_ASSERT(m_threads.empty());
+  m_nextWorker = 0;
 
   m_threads.resize(m_threadCount);
   for (size_t i = 0; i < m_threadCount; ++i) {
@@ -99,14 +122,8 @@ void Scheduler::stop() {
   }
 
   m_stopping = true;
-  // first. tickle 多次 存疑 tickle是为了什么 (需要实现才知道)
-  for (size_t i = 0; i < m_threadCount; ++i) {
-    tickle(); // notify all threads to stop
-  }
-
-  if (m_rootFiber) { // 如果有主协程 也要tickle
-    tickle();
-  }
+  // first. 通知所有线程 没有任务的话就可以退出了
+  tickleAll();
 
   // 如果caller线程也需要run的话，就调用call()
   if (m_rootFiber) {
@@ -146,42 +163,36 @@ void Scheduler::run() {
             .get(); // 我寻思 这也没用啊 非主线程的t_scheduler_fiber完全没用
   }
 
+  // 分配本地队列 (多出来的线程只用全局队列)
+  int worker = m_nextWorker++;
+  if (worker >= (int)m_queues.size()) {
+    worker = -1;
+  }
+  t_scheduler_worker = worker;
+  pid_t tid = spadger::GetThreadId();
+  if (worker >= 0) {
+    RWMutex::WriteLock lock(m_workerMutex);
+    m_workerIds[tid] = worker;
+  }
+
   // 空闲协程 当没有任务时执行 也是虚函数需要自己实现
   Fiber::ptr idle_fiber(new Fiber(std::bind(&Scheduler::idle, this)));
   Fiber::ptr cb_fiber;
+  // 回调任务yield之后cb_fiber就交出去了, 等它执行完回到这里时放进池子
+  // 下一个回调任务直接reset复用, 不用重新分配Fiber和栈
+  std::vector<Fiber::ptr> fiber_pool;
+  size_t fiber_pool_max = g_fiber_pool_max_size->getValue();
 
   FiberAndThread ft; // 任务取出来存放的变量
   while (true) {
     ft.reset();
     bool tickle_me = false;
     bool is_active = false;
-    {
-      // 这样scheduler只有一个m_fibers队列 竞争会不会不太好
-
-      MutexType::Lock lock(m_mutex);
-      auto it = m_fibers.begin();
-      while (it != m_fibers.end()) {
-        // 如果指定线程执行 但是又不是那个线程的话 就下一个
-        if (it->thread != -1 && it->thread != spadger::GetThreadId()) {
-          ++it;
-          tickle_me = true; // 虽然自己不能处理 但是可以通知别人处理
-          continue;
-        }
-        SPADGER_ASSERT(it->fiber || it->cb);
-        // 正在执行就算了 问题来了 为什么会有这种情况?? 按道理来说
-        // 应该是先取出来再执行的啊
-        if (it->fiber && it->fiber->getState() == Fiber::EXEC) {
-          ++it;
-          continue;
-        }
-
-        ft = *it;
-        m_fibers.erase(it++);
-        ++m_activeThreadCount;
-        is_active = true;
-        break;
-      }
-      tickle_me |= it != m_fibers.end(); // 还有任务的话也需要唤醒一下别的线程
+    bool busy = false;
+    if (dequeue(ft, worker, tid, tickle_me, busy)) {
+      ++m_activeThreadCount;
+      is_active = true;
+      Clock::Update(); // 任务里的定时器/日志读这个时间
     }
     if (tickle_me) {
       tickle();
@@ -194,16 +205,31 @@ void Scheduler::run() {
       // swapIn执行后 如果没有结束还是要重新放进队列里的
       if (ft.fiber->getState() == Fiber::READY) {
         schedule(ft.fiber);
-      } else if (ft.fiber->getState() != Fiber::TERM &&
-                 ft.fiber->getState() != Fiber::EXCEPT) {
+      } else if (ft.fiber->getState() == Fiber::TERM ||
+                 ft.fiber->getState() == Fiber::EXCEPT) {
+        // 没有别人引用了就回收 (共享栈协程绑定了线程 不回收)
+        // 外面指定了栈大小的协程也不回收 池子里的都是默认大小的栈
+        if (ft.fiber.use_count() == 1 && !ft.fiber->isSharedStack() &&
+            ft.fiber->getStackSize() == Fiber::DefaultStackSize() &&
+            fiber_pool.size() < fiber_pool_max) {
+          ft.fiber->reset(nullptr); // 释放cb捕获的对象
+          fiber_pool.push_back(ft.fiber);
+        }
+      } else {
         ft.fiber->setState(Fiber::HOLD); // 变成HOLD然后呢 也没个动静了
       }
       ft.reset();
     } else if (ft.cb) {
+      if (!cb_fiber && !fiber_pool.empty()) {
+        cb_fiber = fiber_pool.back();
+        fiber_pool.pop_back();
+        ++m_fiberPoolHits; // 只统计从池子里拿的 上一个cb_fiber直接复用不算
+      }
       if (cb_fiber) {
-        cb_fiber->reset(ft.cb); // 重置fiber的function
+        cb_fiber->reset(std::move(ft.cb)); // 重置fiber的function
       } else {
-        cb_fiber.reset(new Fiber(ft.cb));
+        cb_fiber.reset(new Fiber(std::move(ft.cb)));
+        ++m_fiberPoolMisses;
       }
       ft.reset(); // 指针置为空 因为使命已完成 不需要了
       // 开始swapIn
@@ -224,6 +250,10 @@ void Scheduler::run() {
         --m_activeThreadCount;
         continue;
       }
+      if (busy) {
+        // 有任务但是协程还没在别的线程切出去 马上就可以执行 不要去idle
+        continue;
+      }
       if (idle_fiber->getState() == Fiber::TERM) {
         SPADGER_LOG_INFO(g_logger) << "idle fiber term......";
         break;
@@ -237,14 +267,177 @@ void Scheduler::run() {
       }
     }
   }
+  if (worker >= 0) {
+    RWMutex::WriteLock lock(m_workerMutex);
+    m_workerIds.erase(tid);
+  }
+  t_scheduler_worker = -1;
+  Clock::Stop();
+}
+
+// =================================================
+// 任务队列
+// =================================================
+int Scheduler::findWorker(int thread) {
+  RWMutex::ReadLock lock(m_workerMutex);
+  auto it = m_workerIds.find(thread);
+  return it == m_workerIds.end() ? -1 : it->second;
+}
+
+bool Scheduler::enqueue(FiberAndThread &ft, int &target) {
+  ++m_taskCount;
+  target = -1;
+  int worker = t_scheduler == this ? t_scheduler_worker : -1;
+  // 指定线程的任务直接投递到那个线程的信箱 只唤醒它
+  if (ft.thread != -1) {
+    int owner = findWorker(ft.thread);
+    if (owner >= 0) {
+      WorkerQueue &q = *m_queues[owner];
+      MutexType::Lock lock(q.mutex);
+      q.pinned.push_back(std::move(ft));
+      target = owner;
+      return owner != worker; // 投给自己的不用唤醒
+    }
+    // 线程还没有开始run(比如use_caller的主线程) 先放全局队列
+  }
+  // 工作线程自己产生的任务放进自己的队列 不和别人抢全局锁
+  if (ft.thread == -1 && worker >= 0) {
+    WorkerQueue &q = *m_queues[worker];
+    MutexType::Lock lock(q.mutex);
+    if (q.tasks.size() < m_queueCapacity) {
+      // 原来是空的 通知空闲的线程来偷
+      bool need_tickle = q.tasks.empty() && hasIdleThreads();
+      q.tasks.push_back(std::move(ft));
+      return need_tickle;
+    }
+  }
+  MutexType::Lock lock(m_mutex);
+  bool need_tickle = m_fibers.empty();
+  m_fibers.push_back(std::move(ft));
+  return need_tickle;
+}
+
+bool Scheduler::dequeue(FiberAndThread &ft, int worker, pid_t tid,
+                        bool &tickle_me, bool &busy) {
+  if (worker >= 0) {
+    if (popLocal(ft, worker, tickle_me, busy)) {
+      return true;
+    }
+  }
+  if (popGlobal(ft, tid, tickle_me, busy)) {
+    return true;
+  }
+  if (worker >= 0 && steal(worker)) {
+    return popLocal(ft, worker, tickle_me, busy);
+  }
+  return false;
+}
+
+bool Scheduler::popLocal(FiberAndThread &ft, int worker, bool &tickle_me,
+                         bool &busy) {
+  WorkerQueue &q = *m_queues[worker];
+  MutexType::Lock lock(q.mutex);
+  // 先看指定给自己的 别人拿不走
+  if (popQueue(q.pinned, ft, busy)) {
+    return true;
+  }
+  if (popQueue(q.tasks, ft, busy)) {
+    tickle_me |= !q.tasks.empty() && hasIdleThreads();
+    return true;
+  }
+  return false;
+}
+
+bool Scheduler::popQueue(RingQueue<FiberAndThread> &tasks,
+                         FiberAndThread &ft, bool &busy) {
+  for (size_t n = tasks.size(); n > 0; --n) {
+    FiberAndThread &front = tasks.front();
+    // 协程还在别的线程上没切出去 放到后面
+    if (front.fiber && front.fiber->getState() == Fiber::EXEC) {
+      FiberAndThread tmp = std::move(front);
+      tasks.pop_front();
+      tasks.push_back(std::move(tmp));
+      busy = true;
+      continue;
+    }
+    ft = std::move(front);
+    tasks.pop_front();
+    --m_taskCount;
+    return true;
+  }
+  return false;
+}
+
+bool Scheduler::popGlobal(FiberAndThread &ft, pid_t tid, bool &tickle_me,
+                          bool &busy) {
+  MutexType::Lock lock(m_mutex);
+  for (size_t i = 0; i < m_fibers.size(); ++i) {
+    FiberAndThread &it = m_fibers[i];
+    // 如果指定线程执行 但是又不是那个线程的话 就下一个
+    if (it.thread != -1 && it.thread != tid) {
+      tickle_me = true; // 虽然自己不能处理 但是可以通知别人处理
+      continue;
+    }
+    SPADGER_ASSERT(it.fiber || it.cb);
+    // 正在执行就算了 问题来了 为什么会有这种情况?? 按道理来说
+    // 应该是先取出来再执行的啊
+    if (it.fiber && it.fiber->getState() == Fiber::EXEC) {
+      busy = true;
+      continue;
+    }
+
+    ft = std::move(it);
+    m_fibers.erase(i);
+    --m_taskCount;
+    tickle_me |= i < m_fibers.size(); // 还有任务的话也需要唤醒一下别的线程
+    return true;
+  }
+  return false;
+}
+
+bool Scheduler::steal(int worker) {
+  // 从其他线程队列的尾部偷一半放进自己的队列
+  // 同一时刻只拿一把锁 避免两个线程互相偷的时候死锁
+  static thread_local std::vector<FiberAndThread> stolen;
+  stolen.clear();
+  size_t count = m_queues.size();
+  for (size_t i = 1; i < count && stolen.empty(); ++i) {
+    WorkerQueue &victim = *m_queues[(worker + i) % count];
+    MutexType::Lock lock(victim.mutex);
+    size_t n = (victim.tasks.size() + 1) / 2;
+    while (n--) {
+      stolen.push_back(std::move(victim.tasks.back()));
+      victim.tasks.pop_back();
+    }
+  }
+  if (stolen.empty()) {
+    return false;
+  }
+  WorkerQueue &q = *m_queues[worker];
+  MutexType::Lock lock(q.mutex);
+  // 偷的时候是倒着拿的 保持原来的先后顺序
+  for (auto it = stolen.rbegin(); it != stolen.rend(); ++it) {
+    q.tasks.push_back(std::move(*it));
+  }
+  return true;
 }
 
 void Scheduler::tickle() { SPADGER_LOG_INFO(g_logger) << "tickle"; }
 
+void Scheduler::tickleWorker(int worker) { tickle(); }
+
+void Scheduler::tickleAll() {
+  for (size_t i = 0; i < m_threadCount; ++i) {
+    tickle(); // notify all threads to stop
+  }
+  if (m_rootFiber) { // 如果有主协程 也要tickle
+    tickle();
+  }
+}
+
 bool Scheduler::stopping() {
-  MutexType::Lock lock(m_mutex);
-  return m_autoStop && m_stopping && m_fibers.empty() &&
-         m_activeThreadCount == 0;
+  return m_autoStop && m_stopping && m_taskCount == 0 &&
+         m_activeThreadCount == 0 && m_externalWaits == 0;
 }
 
 void Scheduler::idle() {
@@ -273,7 +466,18 @@ std::ostream &Scheduler::dump(std::ostream &os) {
   MutexType::Lock lokc(m_mutex); // 输出之前当然要加锁
   os << "[Scheduler name=" << m_name << " size=" << m_threadCount
      << " active_count=" << m_activeThreadCount
-     << " idle_count=" << m_idleThreadCount << " stopping=" << m_stopping
+     << " idle_count=" << m_idleThreadCount << " stopping=" << m_stopping;
+  uint64_t hits = m_fiberPoolHits;
+  uint64_t misses = m_fiberPoolMisses;
+  os << " global_queue=" << m_fibers.size() << " local_queues=";
+  for (size_t i = 0; i < m_queues.size(); ++i) {
+    MutexType::Lock lock(m_queues[i]->mutex);
+    os << (i ? "," : "") << m_queues[i]->tasks.size() << "/"
+       << m_queues[i]->pinned.size();
+  }
+  os << " fiber_pool_hit=" << hits << " fiber_pool_miss=" << misses
+     << " fiber_pool_hit_rate="
+     << (hits + misses ? hits * 100.0 / (hits + misses) : 0.0) << "%"
      << " ]" << std::endl
      << "   ";
   for (size_t i = 0; i < m_threads.size(); ++i) {
@@ -15,10 +15,68 @@
 #include <atomic>
 #include <list>
 #include <memory>
+#include <unordered_map>
 #include <vector>
 
 namespace spadger {
 
+// 环形队列: 调度队列用 容量只增不减, 稳定之后入队出队都不分配内存
+// (std::deque每几个元素就要分配/释放一块, std::list每个元素一个节点)
+template <class T> class RingQueue {
+public:
+  bool empty() const { return m_size == 0; }
+  size_t size() const { return m_size; }
+  T &operator[](size_t i) { return m_buf[(m_head + i) & (m_buf.size() - 1)]; }
+  T &front() { return (*this)[0]; }
+  T &back() { return (*this)[m_size - 1]; }
+
+  void push_back(T &&v) {
+    if (m_size == m_buf.size()) {
+      grow();
+    }
+    (*this)[m_size] = std::move(v);
+    ++m_size;
+  }
+  void pop_front() {
+    front() = T(); // 释放持有的协程和回调
+    m_head = (m_head + 1) & (m_buf.size() - 1);
+    --m_size;
+  }
+  void pop_back() {
+    back() = T();
+    --m_size;
+  }
+  // 删除中间的元素 离哪头近就挪哪头
+  void erase(size_t i) {
+    if (i < m_size / 2) {
+      for (; i > 0; --i) {
+        (*this)[i] = std::move((*this)[i - 1]);
+      }
+      pop_front();
+    } else {
+      for (; i + 1 < m_size; ++i) {
+        (*this)[i] = std::move((*this)[i + 1]);
+      }
+      pop_back();
+    }
+  }
+
+private:
+  void grow() {
+    std::vector<T> buf(m_buf.empty() ? 16 : m_buf.size() * 2); // 保持2的幂
+    for (size_t i = 0; i < m_size; ++i) {
+      buf[i] = std::move((*this)[i]);
+    }
+    m_buf.swap(buf);
+    m_head = 0;
+  }
+
+private:
+  std::vector<T> m_buf;
+  size_t m_head = 0;
+  size_t m_size = 0;
+};
+
 class Scheduler {
 public:
   /// @brief Construct a scheduler
@@ -37,17 +95,21 @@ public:
   void start();
   void stop();
   std::ostream &dump(std::ostream &);
+  // 协程挂起等调度器以外的线程(比如OffloadPool)来schedule它
+  // 等的时候调度器不能停 协程回来之后自己减掉
+  void addExternalWait() { ++m_externalWaits; }
+  void delExternalWait() { --m_externalWaits; }
   void switchTo(int thread = -1); // 默认没有指定 没有指定 就 不操作
 
   // 单个加入
   template <typename FiberOrCb> void schedule(FiberOrCb fc, int thread = -1) {
-    bool need_tickle;
-    {
-      MutexType::Lock lock(m_mutex);
-      need_tickle = scheduleNoLock(fc, thread);
+    FiberAndThread ft(std::move(fc), thread);
+    if (!ft.cb && !ft.fiber) {
+      return;
     }
-    if (need_tickle) {
-      tickle();
+    int target = -1;
+    if (enqueue(ft, target)) {
+      wake(target);
     }
   }
 
@@ -55,12 +117,13 @@ public:
   template <typename InputIterator>
   void schedule(InputIterator begin, InputIterator end) {
     bool need_tickle = false;
-    {
-      MutexType::Lock lock(m_mutex);
-      while (begin != end) {
-        need_tickle = scheduleNoLock(&*begin, -1) || need_tickle;
-        begin++;
+    while (begin != end) {
+      FiberAndThread ft(&*begin, -1);
+      if (ft.cb || ft.fiber) {
+        int target = -1;
+        need_tickle = enqueue(ft, target) || need_tickle;
       }
+      begin++;
     }
     if (need_tickle) {
       tickle();
@@ -69,39 +132,45 @@ public:
 
 protected:
   virtual void tickle(); // notify
+  // 只唤醒指定的工作线程(下标) 默认和tickle()一样
+  virtual void tickleWorker(int worker);
+  // 唤醒所有线程(stop的时候用)
+  virtual void tickleAll();
   void run();
   virtual bool stopping(); // check if stopped
   virtual void idle();     // 没有发任务的时候怎么处理
   void setThis();          // 设置线程的scheduler为this
   bool hasIdleThreads() { return m_idleThreadCount > 0; }
-
-private:
-  template <typename FiberOrCb> bool scheduleNoLock(FiberOrCb fc, int thread) {
-    // 判断原来协程队列是否是空的 用于唤醒执行
-    bool need_tickle = m_fibers.empty();
-    FiberAndThread ft(fc, thread);
-    if (ft.cb || ft.fiber) {
-      m_fibers.push_back(ft);
-    }
-    return need_tickle;
-  }
+  // 当前线程在调度器中的工作线程下标 不是工作线程返回-1
+  static int GetWorkerIndex();
+  size_t getWorkerCount() const { return m_queues.size(); }
 
 private:
   struct FiberAndThread {
     Fiber::ptr fiber;
-    std::function<void()> cb;
+    Task cb;
     int thread; // 指定在哪一个线程执行
 
-    FiberAndThread(Fiber::ptr f, int thr) : fiber(f), thread(thr) {}
+    FiberAndThread(Fiber::ptr f, int thr) : fiber(f), thread(thr) {
+      bindThread();
+    }
     FiberAndThread(Fiber::ptr *f, int thr) : thread(thr) {
       fiber.swap(*f); // shared_ptr整体swap 防止出现引用释放问题
+      bindThread();
     }
-    FiberAndThread(std::function<void()> f, int thr) : cb(f), thread(thr) {}
-    FiberAndThread(std::function<void()> *f, int thr) : thread(thr) {
-      cb.swap(*f); // 图啥呀???
+    FiberAndThread(Task f, int thr) : cb(std::move(f)), thread(thr) {}
+    FiberAndThread(Task *f, int thr) : thread(thr) {
+      cb.swap(*f); // 直接拿走 不用拷贝
     }
     FiberAndThread() : thread(-1) {}
 
+    // 共享栈协程的栈内容只能恢复到原来线程的共享栈上 必须回到那个线程执行
+    void bindThread() {
+      if (thread == -1 && fiber) {
+        thread = fiber->getBoundThread();
+      }
+    }
+
     void reset() {
       fiber = nullptr;
       cb = nullptr;
@@ -109,10 +178,41 @@ private:
     }
   };
 
+  // 每个工作线程自己的任务队列 有容量上限 满了放到全局队列
+  // 本线程从头部取, 其他空闲线程从尾部偷一半
+  // pinned: 指定在这个线程执行的任务 只有自己会取 不会被偷
+  struct WorkerQueue {
+    MutexType mutex;
+    RingQueue<FiberAndThread> tasks;
+    RingQueue<FiberAndThread> pinned;
+  };
+
+  // 放入任务队列, 返回是否需要tickle, target为需要唤醒的线程(-1为任意)
+  bool enqueue(FiberAndThread &ft, int &target);
+  void wake(int target) { target < 0 ? tickle() : tickleWorker(target); }
+  // 线程id -> 工作线程下标 还没开始run的线程返回-1
+  int findWorker(int thread);
+  // 取一个可以在当前线程执行的任务: 本地队列 -> 全局队列 -> 偷别人的
+  // tickle_me: 还有剩余任务需要通知别人 busy: 有任务但协程还没切出去
+  bool dequeue(FiberAndThread &ft, int worker, pid_t tid, bool &tickle_me,
+               bool &busy);
+  bool popLocal(FiberAndThread &ft, int worker, bool &tickle_me, bool &busy);
+  bool popQueue(RingQueue<FiberAndThread> &tasks, FiberAndThread &ft,
+                bool &busy);
+  bool popGlobal(FiberAndThread &ft, pid_t tid, bool &tickle_me, bool &busy);
+  bool steal(int worker);
+
 private:
   MutexType m_mutex;                  // 锁
   std::vector<Thread::ptr> m_threads; // 线程池
-  std::list<FiberAndThread> m_fibers; // 协程池
+  RingQueue<FiberAndThread> m_fibers; // 全局队列(外部线程提交/指定线程/本地队列满)
+  std::vector<std::unique_ptr<WorkerQueue>> m_queues; // 工作线程本地队列
+  size_t m_queueCapacity = 0;
+  std::atomic<int> m_nextWorker = {0};   // 分配工作线程的队列下标
+  RWMutex m_workerMutex;
+  std::unordered_map<int, int> m_workerIds; // 线程id -> 工作线程下标
+  std::atomic<size_t> m_taskCount = {0}; // 所有队列里的任务数
+  std::atomic<size_t> m_externalWaits = {0};
   Fiber::ptr m_rootFiber; // 调度器主协程 (use_caller为true才有用)
   std::string m_name;     // 调度器名称
 
@@ -121,6 +221,9 @@ protected:
   size_t m_threadCount = 0; // 主线程之外还有几个线程
   std::atomic<size_t> m_activeThreadCount = {0};
   std::atomic<size_t> m_idleThreadCount = {0};
+  // 回调任务从协程池里取到协程和新建协程的次数
+  std::atomic<uint64_t> m_fiberPoolHits = {0};
+  std::atomic<uint64_t> m_fiberPoolMisses = {0};
   bool m_stopping = true; // 初始状态为停止状态
   bool m_autoStop = false;
   // m_rootThread是主线程的ID 如果use_caller=false的话，就没有这个所谓的主线程了
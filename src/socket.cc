@@ -70,7 +70,7 @@ Socket::~Socket() { close(); }
 
 int64_t Socket::getSendTimeout() {
   // 使用fd_manager中的FdCtx管理timeout
-  FdCtx::ptr ctx = FdMgr::GetInstance()->get(m_sock);
+  FdCtx *ctx = FdMgr::GetInstance()->get(m_sock);
   if (ctx) {
     return ctx->getTimeout(SO_SNDTIMEO);
   }
@@ -85,7 +85,7 @@ void Socket::setSendTimeout(uint64_t v) {
 }
 
 int64_t Socket::getRecvTimeout() {
-  FdCtx::ptr ctx = FdMgr::GetInstance()->get(m_sock);
+  FdCtx *ctx = FdMgr::GetInstance()->get(m_sock);
   if (ctx) {
     return ctx->getTimeout(SO_RCVTIMEO);
   }
@@ -152,7 +152,7 @@ bool Socket::newSock() {
 /// @param socket
 /// @return true if succeed.
 bool Socket::init(int socket) {
-  FdCtx::ptr ctx = FdMgr::GetInstance()->get(socket);
+  FdCtx *ctx = FdMgr::GetInstance()->get(socket);
   if (ctx) {
     m_sock = socket;
     m_isConnected = true;
@@ -389,8 +389,8 @@ Address::ptr Socket::getRemoteAddress() {
 }
 
 Address::ptr Socket::getLocalAddress() {
-  if (m_remoteAddress) {
-    return m_remoteAddress;
+  if (m_localAddress) {
+    return m_localAddress;
   }
 
   Address::ptr result;
@@ -408,9 +408,9 @@ Address::ptr Socket::getLocalAddress() {
     result.reset(new UnknownAddress(m_family));
   }
   socklen_t addrlen = result->getAddrLen();
-  if (getpeername(m_sock, result->getAddr(), &addrlen)) {
+  if (getsockname(m_sock, result->getAddr(), &addrlen)) {
     SPADGER_LOG_ERROR(g_logger)
-        << "getpeername error sock=" << m_sock << " errno=" << errno
+        << "getsockname error sock=" << m_sock << " errno=" << errno
         << " error=" << strerror(errno);
     return Address::ptr(new UnknownAddress(m_family));
   }
@@ -0,0 +1,144 @@
+/*
+ * @Author: lxk
+ * @Date: 2022-10-27 10:21:36
+ * @LastEditors: lxk
+ * @LastEditTime: 2022-10-27 15:48:02
+ */
+
+#ifndef __SPADGER_TASK_H__
+#define __SPADGER_TASK_H__
+
+#include <cstddef>
+#include <functional>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+namespace spadger {
+
+// ================================================================
+// Task: 只能移动的void()可调用对象, 用来代替std::function<void()>
+//   1. 不要求可拷贝, 调度队列里只需要移动
+//   2. 对象不超过INLINE_SIZE字节时直接放在内部缓冲区里, 不需要malloc
+//      (std::function只有16字节, 捕获两个shared_ptr就要分配了)
+// ================================================================
+class Task {
+public:
+  static const size_t INLINE_SIZE = 64;
+
+  Task() {}
+  Task(std::nullptr_t) {}
+
+  template <class F, class D = typename std::decay<F>::type,
+            class = typename std::enable_if<!std::is_same<D, Task>::value>::type,
+            class = decltype(std::declval<D &>()())>
+  Task(F &&f) {
+    if (IsEmpty(f)) {
+      return; // 空的函数指针和std::function 还是空的Task
+    }
+    init<D>(std::forward<F>(f), std::integral_constant<bool, FitsInline<D>()>());
+  }
+
+  Task(Task &&other) noexcept { moveFrom(other); }
+  Task &operator=(Task &&other) noexcept {
+    if (this != &other) {
+      reset();
+      moveFrom(other);
+    }
+    return *this;
+  }
+  Task &operator=(std::nullptr_t) {
+    reset();
+    return *this;
+  }
+  Task(const Task &) = delete;
+  Task &operator=(const Task &) = delete;
+  ~Task() { reset(); }
+
+  explicit operator bool() const { return m_ops != nullptr; }
+  void operator()() { m_ops->call(m_buf); }
+
+  void reset() {
+    if (m_ops) {
+      m_ops->destroy(m_buf);
+      m_ops = nullptr;
+    }
+  }
+  void swap(Task &other) {
+    Task tmp(std::move(other));
+    other = std::move(*this);
+    *this = std::move(tmp);
+  }
+  // 是否放在内部缓冲区(没有分配内存)
+  bool isInline() const { return m_ops && m_ops->inlined; }
+
+private:
+  struct Ops {
+    void (*call)(void *buf);
+    void (*move)(void *dst, void *src); // 移动到dst 并析构src
+    void (*destroy)(void *buf);
+    bool inlined;
+  };
+
+  template <class D> struct InlineOps {
+    static void Call(void *buf) { (*static_cast<D *>(buf))(); }
+    static void Move(void *dst, void *src) {
+      new (dst) D(std::move(*static_cast<D *>(src)));
+      static_cast<D *>(src)->~D();
+    }
+    static void Destroy(void *buf) { static_cast<D *>(buf)->~D(); }
+    static const Ops ops;
+  };
+
+  template <class D> struct HeapOps {
+    static void Call(void *buf) { (**static_cast<D **>(buf))(); }
+    static void Move(void *dst, void *src) {
+      *static_cast<D **>(dst) = *static_cast<D **>(src);
+    }
+    static void Destroy(void *buf) { delete *static_cast<D **>(buf); }
+    static const Ops ops;
+  };
+
+  template <class D> static constexpr bool FitsInline() {
+    return sizeof(D) <= INLINE_SIZE &&
+           alignof(D) <= alignof(std::max_align_t) &&
+           std::is_nothrow_move_constructible<D>::value;
+  }
+  template <class D, class F> void init(F &&f, std::true_type) {
+    new (m_buf) D(std::forward<F>(f));
+    m_ops = &InlineOps<D>::ops;
+  }
+  template <class D, class F> void init(F &&f, std::false_type) {
+    *reinterpret_cast<D **>(m_buf) = new D(std::forward<F>(f));
+    m_ops = &HeapOps<D>::ops;
+  }
+
+  template <class D> static bool IsEmpty(const D &) { return false; }
+  template <class R, class... Args> static bool IsEmpty(R (*f)(Args...)) {
+    return f == nullptr;
+  }
+  template <class Sig> static bool IsEmpty(const std::function<Sig> &f) {
+    return !f;
+  }
+
+  void moveFrom(Task &other) {
+    m_ops = other.m_ops;
+    if (m_ops) {
+      m_ops->move(m_buf, other.m_buf);
+      other.m_ops = nullptr;
+    }
+  }
+
+private:
+  alignas(std::max_align_t) unsigned char m_buf[INLINE_SIZE];
+  const Ops *m_ops = nullptr;
+};
+
+template <class D>
+const Task::Ops Task::InlineOps<D>::ops = {&Call, &Move, &Destroy, true};
+template <class D>
+const Task::Ops Task::HeapOps<D>::ops = {&Call, &Move, &Destroy, false};
+
+} // namespace spadger
+
+#endif
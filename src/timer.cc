@@ -5,96 +5,99 @@
  * @LastEditTime: 2022-10-23 10:54:15
  */
 #include "timer.h"
+#include "clock.h"
 #include "util.h"
+#include <algorithm>
 
 namespace spadger {
 
-bool Timer::Comparator::operator()(const Timer::ptr &lhs,
-                                   const Timer::ptr &rhs) const {
-  if (!lhs && !rhs) {
-    return false;
-  }
-  if (!lhs) {
-    return true;
-  }
-  if (!rhs) {
-    return false;
-  }
-  // 先比较next时间，再比较地址
-  if (lhs->m_next < rhs->m_next) {
-    return true;
-  } else if (lhs->m_next > rhs->m_next) {
-    return false;
-  } else {
-    return lhs.get() < rhs.get();
-  }
-}
-
 // ================================================================
 // ======================   Timer  ===============================
 // ================================================================
 
 // ------------------------ Timer() --------------------------
-Timer::Timer(uint64_t ms, std::function<void()> cb, bool recurring,
+Timer::Timer(uint64_t us, uint64_t slack_us, Task cb, bool recurring,
              TimerManager *manager)
-    : m_recurring(recurring), m_ms(ms), m_cb(cb), m_manager(manager) {
-  m_next = m_ms + getCurrentMS();
+    : m_recurring(recurring), m_us(us), m_slack(slack_us), m_manager(manager) {
+  if (m_recurring) {
+    m_recurringCb = std::make_shared<Task>(std::move(cb));
+  } else {
+    m_cb = std::move(cb);
+  }
+  m_next = m_us + Clock::NowUS();
+  coalesce();
 }
 
-// 只是构造一个含有m_next的Timer,方便临时使用,比如比较查找
-Timer::Timer(uint64_t next) : m_next(next) {}
+// ------------------------ coalesce ----------------------------
+// 取不超过slack的最大的2的幂p 到期时间向上对齐到p的倍数
+// slack相近的定时器对齐到同一个时间点 进同一个格子 一次epoll_wait返回一起处理
+void Timer::coalesce() {
+  m_expires = m_next;
+  if (m_slack == 0) {
+    return;
+  }
+  uint64_t mask = (1ull << (63 - __builtin_clzll(m_slack))) - 1;
+  m_expires = (m_next + mask) & ~mask;
+}
 
 // ------------------------ cancel ----------------------------
 bool Timer::cancel() {
-  TimerManager::RWMutexType::WriteLock lock(m_manager->m_mutex);
-  if (m_cb) {
-    m_cb = nullptr;
-    auto it = m_manager->m_timers.find(shared_from_this());
-    m_manager->m_timers.erase(it);
-    return true;
+  // 已经执行过(比如在自己的回调里cancel)或者已经取消了 不用加锁
+  if (!m_linked.load(std::memory_order_acquire)) {
+    return false;
   }
-  return false;
+  // 回调和时间轮的引用放到锁外面释放 析构的时候可能做很多事
+  Timer::ptr self;
+  Task cb;
+  std::shared_ptr<Task> recurring_cb;
+  TimerWheel::RWMutexType::WriteLock lock(m_wheel->m_mutex);
+  if (!m_linked) {
+    return false;
+  }
+  cb.swap(m_cb);
+  recurring_cb.swap(m_recurringCb);
+  self = m_wheel->wheelRemove(this);
+  lock.unlock();
+  return true;
 }
 
 // ------------------------ reset -----------------------------
 bool Timer::reset(uint64_t ms, bool from_now) {
-  if (m_ms == ms && from_now == false) {
+  uint64_t us = ms * 1000;
+  if (m_us == us && from_now == false) {
     return true; // does not need to change.
   }
-  TimerManager::RWMutexType::WriteLock lock(m_manager->m_mutex);
-  auto it = m_manager->m_timers.find(shared_from_this());
-  if (it == m_manager->m_timers.end()) {
-    return false;
+  TimerWheel::RWMutexType::WriteLock lock(m_wheel->m_mutex);
+  if (!m_linked) {
+    return false; // 已经取消或者执行过了
   }
-  m_manager->m_timers.erase(it);
+  Timer::ptr self = m_wheel->wheelRemove(this);
   uint64_t last_start = 0;
   if (from_now) {
-    last_start = time(0);
+    last_start = Clock::NowUS();
   } else {
-    last_start = m_next - m_ms;
+    last_start = m_next - m_us;
   }
-  m_ms = ms;
-  m_next = last_start + m_ms;
+  m_us = us;
+  m_next = last_start + m_us;
+  coalesce();
   // addTimer中有检测是否当前事件出于最前面，如果是的话，需要唤醒查看是否到计时的时间了
-  m_manager->addTimer(shared_from_this(), lock);
+  m_manager->addTimer(self, lock);
   return true;
 }
 
 // ------------------------ refresh -----------------------------
 bool Timer::refresh() {
   // 以当前时刻为准设置m_next
-  TimerManager::RWMutexType::WriteLock lock(m_manager->m_mutex);
-  if (!m_cb) {
-    return false;
-  }
-  auto it = m_manager->m_timers.find(shared_from_this());
-  if (it == m_manager->m_timers.end()) {
+  TimerWheel::RWMutexType::WriteLock lock(m_wheel->m_mutex);
+  if (!m_linked) {
     return false;
   }
-  m_manager->m_timers.erase(it);
-  m_next = getCurrentMS() + m_ms;
+  Timer::ptr self = m_wheel->wheelRemove(this);
+  m_next = Clock::NowUS() + m_us;
+  coalesce();
   // 直接插入，因为时间只会更加靠后面 不会向前
-  m_manager->m_timers.insert(shared_from_this());
+  m_wheel->wheelAdd(self);
   return true;
 }
 
@@ -102,130 +105,399 @@ bool Timer::refresh() {
 // ======================   TimerManager  =========================
 // ================================================================
 
-TimerManager::TimerManager() { m_previousTime = getCurrentMS(); }
+TimerManager::TimerManager(size_t shards) {
+  if (shards == 0) {
+    shards = 1;
+  }
+  m_wheels.reserve(shards);
+  for (size_t i = 0; i < shards; ++i) {
+    m_wheels.emplace_back(new TimerWheel(i));
+  }
+}
 
 TimerManager::~TimerManager() {}
 
+TimerWheel *TimerManager::currentWheel() {
+  int shard = getTimerShard();
+  if (shard < 0 || shard >= (int)m_wheels.size()) {
+    shard = 0;
+  }
+  return m_wheels[shard].get();
+}
+
 // ------------------------ addTimer --------------------------
 // 普通定时器
-Timer::ptr TimerManager::addTimer(uint64_t ms, std::function<void()> cb,
-                                  bool recurring) {
-  Timer::ptr timer(new Timer(ms, cb, recurring, this));
-  RWMutexType::WriteLock lock(m_mutex);
-  addTimer(timer, lock);
-  return timer;
+Timer::ptr TimerManager::addTimer(uint64_t ms, Task cb, bool recurring,
+                                  uint64_t slack_ms) {
+  return addTimerUS(ms * 1000, std::move(cb), recurring, slack_ms * 1000);
 }
 
-static void OnTimer(std::weak_ptr<void> weak_cond, std::function<void()> cb) {
-  // lock()如果对象还在，返回shared_ptr，否则返回空指针
-  std::shared_ptr<void> tmp = weak_cond.lock();
-  if (tmp) {
-    cb();
-  }
+Timer::ptr TimerManager::addTimerUS(uint64_t us, Task cb, bool recurring,
+                                    uint64_t slack_us) {
+  Timer::ptr timer(new Timer(us, slack_us, std::move(cb), recurring, this));
+  timer->m_wheel = currentWheel();
+  RWMutexType::WriteLock lock(timer->m_wheel->m_mutex);
+  addTimer(timer, lock);
+  return timer;
 }
 
 // ------------------------ addConditionTimer --------------------------
 // 条件定时器，在满足条件的状态下才会执行
-// 其实就是在cb外再包装一层，见上文的OnTimer
-Timer::ptr TimerManager::addConditionTimer(uint64_t ms,
-                                           std::function<void()> cb,
+// 条件记在Timer上 到期时检查(见listExpiredCb) 不用在cb外再包装一层
+Timer::ptr TimerManager::addConditionTimer(uint64_t ms, Task cb,
                                            std::weak_ptr<void> weak_cond,
-                                           bool recurring) {
-  return addTimer(ms, std::bind(&OnTimer, weak_cond, cb), recurring);
+                                           bool recurring, uint64_t slack_ms) {
+  Timer::ptr timer(
+      new Timer(ms * 1000, slack_ms * 1000, std::move(cb), recurring, this));
+  timer->m_conditional = true;
+  timer->m_cond = weak_cond;
+  timer->m_wheel = currentWheel();
+  RWMutexType::WriteLock lock(timer->m_wheel->m_mutex);
+  addTimer(timer, lock);
+  return timer;
+}
+
+// ------------------------ restartTimer --------------------------
+bool TimerManager::restartTimer(const Timer::ptr &timer, uint64_t ms, Task cb,
+                                uint64_t slack_ms) {
+  if (timer->m_manager != this) {
+    return false;
+  }
+  TimerWheel *wheel = currentWheel();
+  TimerWheel *old = timer->m_wheel;
+  if (old != wheel) {
+    // 在原来的分片上到期时 listExpired持有锁把回调移出去
+    // 加一下锁保证它做完了 再改定时器
+    RWMutexType::ReadLock lock(old->m_mutex);
+    if (timer->m_linked) {
+      return false;
+    }
+  }
+  RWMutexType::WriteLock lock(wheel->m_mutex);
+  if (timer->m_linked) {
+    return false;
+  }
+  timer->m_wheel = wheel;
+  timer->m_recurring = false;
+  timer->m_recurringCb.reset();
+  timer->m_conditional = false;
+  timer->m_cond.reset();
+  timer->m_cb = std::move(cb);
+  timer->m_us = ms * 1000;
+  timer->m_slack = slack_ms * 1000;
+  timer->m_next = Clock::NowUS() + timer->m_us;
+  timer->coalesce();
+  addTimer(timer, lock);
+  return true;
 }
 
 // ------------------------ getNextTimer --------------------------
 // 获取下一个最近到时的timer
 uint64_t TimerManager::getNextTimer() {
-  RWMutexType::ReadLock lock(m_mutex);
-  m_tickled = false; // 前面没有行为需要去唤醒了
-  if (m_timers.empty()) {
-    return ~0ull;
-  }
-  const Timer::ptr &next = *m_timers.begin();
-  uint64_t now_ms = getCurrentMS();
-  if (now_ms >= next->m_next) {
-    return 0; // 如果已经错过第一个了，只能返回0了
-  } else {
-    return next->m_next - now_ms;
+  uint64_t next = getNextTimerUS();
+  return next == ~0ull ? next : (next + 999) / 1000;
+}
+
+uint64_t TimerManager::getNextTimerUS() {
+  uint64_t next = ~0ull;
+  for (size_t i = 0; i < m_wheels.size(); ++i) {
+    next = std::min(next, m_wheels[i]->getNext());
   }
+  return next;
+}
+
+uint64_t TimerManager::getNextTimerUS(int shard) {
+  return m_wheels[shard]->getNext();
 }
 
 // ------------------------ listExpiredCb --------------------------
 // 取出所有的过时的timer的cb
-void TimerManager::listExpiredCb(std::vector<std::function<void()>> &cbs) {
-  uint64_t now_ms = getCurrentMS();
-  {
-    RWMutexType::ReadLock lock(m_mutex);
-    if (m_timers.empty()) {
-      return;
+void TimerManager::listExpiredCb(std::vector<Task> &cbs) {
+  for (size_t i = 0; i < m_wheels.size(); ++i) {
+    m_wheels[i]->listExpired(cbs);
+  }
+}
+
+void TimerManager::listExpiredCb(std::vector<Task> &cbs, int shard) {
+  m_wheels[shard]->listExpired(cbs);
+}
+
+uint64_t TimerManager::getTimerDeadline(int shard) const {
+  return m_wheels[shard]->m_deadline.load(std::memory_order_relaxed);
+}
+
+// ------------------------ addTimer(timer, lock) --------------------------
+// lock是timer所在分片的写锁
+void TimerManager::addTimer(Timer::ptr timer, RWMutexType::WriteLock &lock) {
+  TimerWheel *wheel = timer->m_wheel;
+  bool need_to_notify = wheel->add(timer);
+  lock.unlock();
+
+  if (need_to_notify) {
+    onTimerInsertedAtFront(wheel->m_index);
+  }
+}
+
+// ------------------------ hasTimer() --------------------------
+bool TimerManager::hasTimer() const {
+  for (size_t i = 0; i < m_wheels.size(); ++i) {
+    if (m_wheels[i]->m_count.load(std::memory_order_relaxed)) {
+      return true;
     }
   }
+  return false;
+}
+
+// ================================================================
+// ======================   TimerWheel  ===========================
+// ================================================================
+
+// 第level层的格子在m_slots中从哪开始/有几格/每格多少us(2的幂)/能表示多远
+static inline int LevelOffset(int level) {
+  return level == 0 ? 0 : 256 + (level - 1) * 64;
+}
+static inline int LevelSize(int level) { return level == 0 ? 256 : 64; }
+static inline int LevelShift(int level) {
+  return level == 0 ? 0 : 8 + (level - 1) * 6;
+}
+static inline uint64_t LevelSpan(int level) { return 1ull << (8 + level * 6); }
+
+TimerWheel::TimerWheel(int index) : m_index(index) {
+  m_wheelTime = Clock::NowUS();
+}
+
+TimerWheel::~TimerWheel() {
+  // 时间轮里的定时器持有自己的引用 要断开
+  std::vector<Timer::ptr> timers;
+  wheelTake(m_expired, timers);
+  for (int i = 0; i < WHEEL_SLOTS; ++i) {
+    wheelTake(m_slots[i], timers);
+  }
+}
+
+// ------------------------ add --------------------------
+bool TimerWheel::add(const Timer::ptr &timer) {
+  wheelAdd(timer);
+  // 比poller要睡到的时间还早 就需要去唤醒了 如果m_tickled = true,
+  // 表明前面有插入需要唤醒但是还没有被唤醒(因为醒来之后肯定是要调用
+  // getNext的，就会设置m_tickled = false了)，也就是说信号只需要设置一次即可
+  if (timer->m_expires < m_nextHint && !m_tickled) {
+    m_tickled = true;
+    return true;
+  }
+  return false;
+}
+
+// ------------------------ getNext --------------------------
+uint64_t TimerWheel::getNext() {
+  // 要记下m_nextHint 所以用写锁
   RWMutexType::WriteLock lock(m_mutex);
-  if (m_timers.empty()) {
+  m_tickled = false; // 前面没有行为需要去唤醒了
+  if (m_count == 0) {
+    m_nextHint = ~0ull;
+    return ~0ull;
+  }
+  uint64_t next = wheelEarliest();
+  m_nextHint = next;
+  m_deadline = next;
+  uint64_t now = Clock::NowUS();
+  if (now >= next) {
+    return 0; // 如果已经错过第一个了，只能返回0了
+  } else {
+    return next - now;
+  }
+}
+
+// ------------------------ listExpired --------------------------
+void TimerWheel::listExpired(std::vector<Task> &cbs) {
+  // 单调时钟 不会往回走 不用再判断是不是调了时间
+  uint64_t now = Clock::NowUS();
+  if (m_count == 0 || m_deadline > now) {
     return;
   }
-  bool rollover = detectClockRollover(now_ms);
-  // 没有回调时间并且第一个计时器到时也在之后，那就没有过期的计时器事件了
-  if (!rollover && ((*m_timers.begin())->m_next > now_ms)) {
+  RWMutexType::WriteLock lock(m_mutex);
+  if (m_count == 0) {
     return;
   }
 
-  Timer::ptr now_timer(new Timer(now_ms));
-  // lower_bound和upper_bound的效果是一样的 因为不会相等
-  auto it = rollover ? m_timers.end() : m_timers.lower_bound(now_timer);
-  while (it != m_timers.end() && (*it)->m_next == now_ms) {
-    ++it;
-  }
   std::vector<Timer::ptr> expired;
-  expired.insert(expired.begin(), m_timers.begin(), it);
-  m_timers.erase(m_timers.begin(), it);
+  // 加进来的时候就已经过期了的
+  wheelTake(m_expired, expired);
+  wheelAdvance(now, expired);
 
-  cbs.reserve(expired.size());
+  cbs.reserve(cbs.size() + expired.size());
   for (auto &timer : expired) {
-    cbs.push_back(timer->m_cb);
+    // lock()如果对象还在，返回shared_ptr，否则返回空指针
+    if (timer->m_conditional && !timer->m_cond.lock()) {
+      // 条件不在了 循环定时器也不用再继续了
+      timer->m_cb = nullptr;
+      timer->m_recurringCb.reset();
+      continue;
+    }
     if (timer->m_recurring) {
-      timer->m_next = now_ms + timer->m_ms;
-      m_timers.insert(timer);
+      std::shared_ptr<Task> cb = timer->m_recurringCb;
+      cbs.emplace_back([cb]() { (*cb)(); });
+      timer->m_next = now + timer->m_us;
+      timer->coalesce();
+      wheelAdd(timer);
     } else {
-      timer->m_cb = nullptr; // TODO: 有必要吗
+      cbs.push_back(std::move(timer->m_cb)); // 移交出去 m_cb变成空的
     }
   }
+  m_deadline = m_count ? wheelEarliest() : ~0ull;
 }
 
-// ------------------------ addTimer(timer, lock) --------------------------
-void TimerManager::addTimer(Timer::ptr timer, RWMutexType::WriteLock &lock) {
-  auto it = m_timers.insert(timer).first; // first是iter second是bool
-  // 需要去唤醒了 如果m_tickled = true, 表明前面有插入需要唤醒但是
-  // 还没有被唤醒(因为醒来之后肯定是要调用getNextTimer的，就会设置m_tickled
-  // = false了)，也就是说信号只需要设置一次即可
-  bool need_to_notify = false;
-  if (it == m_timers.begin() && !m_tickled) {
-    // 位于第一位并且前面没有唤醒行为，那就唤醒
-    need_to_notify = true;
-    m_tickled = true;
+// ================================================================
+// ======================   时间轮  ================================
+// ================================================================
+
+TimerNode *TimerWheel::wheelSlot(uint64_t expires, int &id) {
+  if (expires < m_wheelTime) {
+    id = -1;
+    return &m_expired;
   }
-  lock.unlock();
+  uint64_t diff = expires - m_wheelTime;
+  int level = 0;
+  while (level < WHEEL_LEVELS - 1 && diff >= LevelSpan(level)) {
+    ++level;
+  }
+  if (diff >= LevelSpan(level)) {
+    expires = m_wheelTime + LevelSpan(level) - 1; // 太远了 到时候再重新放
+  }
+  id = LevelOffset(level) +
+       ((expires >> LevelShift(level)) & (LevelSize(level) - 1));
+  m_bitmap[id / 64] |= 1ull << (id % 64);
+  return &m_slots[id];
+}
 
-  if (need_to_notify) {
-    onTimerInsertedAtFront();
+void TimerWheel::wheelAdd(const Timer::ptr &timer) {
+  ++m_count;
+  if (timer->m_expires < m_deadline) {
+    m_deadline = timer->m_expires;
   }
+  timer->linkBefore(wheelSlot(timer->m_expires, timer->m_slotId));
+  timer->m_self = timer;
+  timer->m_linked.store(true, std::memory_order_release);
 }
 
-// ------------------------ hasTimer() --------------------------
-bool TimerManager::hasTimer() {
-  RWMutexType::ReadLock lock(m_mutex);
-  return !m_timers.empty();
+Timer::ptr TimerWheel::wheelRemove(Timer *timer) {
+  --m_count;
+  timer->unlink();
+  int id = timer->m_slotId;
+  if (id >= 0 && m_slots[id].empty()) {
+    m_bitmap[id / 64] &= ~(1ull << (id % 64));
+  }
+  timer->m_linked.store(false, std::memory_order_release);
+  return std::move(timer->m_self);
+}
+
+void TimerWheel::wheelTake(TimerNode &head, std::vector<Timer::ptr> &timers) {
+  while (!head.empty()) {
+    timers.push_back(wheelRemove(static_cast<Timer *>(head.next)));
+  }
+}
+
+void TimerWheel::cascade(int level, int index) {
+  int id = LevelOffset(level) + index;
+  // 先整个摘下来 重新放的时候可能还会放回这一格(太远的)
+  TimerNode list;
+  m_slots[id].moveTo(list);
+  m_bitmap[id / 64] &= ~(1ull << (id % 64));
+  while (!list.empty()) {
+    Timer *timer = static_cast<Timer *>(list.next);
+    timer->unlink();
+    timer->linkBefore(wheelSlot(timer->m_expires, timer->m_slotId));
+  }
+}
+
+void TimerWheel::wheelAdvance(uint64_t now, std::vector<Timer::ptr> &expired) {
+  static const int MASK0 = (1 << WHEEL_BITS0) - 1;
+  while (m_wheelTime <= now) {
+    if (m_count == 0) {
+      m_wheelTime = now + 1; // 时间轮是空的
+      break;
+    }
+    int index = m_wheelTime & MASK0;
+    if (index == 0) {
+      // 第0层转完一圈 把上一层的当前格子分下来 上一层也转完一圈的话继续往上
+      for (int level = 1; level < WHEEL_LEVELS; ++level) {
+        int idx = (m_wheelTime >> LevelShift(level)) & (LevelSize(level) - 1);
+        cascade(level, idx);
+        if (idx != 0) {
+          break;
+        }
+      }
+    }
+    int pos = findSlot(index, MASK0 + 1);
+    if (pos < 0) {
+      // 第0层这一圈剩下的都是空的 直接跳到下一个有定时器的格子或者
+      // 上层下一次cascade的时间 中间跨过的边界上都是空格子 不用cascade
+      uint64_t next = std::max(wheelEarliest(), m_wheelTime + 1);
+      m_wheelTime = std::min(next, now + 1);
+      continue;
+    }
+    m_wheelTime += pos - index;
+    if (m_wheelTime > now) {
+      m_wheelTime = now + 1;
+      break;
+    }
+    wheelTake(m_slots[pos], expired);
+    ++m_wheelTime;
+  }
+}
+
+uint64_t TimerWheel::wheelEarliest() {
+  if (!m_expired.empty()) {
+    return 0;
+  }
+  uint64_t earliest = ~0ull;
+  // 第0层每格就是1us 格子的时间就是到期时间
+  int dist = findInLevel(0, m_wheelTime & ((1 << WHEEL_BITS0) - 1));
+  if (dist >= 0) {
+    earliest = m_wheelTime + dist;
+  }
+  // 上层的格子只能知道它什么时候cascade
+  // 当前格子要转一整圈才会cascade 除非m_wheelTime正好在边界上还没处理
+  for (int level = 1; level < WHEEL_LEVELS; ++level) {
+    int shift = LevelShift(level);
+    int size = LevelSize(level);
+    uint64_t base = m_wheelTime >> shift;
+    if (m_wheelTime & ((1ull << shift) - 1)) {
+      ++base;
+    }
+    dist = findInLevel(level, base & (size - 1));
+    if (dist >= 0) {
+      earliest = std::min(earliest, (base + dist) << shift);
+    }
+  }
+  return earliest;
 }
 
-// ------------------------ detectClockRollover --------------------------
-bool TimerManager::detectClockRollover(uint64_t now_ms) {
-  bool rollover = false;
-  if (now_ms < m_previousTime && now_ms < m_previousTime - 60 * 60 * 1000) {
-    rollover = true;
+int TimerWheel::findSlot(int begin, int end) const {
+  while (begin < end) {
+    int word = begin / 64;
+    uint64_t bits = m_bitmap[word] >> (begin % 64);
+    if (bits) {
+      int pos = begin + __builtin_ctzll(bits);
+      return pos < end ? pos : -1;
+    }
+    begin = (word + 1) * 64;
+  }
+  return -1;
+}
+
+int TimerWheel::findInLevel(int level, int index) const {
+  int offset = LevelOffset(level);
+  int size = LevelSize(level);
+  int pos = findSlot(offset + index, offset + size);
+  if (pos >= 0) {
+    return pos - offset - index;
+  }
+  pos = findSlot(offset, offset + index);
+  if (pos >= 0) {
+    return pos - offset + size - index;
   }
-  m_previousTime = now_ms;
-  return rollover;
+  return -1;
 }
 
-} // namespace spadger
\ No newline at end of file
+} // namespace spadger
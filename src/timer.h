@@ -8,22 +8,60 @@
 #ifndef __SPADGER_TIMER_H__
 #define __SPADGER_TIMER_H__
 
+#include "task.h"
 #include "thread.h"
+#include <atomic>
 #include <functional>
 #include <memory>
-#include <set>
 #include <vector>
 
 namespace spadger {
 
 class TimerManager;
+class TimerWheel;
+
+// 侵入式双向循环链表的节点: Timer自己就是节点 时间轮的每一格是一个哨兵
+struct TimerNode {
+  TimerNode() : prev(this), next(this) {}
+  TimerNode(const TimerNode &) = delete;
+  TimerNode &operator=(const TimerNode &) = delete;
+
+  bool empty() const { return next == this; }
+  // 加到head所在链表的尾部
+  void linkBefore(TimerNode *head) {
+    prev = head->prev;
+    next = head;
+    head->prev->next = this;
+    head->prev = this;
+  }
+  void unlink() {
+    prev->next = next;
+    next->prev = prev;
+    prev = next = this;
+  }
+  // 把链表(除了哨兵自己)整个移到空的to上
+  void moveTo(TimerNode &to) {
+    if (empty()) {
+      return;
+    }
+    to.next = next;
+    to.prev = prev;
+    next->prev = &to;
+    prev->next = &to;
+    prev = next = this;
+  }
+
+  TimerNode *prev;
+  TimerNode *next;
+};
 
 // ================================================================
 // ======================   Timer  ================================
 // ================================================================
 
-class Timer : public std::enable_shared_from_this<Timer> {
+class Timer : public std::enable_shared_from_this<Timer>, private TimerNode {
   friend class TimerManager; // Timer只能通过TimerManager创建
+  friend class TimerWheel;
 
 public:
   typedef std::shared_ptr<Timer> ptr;
@@ -34,60 +72,159 @@ public:
 
 private:
   // 设置为private函数是因为只能在TimerManager中设置
-  Timer(uint64_t ms, std::function<void()> cb, bool recurring,
+  Timer(uint64_t us, uint64_t slack_us, Task cb, bool recurring,
         TimerManager *manager);
-  Timer(uint64_t ms);
+  // 按m_next和m_slack算出m_expires
+  void coalesce();
   bool m_recurring = false; // 是否循环执行
-  uint64_t m_ms = 0;        // 多久执行一次
-  uint64_t m_next = 0; // 下次执行的精确的时间 = (init_time + k * m_ms)
-  std::function<void()> m_cb;
+  uint64_t m_us = 0;        // 多久执行一次(微秒)
+  // 下次执行的时间(Clock::NowUS) = (init_time + k * m_us)
+  uint64_t m_next = 0;
+  // 允许晚多久执行 [m_next, m_next + m_slack]里对齐到尽量粗的边界作为
+  // 真正的到期时间m_expires 差不多时间到期的定时器就落到同一个时间点一起处理
+  uint64_t m_slack = 0;
+  uint64_t m_expires = 0;
+  Task m_cb; // 单次定时器的回调 到期时移交出去
+  // 循环定时器每次到期都要执行一次 由每次调度的任务共享
+  std::shared_ptr<Task> m_recurringCb;
+  // 条件定时器: 到期时条件已经不存在就不执行了
+  bool m_conditional = false;
+  std::weak_ptr<void> m_cond;
   TimerManager *m_manager = nullptr;
+  TimerWheel *m_wheel = nullptr; // 所在的分片 创建时定下来 之后不变
+  // 在时间轮里时: 所在格子的编号(-1是已经过期的列表) 以及时间轮持有的引用
+  int m_slotId = -1;
+  Timer::ptr m_self;
+  // 是否在时间轮里 在锁外也可以读 到期/取消之后再cancel不用加锁
+  std::atomic<bool> m_linked = {false};
+};
+
+// ================================================================
+// ======================   TimerWheel  ===========================
+// ================================================================
+
+// TimerManager的一个分片: 自己的锁和时间轮 只能由TimerManager使用
+class TimerWheel {
+  friend class Timer;
+  friend class TimerManager;
+
+public:
+  typedef RWMutex RWMutexType;
+
+  TimerWheel(const TimerWheel &) = delete;
+  TimerWheel &operator=(const TimerWheel &) = delete;
+  ~TimerWheel();
 
 private:
-  // 定时器的比较句柄
-  struct Comparator {
-    bool operator()(const Timer::ptr &lhs, const Timer::ptr &rhs) const;
-  };
+  explicit TimerWheel(int index);
+
+  // 加进时间轮 返回是否需要通知(比上次getNext算出来的还早)
+  bool add(const Timer::ptr &timer);
+  uint64_t getNext();
+  void listExpired(std::vector<Task> &cbs);
+
+  // ------------------------------------------------------------
+  // 分层时间轮(和linux以前的timer wheel一样):
+  //   第0层256格 每格1us; 第1~4层各64格 每格是下一层转一圈的时间
+  //   能表示2^32us(约71分钟) 更远的先放在最后一层 转到了再重新放
+  //   中间全是空格子的时候直接跳过去 所以格子再细也不会多转
+  // 插入/删除O(1) 低层转完一圈时把上一层的一格重新分配到下面(cascade)
+  // 下面的函数都要求持有写锁
+  // ------------------------------------------------------------
+  static const int WHEEL_LEVELS = 5;
+  static const int WHEEL_BITS0 = 8;
+  static const int WHEEL_BITS = 6;
+  static const int WHEEL_SLOTS = (1 << WHEEL_BITS0) + 4 * (1 << WHEEL_BITS);
+
+  // expires应该放在哪个格子 id为格子编号(已经过期的是-1)
+  TimerNode *wheelSlot(uint64_t expires, int &id);
+  void wheelAdd(const Timer::ptr &timer);
+  // 返回时间轮持有的引用 让调用者在锁外释放
+  Timer::ptr wheelRemove(Timer *timer);
+  // 把一格里所有的定时器取出来
+  void wheelTake(TimerNode &head, std::vector<Timer::ptr> &timers);
+  // 处理m_wheelTime到now之间的格子 到期的放到expired
+  void wheelAdvance(uint64_t now, std::vector<Timer::ptr> &expired);
+  void cascade(int level, int index);
+  // 最早的到期时间(对上层的格子来说是它cascade的时间 不会晚于真正的到期时间)
+  uint64_t wheelEarliest();
+  // [begin, end)中第一个非空格子的位置 没有返回-1
+  int findSlot(int begin, int end) const;
+  // 第level层从index开始(循环)第一个非空格子离index多远 没有返回-1
+  int findInLevel(int level, int index) const;
+
+private:
+  int m_index; // 第几个分片
+  RWMutexType m_mutex;
+  TimerNode m_slots[WHEEL_SLOTS];
+  uint64_t m_bitmap[WHEEL_SLOTS / 64] = {0}; // 格子是否非空
+  TimerNode m_expired;             // 加进来时已经过期了的
+  uint64_t m_wheelTime = 0;        // 下一个要处理的格子对应的时间(us)
+  // 定时器总数和最早的到期时间 写的时候持有锁 别的线程不加锁也可以读
+  std::atomic<size_t> m_count = {0};
+  std::atomic<uint64_t> m_deadline = {~0ull};
+  uint64_t m_nextHint = ~0ull;     // 上次getNext算出来的到期时间
+  bool m_tickled = false;
 };
 
 // ================================================================
 // ======================   TimerManager  =========================
 // ================================================================
 
+// 定时器按分片存放 每个分片一把锁一个时间轮
+// 加定时器时由getTimerShard()决定放在哪个分片(IOManager里是当前工作线程)
+// cancel/reset只锁定时器所在的分片
 class TimerManager {
   friend class Timer;
 
 public:
   typedef RWMutex RWMutexType;
 
-  TimerManager();
+  explicit TimerManager(size_t shards = 1);
   virtual ~TimerManager();
 
-  // 普通定时器
-  Timer::ptr addTimer(uint64_t ms, std::function<void()> cb,
-                      bool recurring = false);
+  // 普通定时器(毫秒) slack_ms: 允许晚多久执行 用来和别的定时器合并
+  Timer::ptr addTimer(uint64_t ms, Task cb, bool recurring = false,
+                      uint64_t slack_ms = 0);
+  // 微秒精度的定时器
+  Timer::ptr addTimerUS(uint64_t us, Task cb, bool recurring = false,
+                        uint64_t slack_us = 0);
   // 条件定时器，在满足条件的状态下才会执行
-  Timer::ptr addConditionTimer(uint64_t ms, std::function<void()> cb,
+  Timer::ptr addConditionTimer(uint64_t ms, Task cb,
                                std::weak_ptr<void> weak_cond,
-                               bool recurring = false);
-
+                               bool recurring = false, uint64_t slack_ms = 0);
+  /**
+   * @brief 已经到期或者取消了的单次定时器换上新的回调重新启动 不用再分配
+   * @return 还在时间轮里 或者不是这个TimerManager创建的 返回false
+   */
+  bool restartTimer(const Timer::ptr &timer, uint64_t ms, Task cb,
+                    uint64_t slack_ms = 0);
+
+  // 所有分片中最近的定时器还有多久到期 没有定时器返回~0ull
+  // 毫秒的版本向上取整 按它睡不会早醒
   uint64_t getNextTimer();
-  void listExpiredCb(std::vector<std::function<void()>> &cbs);
-  bool hasTimer();
+  uint64_t getNextTimerUS();
+  void listExpiredCb(std::vector<Task> &cbs);
+  // 只看一个分片
+  uint64_t getNextTimerUS(int shard);
+  void listExpiredCb(std::vector<Task> &cbs, int shard);
+  // 分片里最早的到期时间(getMonotonicUS 没有定时器是~0ull) 不加锁
+  uint64_t getTimerDeadline(int shard) const;
+  bool hasTimer() const;
+  int getTimerShardCount() const { return m_wheels.size(); }
 
 protected:
-  virtual void onTimerInsertedAtFront() = 0;
+  // 第shard个分片插入了比上次getNextTimer(shard)更早的定时器
+  virtual void onTimerInsertedAtFront(int shard) = 0;
+  // 当前线程新加的定时器放在哪个分片
+  virtual int getTimerShard() { return 0; }
   void addTimer(Timer::ptr timer, RWMutexType::WriteLock &lock);
 
 private:
-  // 判断是否调了时间
-  bool detectClockRollover(uint64_t now_ms);
+  TimerWheel *currentWheel();
 
 private:
-  RWMutexType m_mutex;
-  std::set<Timer::ptr, Timer::Comparator> m_timers;
-  bool m_tickled = false;
-  uint64_t m_previousTime = 0;
+  std::vector<std::unique_ptr<TimerWheel>> m_wheels;
 };
 
 } // namespace spadger
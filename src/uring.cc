@@ -0,0 +1,216 @@
+/*
+ * @Author: lxk
+ * @Date: 2022-10-28 09:58:03
+ * @LastEditors: lxk
+ * @LastEditTime: 2022-10-28 17:12:45
+ */
+#include "uring.h"
+#include "log.h"
+#include <algorithm>
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace spadger {
+
+static Logger::ptr g_logger = SPADGER_LOG_NAME("system");
+
+IoUring::~IoUring() {
+  if (m_sqes) {
+    munmap(m_sqes, m_sqesSize);
+  }
+  if (m_cqRing && m_cqRing != m_sqRing) {
+    munmap(m_cqRing, m_cqRingSize);
+  }
+  if (m_sqRing) {
+    munmap(m_sqRing, m_sqRingSize);
+  }
+  if (m_fd >= 0) {
+    ::close(m_fd);
+  }
+}
+
+bool IoUring::init(uint32_t entries) {
+  io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  m_fd = syscall(__NR_io_uring_setup, entries, &params);
+  if (m_fd < 0) {
+    SPADGER_LOG_WARN(g_logger) << "io_uring_setup(" << entries
+                               << ") errno=" << errno << " "
+                               << strerror(errno);
+    return false;
+  }
+
+  m_sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  m_cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+  bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+  if (single_mmap) {
+    m_sqRingSize = m_cqRingSize = std::max(m_sqRingSize, m_cqRingSize);
+  }
+  m_sqRing = mmap(nullptr, m_sqRingSize, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQ_RING);
+  if (m_sqRing == MAP_FAILED) {
+    m_sqRing = nullptr;
+    return false;
+  }
+  if (single_mmap) {
+    m_cqRing = m_sqRing;
+  } else {
+    m_cqRing = mmap(nullptr, m_cqRingSize, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_CQ_RING);
+    if (m_cqRing == MAP_FAILED) {
+      m_cqRing = nullptr;
+      return false;
+    }
+  }
+  m_sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+  m_sqes = (io_uring_sqe *)mmap(nullptr, m_sqesSize, PROT_READ | PROT_WRITE,
+                                MAP_SHARED | MAP_POPULATE, m_fd,
+                                IORING_OFF_SQES);
+  if (m_sqes == MAP_FAILED) {
+    m_sqes = nullptr;
+    return false;
+  }
+
+  char *sq = (char *)m_sqRing;
+  m_sqHead = (unsigned *)(sq + params.sq_off.head);
+  m_sqTail = (unsigned *)(sq + params.sq_off.tail);
+  m_sqFlags = (unsigned *)(sq + params.sq_off.flags);
+  m_sqArray = (unsigned *)(sq + params.sq_off.array);
+  m_sqMask = *(unsigned *)(sq + params.sq_off.ring_mask);
+  m_sqEntries = params.sq_entries;
+
+  char *cq = (char *)m_cqRing;
+  m_cqHead = (unsigned *)(cq + params.cq_off.head);
+  m_cqTail = (unsigned *)(cq + params.cq_off.tail);
+  m_cqes = (io_uring_cqe *)(cq + params.cq_off.cqes);
+  m_cqMask = *(unsigned *)(cq + params.cq_off.ring_mask);
+
+  m_cancelFd = probeCancelFd();
+  SPADGER_LOG_INFO(g_logger) << "io_uring fd=" << m_fd
+                             << " sq_entries=" << params.sq_entries
+                             << " cq_entries=" << params.cq_entries
+                             << " cancel_fd=" << m_cancelFd;
+  return true;
+}
+
+// 老内核(5.19以前)不认识cancel_flags 会直接返回-EINVAL
+// 拿ring自己的fd试一次 支持的话找不到要取消的 返回-ENOENT
+bool IoUring::probeCancelFd() {
+  uint32_t flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+  if (submitCancel(m_fd, 0, flags)) {
+    return false;
+  }
+  if (enter(0, 1, IORING_ENTER_GETEVENTS) < 0) {
+    return false;
+  }
+  int res = -EINVAL;
+  reap([&res](uint64_t user_data, int r) {
+    if (!user_data) {
+      res = r;
+    }
+  });
+  return res != -EINVAL;
+}
+
+// 调用者持有m_sqMutex
+io_uring_sqe *IoUring::getSqe() {
+  unsigned head = __atomic_load_n(m_sqHead, __ATOMIC_ACQUIRE);
+  unsigned tail = *m_sqTail + m_sqPending;
+  if (tail - head >= m_sqEntries) {
+    return nullptr;
+  }
+  unsigned index = tail & m_sqMask;
+  io_uring_sqe *sqe = &m_sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  m_sqArray[index] = index;
+  ++m_sqPending;
+  return sqe;
+}
+
+int IoUring::enter(unsigned to_submit, unsigned min_complete,
+                   unsigned flags) {
+  int rt;
+  do {
+    rt = syscall(__NR_io_uring_enter, m_fd, to_submit, min_complete, flags,
+                 nullptr, 0);
+  } while (rt < 0 && errno == EINTR);
+  return rt < 0 ? -errno : rt;
+}
+
+int IoUring::submit(int fd, const UringIo &io, uint64_t user_data,
+                    uint64_t timeout_ms, __kernel_timespec *ts) {
+  MutexType::Lock lock(m_sqMutex);
+  bool linked = timeout_ms != (uint64_t)-1;
+  // 超时需要两个sqe 要么都提交要么都不提交
+  io_uring_sqe *sqe = getSqe();
+  io_uring_sqe *tsqe = (sqe && linked) ? getSqe() : nullptr;
+  if (!sqe || (linked && !tsqe)) {
+    m_sqPending = 0;
+    return -EBUSY;
+  }
+  sqe->opcode = io.opcode;
+  sqe->fd = fd;
+  sqe->addr = (uint64_t)io.addr;
+  sqe->len = io.len;
+  sqe->off = io.off;
+  sqe->msg_flags = io.op_flags; // 和accept_flags等是union
+  sqe->user_data = user_data;
+  if (linked) {
+    sqe->flags |= IOSQE_IO_LINK;
+    ts->tv_sec = timeout_ms / 1000;
+    ts->tv_nsec = (timeout_ms % 1000) * 1000000;
+    tsqe->opcode = IORING_OP_LINK_TIMEOUT;
+    tsqe->fd = -1;
+    tsqe->addr = (uint64_t)ts;
+    tsqe->len = 1;
+    tsqe->user_data = user_data | 1;
+  }
+
+  unsigned count = m_sqPending;
+  __atomic_store_n(m_sqTail, *m_sqTail + count, __ATOMIC_RELEASE);
+  m_sqPending = 0;
+  int rt = enter(count, 0, 0);
+  if (rt < 0) {
+    // 出错时内核一个都没取 把tail退回去 免得之后被别人的enter带着提交
+    __atomic_store_n(m_sqTail, *m_sqTail - count, __ATOMIC_RELEASE);
+    SPADGER_LOG_ERROR(g_logger) << "io_uring_enter(" << m_fd << ", " << count
+                                << ") error=" << -rt << " " << strerror(-rt);
+    return rt;
+  }
+  return 0;
+}
+
+int IoUring::cancelFd(int fd) {
+  return submitCancel(fd, 0, IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL);
+}
+
+int IoUring::cancel(uint64_t user_data) {
+  return submitCancel(-1, user_data, 0);
+}
+
+// 取消操作自己的完成事件user_data为0
+int IoUring::submitCancel(int fd, uint64_t user_data, uint32_t flags) {
+  MutexType::Lock lock(m_sqMutex);
+  io_uring_sqe *sqe = getSqe();
+  if (!sqe) {
+    return -EBUSY;
+  }
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->fd = fd;
+  sqe->addr = user_data;
+  sqe->cancel_flags = flags;
+  sqe->user_data = 0;
+  __atomic_store_n(m_sqTail, *m_sqTail + 1, __ATOMIC_RELEASE);
+  m_sqPending = 0;
+  int rt = enter(1, 0, 0);
+  if (rt < 0) {
+    __atomic_store_n(m_sqTail, *m_sqTail - 1, __ATOMIC_RELEASE);
+    return rt;
+  }
+  return 0;
+}
+
+} // namespace spadger
@@ -0,0 +1,130 @@
+/*
+ * @Author: lxk
+ * @Date: 2022-10-28 09:41:17
+ * @LastEditors: lxk
+ * @LastEditTime: 2022-10-28 17:12:45
+ */
+
+#ifndef __SPADGER_URING_H__
+#define __SPADGER_URING_H__
+
+#include "mutex.h"
+#include "noncopyable.h"
+#include <linux/io_uring.h>
+#include <stddef.h>
+#include <stdint.h>
+
+namespace spadger {
+
+// ================================================================
+// io_uring的一个IO操作: 对应一个sqe, 字段含义见io_uring_sqe
+//   RECV/SEND:         addr=buf len=长度 op_flags=msg flags
+//   RECVMSG/SENDMSG:   addr=msghdr* op_flags=msg flags
+//   ACCEPT:            addr=sockaddr* off=socklen_t* op_flags=accept flags
+//   CONNECT:           addr=sockaddr* off=addrlen
+// ================================================================
+struct UringIo {
+  uint8_t opcode = IORING_OP_NOP;
+  const void *addr = nullptr;
+  uint32_t len = 0;
+  uint64_t off = 0;
+  uint32_t op_flags = 0;
+  bool used = false; // 是否真的通过io_uring完成(用于recvfrom之类回写参数)
+};
+
+// ================================================================
+// 不依赖liburing 直接用系统调用和mmap操作ring
+// 提交可以在任意线程 取完成事件一般只在epoll_wait的那个线程
+// ================================================================
+class IoUring : Noncopyable {
+public:
+  typedef Spinlock MutexType;
+
+  IoUring() {}
+  ~IoUring();
+
+  // 创建ring 内核不支持(或者被seccomp禁止)返回false
+  bool init(uint32_t entries);
+  int getFd() const { return m_fd; }
+
+  /**
+   * @brief 提交一个操作
+   * @param[in] user_data 完成时原样带回, 0留给内部使用(取消/超时)
+   * @param[in] timeout_ms 不是-1的话链接一个IORING_OP_LINK_TIMEOUT,
+   *            超时的完成事件user_data为user_data|1, ts由调用者保证完成前有效
+   * @return 0成功 或者-errno
+   */
+  int submit(int fd, const UringIo &io, uint64_t user_data,
+             uint64_t timeout_ms, __kernel_timespec *ts);
+  // 取消fd上所有还没完成的操作 要先看canCancelFd()
+  int cancelFd(int fd);
+  // 取消一个还没完成的操作(submit时的user_data)
+  int cancel(uint64_t user_data);
+  // 内核支持IORING_ASYNC_CANCEL_FD(5.19以后) init时探测
+  bool canCancelFd() const { return m_cancelFd; }
+
+  // 取出所有完成事件 cb(user_data, res) 返回个数
+  template <class F> size_t reap(F cb) {
+    MutexType::Lock lock(m_cqMutex);
+    size_t count = 0;
+    while (true) {
+      unsigned head = *m_cqHead;
+      unsigned tail = __atomic_load_n(m_cqTail, __ATOMIC_ACQUIRE);
+      if (head == tail) {
+        // CQ满了的话内核先存起来 需要enter一次才会刷回来
+        if (__atomic_load_n(m_sqFlags, __ATOMIC_RELAXED) &
+            IORING_SQ_CQ_OVERFLOW) {
+          enter(0, 0, IORING_ENTER_GETEVENTS);
+          if (*m_cqHead != __atomic_load_n(m_cqTail, __ATOMIC_ACQUIRE)) {
+            continue;
+          }
+        }
+        break;
+      }
+      for (; head != tail; ++head) {
+        io_uring_cqe &cqe = m_cqes[head & m_cqMask];
+        cb(cqe.user_data, cqe.res);
+        ++count;
+      }
+      __atomic_store_n(m_cqHead, head, __ATOMIC_RELEASE);
+    }
+    return count;
+  }
+
+private:
+  io_uring_sqe *getSqe();
+  int enter(unsigned to_submit, unsigned min_complete, unsigned flags);
+  int submitCancel(int fd, uint64_t user_data, uint32_t flags);
+  bool probeCancelFd();
+
+private:
+  int m_fd = -1;
+  bool m_cancelFd = false;
+  MutexType m_sqMutex;
+  MutexType m_cqMutex;
+
+  // mmap出来的区域
+  void *m_sqRing = nullptr;
+  size_t m_sqRingSize = 0;
+  void *m_cqRing = nullptr;
+  size_t m_cqRingSize = 0;
+  io_uring_sqe *m_sqes = nullptr;
+  size_t m_sqesSize = 0;
+
+  unsigned *m_sqHead = nullptr;
+  unsigned *m_sqTail = nullptr;
+  unsigned *m_sqFlags = nullptr;
+  unsigned *m_sqArray = nullptr;
+  unsigned m_sqMask = 0;
+  unsigned m_sqEntries = 0;
+  unsigned m_sqPending = 0; // 已经填好还没提交的sqe
+
+  unsigned *m_cqHead = nullptr;
+  unsigned *m_cqTail = nullptr;
+  io_uring_cqe *m_cqes = nullptr;
+  unsigned m_cqMask = 0;
+};
+
+} // namespace spadger
+
+#endif
@@ -152,4 +152,10 @@ uint64_t getCurrentUS() {
   return tv.tv_sec * 1000 * 1000ul + tv.tv_usec;
 }
 
+uint64_t getMonotonicUS() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000 * 1000ul + ts.tv_nsec / 1000;
+}
+
 } // end namespace spadger
\ No newline at end of file
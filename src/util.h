@@ -84,6 +84,9 @@ uint64_t getCurrentMS();
 
 uint64_t getCurrentUS();
 
+// CLOCK_MONOTONIC(微秒) 不受修改系统时间影响 定时器用这个
+uint64_t getMonotonicUS();
+
 } // namespace spadger
 
 #endif
\ No newline at end of file
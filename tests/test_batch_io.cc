@@ -0,0 +1,291 @@
+/*
+ * @Author: lxk
+ * @Date: 2022-11-13 09:48:16
+ * @LastEditors: lxk
+ * @LastEditTime: 2022-11-13 15:30:27
+ */
+#include "fd_manager.h"
+#include "hook.h"
+#include "iomanager.h"
+#include "spadger.h"
+#include <arpa/inet.h>
+#include <atomic>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+// 协程里的accept4/recvmmsg/sendmmsg/sendfile/splice/tee
+// 单线程的IOManager里等着的时候别的协程照常跑 数据和原版一样
+
+static spadger::Logger::ptr g_logger = SPADGER_LOG_ROOT();
+
+static std::atomic<int> s_ticks = {0};
+static std::atomic<bool> s_done = {false};
+
+static void later(int ms, std::function<void()> cb) {
+  spadger::IOManager::GetThis()->schedule([ms, cb]() {
+    usleep(ms * 1000);
+    cb();
+  });
+}
+
+static sockaddr_in loopback(int sock) {
+  sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  int rt = bind(sock, (sockaddr *)&addr, sizeof(addr));
+  SPADGER_ASSERT(rt == 0);
+  socklen_t len = sizeof(addr);
+  getsockname(sock, (sockaddr *)&addr, &len);
+  return addr;
+}
+
+void test_accept4() {
+  int lsock = socket(AF_INET, SOCK_STREAM, 0);
+  sockaddr_in addr = loopback(lsock);
+  int rt = listen(lsock, 16);
+  SPADGER_ASSERT(rt == 0);
+  later(100, [addr]() {
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    int rt = connect(sock, (sockaddr *)&addr, sizeof(addr));
+    SPADGER_ASSERT(rt == 0);
+    close(sock);
+  });
+  int ticks = s_ticks;
+  sockaddr_in peer;
+  socklen_t len = sizeof(peer);
+  int fd = accept4(lsock, (sockaddr *)&peer, &len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+  ticks = s_ticks - ticks;
+  SPADGER_ASSERT(fd >= 0 && len == sizeof(peer));
+  SPADGER_ASSERT(ticks >= 5);
+  rt = fcntl(fd, F_GETFD);
+  SPADGER_ASSERT(rt & FD_CLOEXEC);
+  // 用户要的非阻塞: 不等
+  bool nonblock = spadger::FdMgr::GetInstance()->get(fd)->getUserNonblock();
+  SPADGER_ASSERT(nonblock);
+  close(fd);
+  close(lsock);
+  SPADGER_LOG_INFO(g_logger) << "accept4 ok";
+}
+
+void test_mmsg() {
+  int rsock = socket(AF_INET, SOCK_DGRAM, 0);
+  int ssock = socket(AF_INET, SOCK_DGRAM, 0);
+  sockaddr_in addr = loopback(rsock);
+  int rt = connect(ssock, (sockaddr *)&addr, sizeof(addr));
+  SPADGER_ASSERT(rt == 0);
+
+  char out[3][8] = {"one", "two", "three"};
+  iovec oiov[3];
+  mmsghdr omsg[3];
+  memset(omsg, 0, sizeof(omsg));
+  for (int i = 0; i < 3; ++i) {
+    oiov[i] = {out[i], strlen(out[i])};
+    omsg[i].msg_hdr.msg_iov = &oiov[i];
+    omsg[i].msg_hdr.msg_iovlen = 1;
+  }
+  char in[4][8];
+  iovec iiov[4];
+  mmsghdr imsg[4];
+  memset(imsg, 0, sizeof(imsg));
+  for (int i = 0; i < 4; ++i) {
+    iiov[i] = {in[i], sizeof(in[i])};
+    imsg[i].msg_hdr.msg_iov = &iiov[i];
+    imsg[i].msg_hdr.msg_iovlen = 1;
+  }
+
+  // 一个一个地来: MSG_WAITFORONE收到第一个就返回
+  later(100, [ssock, omsg]() {
+    mmsghdr msg = omsg[0];
+    int rt = sendmmsg(ssock, &msg, 1, 0);
+    SPADGER_ASSERT(rt == 1);
+  });
+  int ticks = s_ticks;
+  rt = recvmmsg(rsock, imsg, 4, MSG_WAITFORONE, nullptr);
+  ticks = s_ticks - ticks;
+  SPADGER_ASSERT(rt == 1);
+  SPADGER_ASSERT(imsg[0].msg_len == 3 && !memcmp(in[0], "one", 3));
+  SPADGER_ASSERT(ticks >= 5);
+
+  // 不带MSG_WAITFORONE要收满
+  later(20, [ssock, omsg]() {
+    mmsghdr msg[3] = {omsg[0], omsg[1], omsg[2]};
+    for (int i = 0; i < 3; ++i) {
+      int rt = sendmmsg(ssock, msg + i, 1, 0);
+      SPADGER_ASSERT(rt == 1);
+      usleep(20 * 1000);
+    }
+  });
+  rt = recvmmsg(rsock, imsg, 3, 0, nullptr);
+  SPADGER_ASSERT(rt == 3);
+  SPADGER_ASSERT(imsg[2].msg_len == 5 && !memcmp(in[2], "three", 5));
+
+  // 一次发多个
+  rt = sendmmsg(ssock, omsg, 3, 0);
+  SPADGER_ASSERT(rt == 3);
+  for (int i = 0; i < 3; ++i) {
+    SPADGER_ASSERT(omsg[i].msg_len == strlen(out[i]));
+  }
+  rt = recvmmsg(rsock, imsg, 4, MSG_WAITFORONE, nullptr);
+  SPADGER_ASSERT(rt == 3);
+  SPADGER_ASSERT(imsg[1].msg_len == 3 && !memcmp(in[1], "two", 3));
+
+  // SO_RCVTIMEO超时
+  timeval tv = {0, 100 * 1000};
+  setsockopt(rsock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  uint64_t begin = spadger::getMonotonicUS();
+  errno = 0;
+  rt = recvmmsg(rsock, imsg, 4, 0, nullptr);
+  uint64_t used = spadger::getMonotonicUS() - begin;
+  SPADGER_ASSERT(rt == -1 && errno == ETIMEDOUT);
+  SPADGER_ASSERT(used >= 90 * 1000);
+  close(rsock);
+  close(ssock);
+  SPADGER_LOG_INFO(g_logger) << "recvmmsg/sendmmsg ok";
+}
+
+void test_sendfile() {
+  std::string path = "/tmp/spadger_batch_io_" + std::to_string(getpid());
+  std::string data(1024 * 1024, 0);
+  for (size_t i = 0; i < data.size(); ++i) {
+    data[i] = i * 7;
+  }
+  int file = open(path.c_str(), O_CREAT | O_RDWR | O_TRUNC, 0644);
+  SPADGER_ASSERT(file >= 0);
+  ssize_t written = pwrite(file, data.data(), data.size(), 0);
+  SPADGER_ASSERT(written == (ssize_t)data.size());
+
+  int sv[2];
+  int rt = socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+  SPADGER_ASSERT(rt == 0);
+  // socketpair没有hook 交给FdMgr管
+  spadger::FdMgr::GetInstance()->get(sv[0], true);
+  spadger::FdMgr::GetInstance()->get(sv[1], true);
+  // 慢慢读 发送端会满
+  static std::string recved;
+  static std::atomic<bool> eof;
+  recved.clear();
+  eof = false;
+  int reader = sv[1];
+  later(0, [reader]() {
+    char buf[16 * 1024];
+    ssize_t n;
+    while ((n = read(reader, buf, sizeof(buf))) > 0) {
+      recved.append(buf, n);
+      usleep(5 * 1000);
+    }
+    eof = true;
+  });
+  int ticks = s_ticks;
+  off_t off = 0;
+  while (off < (off_t)data.size()) {
+    ssize_t n = sendfile(sv[0], file, &off, data.size() - off);
+    SPADGER_ASSERT(n > 0);
+  }
+  close(sv[0]);
+  close(file);
+  unlink(path.c_str());
+  while (!eof) {
+    usleep(10 * 1000);
+  }
+  close(sv[1]);
+  ticks = s_ticks - ticks;
+  SPADGER_ASSERT(recved == data);
+  SPADGER_ASSERT(ticks >= 5);
+  SPADGER_LOG_INFO(g_logger) << "sendfile ok";
+}
+
+void test_splice() {
+  int sv[2], pfd[2];
+  int rt = socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+  SPADGER_ASSERT(rt == 0);
+  rt = pipe(pfd);
+  SPADGER_ASSERT(rt == 0);
+  int writer = sv[1];
+  later(100, [writer]() {
+    ssize_t n = write(writer, "splice", 6);
+    SPADGER_ASSERT(n == 6);
+  });
+
+  // socket -> 管道: socket没数据 等
+  int ticks = s_ticks;
+  ssize_t n = splice(sv[0], nullptr, pfd[1], nullptr, 4096, 0);
+  ticks = s_ticks - ticks;
+  SPADGER_ASSERT(n == 6);
+  SPADGER_ASSERT(ticks >= 5);
+  // 管道 -> socket
+  n = splice(pfd[0], nullptr, sv[0], nullptr, 4096, 0);
+  SPADGER_ASSERT(n == 6);
+  char buf[16] = {0};
+  n = read(sv[1], buf, sizeof(buf));
+  SPADGER_ASSERT(n == 6);
+  SPADGER_ASSERT(std::string(buf) == "splice");
+
+  // 用户要非阻塞
+  errno = 0;
+  n = splice(sv[0], nullptr, pfd[1], nullptr, 4096, SPLICE_F_NONBLOCK);
+  SPADGER_ASSERT(n == -1 && errno == EAGAIN);
+
+  // tee: 管道 -> 管道 输入的管道没数据 等
+  int pfd2[2];
+  rt = pipe(pfd2);
+  SPADGER_ASSERT(rt == 0);
+  int pw = pfd[1];
+  later(100, [pw]() {
+    ssize_t n = write(pw, "tee", 3);
+    SPADGER_ASSERT(n == 3);
+  });
+  ticks = s_ticks;
+  n = tee(pfd[0], pfd2[1], 4096, 0);
+  ticks = s_ticks - ticks;
+  SPADGER_ASSERT(n == 3);
+  SPADGER_ASSERT(ticks >= 5);
+  // 数据还在原来的管道里
+  memset(buf, 0, sizeof(buf));
+  n = read(pfd[0], buf, sizeof(buf));
+  SPADGER_ASSERT(n == 3);
+  n = read(pfd2[0], buf + 3, sizeof(buf) - 3);
+  SPADGER_ASSERT(n == 3);
+  SPADGER_ASSERT(std::string(buf) == "teetee");
+
+  // 超时用socket的SO_RCVTIMEO
+  timeval tv = {0, 100 * 1000};
+  setsockopt(sv[0], SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  errno = 0;
+  n = splice(sv[0], nullptr, pfd[1], nullptr, 4096, 0);
+  SPADGER_ASSERT(n == -1 && errno == ETIMEDOUT);
+  for (int i = 0; i < 2; ++i) {
+    close(sv[i]);
+    close(pfd[i]);
+    close(pfd2[i]);
+  }
+  SPADGER_LOG_INFO(g_logger) << "splice/tee ok";
+}
+
+int main(int argc, char **argv) {
+  const char *backends[] = {"epoll", "io_uring"};
+  for (const char *backend : backends) {
+    spadger::Config::Lookup<std::string>("iomanager.backend")
+        ->setValue(backend);
+    spadger::IOManager iom(1, false, backend);
+    s_done = false;
+    iom.schedule([]() {
+      while (!s_done) {
+        ++s_ticks;
+        usleep(10 * 1000);
+      }
+    });
+    iom.schedule([]() {
+      test_accept4();
+      test_mmsg();
+      test_sendfile();
+      test_splice();
+      SPADGER_LOG_INFO(g_logger)
+          << "uring=" << spadger::IOManager::GetThis()->hasUring()
+          << " ticks=" << s_ticks;
+      s_done = true;
+    });
+  }
+  return 0;
+}
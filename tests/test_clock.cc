@@ -0,0 +1,86 @@
+/*
+ * @Author: lxk
+ * @Date: 2022-10-30 16:40:02
+ * @LastEditors: lxk
+ * @LastEditTime: 2022-10-30 18:05:41
+ */
+#include "clock.h"
+#include "config.h"
+#include "spadger.h"
+
+// 缓存时钟测试: 缓存的语义 以及各种读法的开销
+// 用法: clock_test [次数]
+
+static spadger::Logger::ptr g_logger = SPADGER_LOG_ROOT();
+
+static uint64_t s_sink = 0;
+
+template <class F> static uint64_t cost(int n, F f) {
+  uint64_t begin = spadger::getMonotonicUS();
+  for (int i = 0; i < n; ++i) {
+    s_sink += f();
+  }
+  return (spadger::getMonotonicUS() - begin) * 1000 / n;
+}
+
+void test_cache() {
+  // 没有Update过 直接读时钟
+  uint64_t a = spadger::Clock::NowUS();
+  while (spadger::Clock::NowUS() == a) {
+  }
+  // Update之后读到的都是同一个值 直到下一次Update
+  spadger::Clock::Update();
+  uint64_t cached = spadger::Clock::NowUS();
+  uint64_t until = spadger::getMonotonicUS() + 1000;
+  while (spadger::getMonotonicUS() < until) {
+  }
+  SPADGER_ASSERT(spadger::Clock::NowUS() == cached);
+  spadger::Clock::Update();
+  SPADGER_ASSERT(spadger::Clock::NowUS() >= cached + 1000);
+  spadger::Clock::Stop();
+  SPADGER_ASSERT(spadger::Clock::NowUS() > cached);
+  SPADGER_LOG_INFO(g_logger) << "test_cache ok";
+}
+
+void bench(int n) {
+  SPADGER_LOG_INFO(g_logger)
+      << "clock_gettime " << cost(n, []() { return spadger::getMonotonicUS(); })
+      << "ns/op";
+  SPADGER_LOG_INFO(g_logger)
+      << "gettimeofday " << cost(n, []() { return spadger::getCurrentMS(); })
+      << "ns/op";
+  spadger::Clock::Update();
+  SPADGER_LOG_INFO(g_logger)
+      << "cached " << cost(n, []() { return spadger::Clock::NowUS(); })
+      << "ns/op";
+  spadger::Clock::Stop();
+
+  spadger::Config::Lookup<bool>("clock.tsc")->setValue(true);
+  if (!spadger::Clock::IsTsc()) {
+    SPADGER_LOG_INFO(g_logger) << "no invariant tsc";
+    return;
+  }
+  SPADGER_LOG_INFO(g_logger)
+      << "tsc " << cost(n, []() { return spadger::Clock::ReadUS(); })
+      << "ns/op";
+  // 走得和CLOCK_MONOTONIC一样快 误差在千分之一以内
+  uint64_t tsc0 = spadger::Clock::ReadUS();
+  uint64_t mono0 = spadger::getMonotonicUS();
+  uint64_t until = mono0 + 200000;
+  while (spadger::getMonotonicUS() < until) {
+  }
+  int64_t tsc_used = spadger::Clock::ReadUS() - tsc0;
+  int64_t mono_used = spadger::getMonotonicUS() - mono0;
+  int64_t diff = tsc_used > mono_used ? tsc_used - mono_used
+                                      : mono_used - tsc_used;
+  SPADGER_LOG_INFO(g_logger) << "tsc drift " << diff << "us in " << mono_used
+                             << "us";
+  SPADGER_ASSERT(diff * 1000 < mono_used);
+  spadger::Config::Lookup<bool>("clock.tsc")->setValue(false);
+}
+
+int main(int argc, char **argv) {
+  test_cache();
+  bench(argc > 1 ? atoi(argv[1]) : 10000000);
+  return 0;
+}
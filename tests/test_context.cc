@@ -0,0 +1,56 @@
+/*
+ * @Author: lxk
+ * @Date: 2022-10-24 17:02:13
+ * @LastEditors: lxk
+ * @LastEditTime: 2022-10-24 17:30:40
+ */
+#include "context.h"
+#include "spadger.h"
+#include <stdlib.h>
+
+// 主协程和子协程之间来回切换 统计每秒切换次数
+// 两种后端都直接测 不受SPADGER_FIBER_UCONTEXT影响
+
+static const uint64_t s_rounds = 10 * 1000 * 1000;
+static const size_t s_stack_size = 128 * 1024;
+
+template <class Ctx> struct Bench {
+  static Ctx s_main;
+  static Ctx s_child;
+
+  static void Entry() {
+    while (true) {
+      Ctx::Swap(s_child, s_main);
+    }
+  }
+
+  static void run(const char *name) {
+    void *stack = malloc(s_stack_size);
+    s_main.initMain();
+    s_child.init(stack, s_stack_size, &Entry);
+
+    uint64_t begin = spadger::getCurrentUS();
+    for (uint64_t i = 0; i < s_rounds; ++i) {
+      Ctx::Swap(s_main, s_child);
+    }
+    uint64_t used = spadger::getCurrentUS() - begin;
+    // 每轮两次切换: main->child child->main
+    double per_sec = s_rounds * 2 * 1000000.0 / (used ? used : 1);
+    SPADGER_LOG_INFO(SPADGER_LOG_ROOT())
+        << name << ": " << s_rounds * 2 << " switches in " << used
+        << "us, " << (uint64_t)per_sec << " switches/s";
+    free(stack);
+  }
+};
+template <class Ctx> Ctx Bench<Ctx>::s_main;
+template <class Ctx> Ctx Bench<Ctx>::s_child;
+
+int main(int argc, char **argv) {
+  SPADGER_LOG_INFO(SPADGER_LOG_ROOT())
+      << "fiber context backend: " << spadger::ContextBackendName();
+  Bench<spadger::UContext>::run("ucontext");
+#if defined(__x86_64__)
+  Bench<spadger::AsmContext>::run("asm");
+#endif
+  return 0;
+}
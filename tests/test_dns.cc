@@ -0,0 +1,256 @@
+/*
+ * @Author: lxk
+ * @Date: 2022-11-09 15:02:44
+ * @LastEditors: lxk
+ * @LastEditTime: 2022-11-09 21:40:03
+ */
+#include "dns.h"
+#include "iomanager.h"
+#include "spadger.h"
+#include <arpa/inet.h>
+#include <atomic>
+#include <map>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// 本地起一个桩DNS服务器 dns.servers指向它
+//  a.test      A 10.0.0.1 TTL 1
+//  cname.test  CNAME real.test, real.test A 10.0.0.2
+//  nx.test     NXDOMAIN
+//  slow.test   200ms之后才回 A 10.0.0.3
+//  v6.test     AAAA 2001:db8::1
+//  drop.test   不回
+// 其它的名字 类型不对的都回NOERROR没有答案
+// 缓存的上限: 问很多不同的名字
+
+static spadger::Logger::ptr g_logger = SPADGER_LOG_ROOT();
+
+static spadger::Mutex s_mutex;
+static std::map<std::string, int> s_queries; // "名字 类型" -> 收到几次
+static std::atomic<bool> s_stop = {false};
+
+static int queries(const std::string &name, int qtype) {
+  spadger::Mutex::Lock lock(s_mutex);
+  return s_queries[name + " " + std::to_string(qtype)];
+}
+
+static void put16(std::string &out, uint16_t v) {
+  out.push_back(v >> 8);
+  out.push_back(v & 0xff);
+}
+
+// 答案的名字都用指向问题的指针
+static void add_rr(std::string &out, uint16_t type, uint32_t ttl,
+                   const std::string &rdata) {
+  put16(out, 0xc00c);
+  put16(out, type);
+  put16(out, 1);
+  put16(out, ttl >> 16);
+  put16(out, ttl & 0xffff);
+  put16(out, rdata.size());
+  out += rdata;
+}
+
+static void stub_server(int sock) {
+  char buf[512];
+  while (!s_stop) {
+    sockaddr_in from;
+    socklen_t len = sizeof(from);
+    int n = recvfrom(sock, buf, sizeof(buf), 0, (sockaddr *)&from, &len);
+    if (n < 12) {
+      continue;
+    }
+    // 问题里的名字 不带压缩
+    std::string name;
+    int off = 12;
+    while (off < n && buf[off]) {
+      if (!name.empty()) {
+        name.push_back('.');
+      }
+      name.append(buf + off + 1, (uint8_t)buf[off]);
+      off += 1 + (uint8_t)buf[off];
+    }
+    off += 1;
+    uint16_t qtype = ((uint8_t)buf[off] << 8) | (uint8_t)buf[off + 1];
+    off += 4;
+    {
+      spadger::Mutex::Lock lock(s_mutex);
+      ++s_queries[name + " " + std::to_string(qtype)];
+    }
+
+    std::string resp(buf, off);
+    resp[2] = (char)0x81; // QR RD
+    resp[3] = (char)0x80; // RA
+    resp[6] = resp[7] = 0;
+    resp[8] = resp[9] = resp[10] = resp[11] = 0;
+    int ancount = 0;
+    if (name == "drop.test") {
+      continue;
+    } else if (name == "slow.test") {
+      usleep(200 * 1000);
+    }
+    if (name == "nx.test") {
+      resp[3] |= 3;
+    } else if (qtype == 1 && (name == "a.test" || name == "slow.test")) {
+      add_rr(resp, 1, 1,
+             std::string(name == "a.test" ? "\x0a\x00\x00\x01"
+                                          : "\x0a\x00\x00\x03",
+                         4));
+      ancount = 1;
+    } else if (qtype == 1 && name == "cname.test") {
+      // real.test 后面的A记录的名字指向CNAME的rdata
+      size_t cname_rdata = resp.size() + 12;
+      add_rr(resp, 5, 60, std::string("\x04real\x04test\x00", 11));
+      put16(resp, 0xc000 | cname_rdata);
+      put16(resp, 1);
+      put16(resp, 1);
+      put16(resp, 0);
+      put16(resp, 30);
+      put16(resp, 4);
+      resp += std::string("\x0a\x00\x00\x02", 4);
+      ancount = 2;
+    } else if (qtype == 28 && name == "v6.test") {
+      in6_addr addr;
+      inet_pton(AF_INET6, "2001:db8::1", &addr);
+      add_rr(resp, 28, 60, std::string((const char *)&addr, 16));
+      ancount = 1;
+    }
+    resp[7] = ancount;
+    sendto(sock, resp.data(), resp.size(), 0, (sockaddr *)&from, len);
+  }
+}
+
+static std::string lookup(const std::string &host, int family = AF_INET) {
+  std::vector<spadger::Address::ptr> result;
+  if (!spadger::Address::Lookup(result, host, family, SOCK_STREAM)) {
+    return "";
+  }
+  return result[0]->toString();
+}
+
+void test_dns() {
+  spadger::Resolver *resolver = spadger::ResolverMgr::GetInstance();
+
+  // 解析 缓存 TTL过期重新查
+  SPADGER_ASSERT(lookup("a.test:80") == "10.0.0.1:80");
+  SPADGER_ASSERT(lookup("A.test.:80") == "10.0.0.1:80");
+  SPADGER_ASSERT(queries("a.test", 1) == 1);
+  SPADGER_ASSERT(resolver->getCacheHitCount() >= 1);
+  usleep(1100 * 1000);
+  SPADGER_ASSERT(lookup("a.test:80") == "10.0.0.1:80");
+  SPADGER_ASSERT(queries("a.test", 1) == 2);
+  SPADGER_LOG_INFO(g_logger) << "cache ok";
+
+  SPADGER_ASSERT(lookup("cname.test") == "10.0.0.2:0");
+  SPADGER_ASSERT(lookup("v6.test:443", AF_INET6) == "[2001:db8::1]:443");
+  // AF_UNSPEC A和AAAA都问 v6.test没有A记录
+  SPADGER_ASSERT(lookup("v6.test", AF_UNSPEC) == "[2001:db8::1]:0");
+
+  // 不存在的也缓存
+  SPADGER_ASSERT(lookup("nx.test") == "");
+  SPADGER_ASSERT(lookup("nx.test") == "");
+  SPADGER_ASSERT(queries("nx.test", 1) == 1);
+  SPADGER_LOG_INFO(g_logger) << "cname/v6/nxdomain ok";
+
+  // 不回的服务器: 超时之后失败 不缓存
+  uint64_t begin = spadger::getMonotonicUS();
+  SPADGER_ASSERT(lookup("drop.test") == "");
+  uint64_t used = spadger::getMonotonicUS() - begin;
+  SPADGER_ASSERT(used >= 250 * 1000 && used < 1000 * 1000);
+  SPADGER_ASSERT(queries("drop.test", 1) == 1);
+  SPADGER_LOG_INFO(g_logger) << "timeout ok used=" << used / 1000 << "ms";
+
+  // /etc/hosts里的交给getaddrinfo
+  uint64_t fallbacks = resolver->getFallbackCount();
+  SPADGER_ASSERT(lookup("localhost:80") == "127.0.0.1:80");
+  SPADGER_ASSERT(resolver->getFallbackCount() == fallbacks + 1);
+  SPADGER_ASSERT(lookup("127.0.0.1:80") == "127.0.0.1:80");
+  SPADGER_LOG_INFO(g_logger) << "fallback ok";
+}
+
+// 缓存有上限: 问过很多不同的名字 旧的被淘汰 新的还在
+void test_cache_bound() {
+  spadger::Resolver *resolver = spadger::ResolverMgr::GetInstance();
+  spadger::Config::Lookup<uint32_t>("dns.cache.max_entries")->setValue(16);
+  uint64_t evicted = resolver->getEvictCount();
+  static const int N = 100;
+  for (int i = 0; i < N; ++i) {
+    SPADGER_ASSERT(lookup("n" + std::to_string(i) + ".test") == "");
+  }
+  SPADGER_ASSERT(resolver->getEvictCount() - evicted >= N - 16);
+  SPADGER_ASSERT(lookup("n0.test") == "");
+  SPADGER_ASSERT(queries("n0.test", 1) == 2);
+  SPADGER_ASSERT(lookup("n99.test") == "");
+  SPADGER_ASSERT(queries("n99.test", 1) == 1);
+  spadger::Config::Lookup<uint32_t>("dns.cache.max_entries")->setValue(4096);
+  SPADGER_LOG_INFO(g_logger) << "cache bound ok evicted="
+                             << resolver->getEvictCount() - evicted;
+}
+
+// 单线程的IOManager: 慢查询的时候别的协程照常跑 同一个名字只问一次
+void test_coalesce(spadger::IOManager &iom) {
+  static const int N = 8;
+  static std::atomic<int> done = {0};
+  static std::atomic<int> ticks = {0};
+  static std::atomic<bool> finished = {false};
+  iom.schedule([]() {
+    while (!finished) {
+      ++ticks;
+      usleep(10 * 1000);
+    }
+  });
+  for (int i = 0; i < N; ++i) {
+    iom.schedule([]() {
+      SPADGER_ASSERT(lookup("slow.test:8080") == "10.0.0.3:8080");
+      if (++done == N) {
+        finished = true;
+      }
+    });
+  }
+  while (!finished) {
+    usleep(10 * 1000);
+  }
+  SPADGER_ASSERT(queries("slow.test", 1) == 1);
+  SPADGER_ASSERT(ticks >= 10);
+  SPADGER_ASSERT(spadger::ResolverMgr::GetInstance()->getCoalescedCount() >=
+                 N - 1);
+  SPADGER_LOG_INFO(g_logger) << "coalesce ok ticks=" << ticks.load();
+}
+
+int main(int argc, char **argv) {
+  int sock = socket(AF_INET, SOCK_DGRAM, 0);
+  sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  SPADGER_ASSERT(bind(sock, (sockaddr *)&addr, sizeof(addr)) == 0);
+  socklen_t len = sizeof(addr);
+  getsockname(sock, (sockaddr *)&addr, &len);
+  timeval tv{0, 100 * 1000};
+  setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  spadger::Thread::ptr server(
+      new spadger::Thread(std::bind(stub_server, sock), "stub_dns"));
+
+  std::vector<std::string> servers{"127.0.0.1:" +
+                                   std::to_string(ntohs(addr.sin_port))};
+  spadger::Config::Lookup<std::vector<std::string>>("dns.servers")
+      ->setValue(servers);
+  spadger::Config::Lookup<uint32_t>("dns.timeout")->setValue(300);
+  spadger::Config::Lookup<uint32_t>("dns.attempts")->setValue(1);
+
+  {
+    spadger::IOManager iom(2, false, "dns");
+    iom.schedule([]() {
+      test_dns();
+      test_cache_bound();
+    });
+  }
+  {
+    spadger::IOManager iom(1, false, "dns1");
+    test_coalesce(iom);
+  }
+  s_stop = true;
+  server->join();
+  close(sock);
+  return 0;
+}
@@ -0,0 +1,147 @@
+/*
+ * @Author: lxk
+ * @Date: 2022-10-28 15:30:12
+ * @LastEditors: lxk
+ * @LastEditTime: 2022-10-28 17:12:45
+ */
+#include "iomanager.h"
+#include "socket.h"
+#include "spadger.h"
+#include <atomic>
+#include <new>
+#include <stdlib.h>
+
+// echo压测: 同一个IOManager里跑echo服务端和N个客户端协程
+// 每个客户端发M次小包并等回包 分别用epoll(每次事件后重新注册/常驻注册)
+// 和io_uring后端跑一遍 比较req/s 最后再带上收超时跑一遍epoll
+// 同时统计operator new的次数 看每个请求分配几次内存
+// 用法: echo_bench_test [线程数] [连接数] [每个连接的请求数]
+
+static spadger::Logger::ptr g_logger = SPADGER_LOG_ROOT();
+
+static std::atomic<uint64_t> s_requests = {0};
+static std::atomic<uint64_t> s_allocs = {0};
+static uint64_t s_timeout = 0; // 不为0时给所有连接设置收超时(ms)
+
+// 自己替换的new/delete里malloc/free是配对的 gcc会误报
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpragmas"
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+void *operator new(size_t size) {
+  s_allocs.fetch_add(1, std::memory_order_relaxed);
+  void *p = malloc(size);
+  if (!p) {
+    throw std::bad_alloc();
+  }
+  return p;
+}
+void operator delete(void *p) noexcept { free(p); }
+void operator delete(void *p, size_t) noexcept { free(p); }
+#pragma GCC diagnostic pop
+
+static void serve(spadger::Socket::ptr client) {
+  if (s_timeout) {
+    client->setRecvTimeout(s_timeout);
+  }
+  char buf[64];
+  while (true) {
+    int n = client->recv(buf, sizeof(buf));
+    if (n <= 0) {
+      break;
+    }
+    if (client->send(buf, n) != n) {
+      break;
+    }
+  }
+  client->close();
+}
+
+static void run_client(spadger::Address::ptr addr, int requests) {
+  spadger::Socket::ptr sock = spadger::Socket::CreateTCP(addr);
+  if (!sock->connect(addr)) {
+    SPADGER_LOG_ERROR(g_logger) << "connect " << addr->toString() << " fail";
+    return;
+  }
+  if (s_timeout) {
+    sock->setRecvTimeout(s_timeout);
+  }
+  char buf[32] = "ping";
+  for (int i = 0; i < requests; ++i) {
+    if (sock->send(buf, sizeof(buf)) != (int)sizeof(buf)) {
+      break;
+    }
+    int got = 0;
+    while (got < (int)sizeof(buf)) {
+      int n = sock->recv(buf + got, sizeof(buf) - got);
+      if (n <= 0) {
+        return;
+      }
+      got += n;
+    }
+    ++s_requests;
+  }
+  sock->close();
+}
+
+static void bench(const std::string &backend, bool persistent, int threads,
+                  int conns, int requests) {
+  spadger::Config::Lookup<std::string>("iomanager.backend")
+      ->setValue(backend);
+  spadger::Config::Lookup<bool>("iomanager.epoll.persistent")
+      ->setValue(persistent);
+  s_requests = 0;
+  uint64_t begin = spadger::getCurrentUS();
+  uint64_t allocs = s_allocs;
+  bool uring = false;
+  {
+    spadger::IOManager iom(threads, false, "echo");
+    uring = iom.hasUring();
+    // socket要在工作线程里创建 才会被hook成非阻塞
+    iom.schedule([conns, requests]() {
+      spadger::Socket::ptr server = spadger::Socket::CreateTCPSocket();
+      spadger::Address::ptr addr =
+          spadger::IPv4Address::Create("127.0.0.1", 0);
+      SPADGER_ASSERT(server->bind(addr));
+      SPADGER_ASSERT(server->listen());
+      addr = server->getLocalAddress();
+
+      spadger::IOManager *iom = spadger::IOManager::GetThis();
+      for (int i = 0; i < conns; ++i) {
+        iom->schedule([addr, requests]() { run_client(addr, requests); });
+      }
+      for (int i = 0; i < conns; ++i) {
+        spadger::Socket::ptr client = server->accept();
+        if (!client) {
+          break;
+        }
+        iom->schedule([client]() { serve(client); });
+      }
+    });
+  }
+  uint64_t used = spadger::getCurrentUS() - begin;
+  allocs = s_allocs - allocs;
+  SPADGER_LOG_INFO(g_logger)
+      << "backend=" << (uring ? "io_uring" : "epoll")
+      << (uring ? "" : (persistent ? "(persistent)" : "(oneshot)"))
+      << (s_timeout ? " recv_timeout=" + std::to_string(s_timeout) : "")
+      << " threads=" << threads << " conns=" << conns
+      << " requests=" << s_requests << " used=" << used / 1000 << "ms"
+      << " req/s=" << (used ? s_requests * 1000000 / used : 0)
+      << " allocs/req="
+      << (s_requests ? (double)allocs / s_requests : 0.0);
+}
+
+int main(int argc, char **argv) {
+  int threads = argc > 1 ? atoi(argv[1]) : 2;
+  int conns = argc > 2 ? atoi(argv[2]) : 64;
+  int requests = argc > 3 ? atoi(argv[3]) : 2000;
+  // 每次EAGAIN都会打一条日志 压测时关掉
+  SPADGER_LOG_NAME("system")->setLevel(spadger::LogLevel::ERROR);
+
+  bench("epoll", false, threads, conns, requests);
+  bench("epoll", true, threads, conns, requests);
+  bench("io_uring", true, threads, conns, requests);
+  s_timeout = 5000;
+  bench("epoll", true, threads, conns, requests);
+  return 0;
+}
@@ -0,0 +1,240 @@
+/*
+ * @Author: lxk
+ * @Date: 2022-11-06 16:10:22
+ * @LastEditors: lxk
+ * @LastEditTime: 2022-11-06 17:31:08
+ */
+#include "fd_manager.h"
+#include "fd_table.h"
+#include "hook.h"
+#include "iomanager.h"
+#include "spadger.h"
+#include <atomic>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// fd表测试: 跨段的下标 多线程同时分配同一段 fd关掉重开之后的代数
+// 没开hook的线程关掉的fd io_uring上在收的fd被关掉
+// 以及查找的开销
+// 用法: fd_table_test [线程数] [每个线程的次数]
+
+static spadger::Logger::ptr g_logger = SPADGER_LOG_ROOT();
+
+struct Item {
+  explicit Item(int fd_) : fd(fd_) {}
+  int fd;
+  std::atomic<int> hits = {0};
+};
+
+void test_index() {
+  spadger::FdTable<Item> table;
+  SPADGER_ASSERT(!table.get(-1, true));
+  SPADGER_ASSERT(!table.get(0));
+  // 每段的头尾
+  int fds[] = {0, 63, 64, 127, 128, 255, 256, 1023, 1024, 65535, 1 << 20};
+  for (int fd : fds) {
+    Item *item = table.get(fd, true);
+    SPADGER_ASSERT(item && item->fd == fd);
+    SPADGER_ASSERT(table.get(fd) == item);
+  }
+  // 同一段里别的位置已经有了 不会再分配
+  SPADGER_ASSERT(table.get(100) && table.get(100)->fd == 100);
+  SPADGER_ASSERT(!table.get((1 << 21) + 1));
+  SPADGER_LOG_INFO(g_logger) << "test_index ok";
+}
+
+// 几个线程同时随机创建 拿到的是同一个元素 之后不会移动
+void test_concurrent(int threads, int n) {
+  static const int MAX_FD = 1 << 18;
+  spadger::FdTable<Item> table;
+  std::vector<spadger::Thread::ptr> thrs;
+  for (int t = 0; t < threads; ++t) {
+    thrs.emplace_back(new spadger::Thread(
+        [&table, n, t]() {
+          unsigned seed = t;
+          for (int i = 0; i < n; ++i) {
+            int fd = rand_r(&seed) % MAX_FD;
+            Item *item = table.get(fd, true);
+            SPADGER_ASSERT(item->fd == fd);
+            ++item->hits;
+          }
+        },
+        "fd_" + std::to_string(t)));
+  }
+  for (auto &thr : thrs) {
+    thr->join();
+  }
+  long total = 0;
+  for (int fd = 0; fd < MAX_FD; ++fd) {
+    Item *item = table.get(fd);
+    SPADGER_ASSERT(item && item->fd == fd);
+    total += item->hits;
+  }
+  SPADGER_ASSERT(total == (long)threads * n);
+  SPADGER_LOG_INFO(g_logger) << "test_concurrent ok threads=" << threads;
+}
+
+// fd关掉之后同号的fd又打开了: 按上一个fd的代数取消 不能动新fd上的等待
+void test_generation() {
+  spadger::IOManager iom(1, false, "gen");
+  iom.schedule([&iom]() {
+    int sv[2];
+    SPADGER_ASSERT(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+    spadger::FdCtx *ctx = spadger::FdMgr::GetInstance()->get(sv[0], true);
+    uint32_t gen = ctx->getGeneration();
+    close(sv[0]);
+    close(sv[1]);
+
+    int fd = sv[0];
+    SPADGER_ASSERT(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+    SPADGER_ASSERT(sv[0] == fd);
+    SPADGER_ASSERT(spadger::FdMgr::GetInstance()->get(fd, true) == ctx);
+    SPADGER_ASSERT(ctx->getGeneration() != gen);
+
+    bool woke = false;
+    iom.schedule([fd, &woke]() {
+      char c;
+      SPADGER_ASSERT(read(fd, &c, 1) == 1);
+      woke = true;
+    });
+    usleep(1000);
+    SPADGER_ASSERT(!iom.cancelEvent(fd, spadger::IOManager::READ, gen));
+    SPADGER_ASSERT(!woke);
+    SPADGER_ASSERT(write(sv[1], "x", 1) == 1);
+    usleep(1000);
+    SPADGER_ASSERT(woke);
+    close(sv[0]);
+    close(sv[1]);
+  });
+  iom.stop();
+  SPADGER_LOG_INFO(g_logger) << "test_generation ok";
+}
+
+// 没开hook的线程(main)关掉fd: 记录也要作废 同号的新fd要重新注册到epoll
+void test_unhooked_close() {
+  spadger::Config::Lookup<bool>("iomanager.epoll.persistent")->setValue(true);
+  spadger::IOManager iom(1, false, "unhooked");
+  int sv[2];
+  SPADGER_ASSERT(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+  int fd = sv[0];
+  std::atomic<bool> done = {false};
+  iom.schedule([&iom, sv, &done]() {
+    spadger::FdMgr::GetInstance()->get(sv[0], true);
+    int peer = sv[1];
+    iom.schedule([peer]() {
+      usleep(10 * 1000);
+      SPADGER_ASSERT(write(peer, "x", 1) == 1);
+    });
+    char c;
+    SPADGER_ASSERT(read(sv[0], &c, 1) == 1);
+    done = true;
+  });
+  while (!done) {
+    usleep(1000);
+  }
+  SPADGER_ASSERT(!spadger::is_hook_enable());
+  close(sv[0]);
+  close(sv[1]);
+
+  done = false;
+  iom.schedule([&iom, fd, &done]() {
+    int sv[2];
+    SPADGER_ASSERT(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+    SPADGER_ASSERT(sv[0] == fd);
+    spadger::FdMgr::GetInstance()->get(fd, true);
+    timeval tv = {1, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    int peer = sv[1];
+    iom.schedule([peer]() {
+      usleep(10 * 1000);
+      SPADGER_ASSERT(write(peer, "y", 1) == 1);
+    });
+    char c;
+    // 带副作用的不要放进SPADGER_ASSERT 失败时assert会再读一次
+    ssize_t n = read(fd, &c, 1);
+    SPADGER_ASSERT(n == 1 && c == 'y');
+    close(sv[0]);
+    close(sv[1]);
+    done = true;
+  });
+  iom.stop();
+  SPADGER_ASSERT(done);
+  spadger::Config::Lookup<bool>("iomanager.epoll.persistent")->setValue(false);
+  SPADGER_LOG_INFO(g_logger) << "test_unhooked_close ok";
+}
+
+// io_uring上还在收的fd被关掉: 操作要被取消 协程醒来(没设超时)
+// cancel_fd=false时模拟老内核 按记下的操作逐个取消
+void test_uring_close(bool cancel_fd) {
+  spadger::Config::Lookup<std::string>("iomanager.backend")
+      ->setValue("io_uring");
+  spadger::Config::Lookup<bool>("iomanager.uring.cancel_fd")
+      ->setValue(cancel_fd);
+  std::atomic<bool> done = {false};
+  {
+    spadger::IOManager iom(1, false, "uring_close");
+    iom.schedule([&iom, &done]() {
+      int sv[2];
+      SPADGER_ASSERT(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+      spadger::FdMgr::GetInstance()->get(sv[0], true);
+      int fd = sv[0];
+      iom.schedule([fd]() {
+        usleep(20 * 1000);
+        close(fd);
+      });
+      char c;
+      uint64_t begin = spadger::getMonotonicUS();
+      ssize_t n = recv(fd, &c, 1, 0);
+      uint64_t used = spadger::getMonotonicUS() - begin;
+      SPADGER_ASSERT(n == -1 && used < 1000 * 1000);
+      close(sv[1]);
+      done = true;
+    });
+  }
+  SPADGER_ASSERT(done);
+  spadger::Config::Lookup<std::string>("iomanager.backend")->setValue("epoll");
+  spadger::Config::Lookup<bool>("iomanager.uring.cancel_fd")->setValue(true);
+  SPADGER_LOG_INFO(g_logger) << "test_uring_close cancel_fd=" << cancel_fd
+                             << " ok";
+}
+
+// 和hook里一样: 每次系统调用前查一次FdCtx
+void bench(int threads, int n) {
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  spadger::FdMgr::GetInstance()->get(fd, true);
+  std::vector<spadger::Thread::ptr> thrs;
+  uint64_t begin = spadger::getMonotonicUS();
+  for (int t = 0; t < threads; ++t) {
+    thrs.emplace_back(new spadger::Thread(
+        [fd, n]() {
+          for (int i = 0; i < n; ++i) {
+            SPADGER_ASSERT(spadger::FdMgr::GetInstance()->get(fd));
+          }
+        },
+        "bench_" + std::to_string(t)));
+  }
+  for (auto &thr : thrs) {
+    thr->join();
+  }
+  uint64_t used = spadger::getMonotonicUS() - begin;
+  SPADGER_LOG_INFO(g_logger) << "FdMgr::get threads=" << threads << " "
+                             << used * 1000 / n << "ns/op";
+  spadger::FdMgr::GetInstance()->del(fd);
+  SPADGER_ASSERT(!spadger::FdMgr::GetInstance()->get(fd));
+  close(fd);
+}
+
+int main(int argc, char **argv) {
+  int threads = argc > 1 ? atoi(argv[1]) : 4;
+  int n = argc > 2 ? atoi(argv[2]) : 10000000;
+  test_index();
+  test_concurrent(threads, n / 10);
+  test_generation();
+  test_unhooked_close();
+  test_uring_close(true);
+  test_uring_close(false);
+  bench(1, n);
+  bench(threads, n);
+  return 0;
+}
@@ -8,6 +8,9 @@
 #include "fiber.h"
 #include "spadger.h"
 #include <iostream>
+#include <signal.h>
+#include <sys/wait.h>
+#include <unistd.h>
 spadger::Logger::ptr logger = SPADGER_LOG_ROOT();
 
 void run_in_fiber() {
@@ -30,6 +33,121 @@ void test_fiber() {
   std::cout << "--------------------------------" << std::endl;
 }
 
+// 共享栈协程: 每个协程在栈上留一段数据, 切出去被别的协程挤掉后再切回来检查
+void test_shared_stack() {
+  spadger::Fiber::GetThis();
+  std::vector<spadger::Fiber::ptr> fibers;
+  for (int i = 0; i < 16; ++i) {
+    fibers.push_back(spadger::Fiber::ptr(new spadger::Fiber(
+        [i]() {
+          char buf[4096];
+          memset(buf, i, sizeof(buf));
+          spadger::Fiber::GetThis()->back();
+          for (auto c : buf) {
+            SPADGER_ASSERT(c == (char)i);
+          }
+          SPADGER_LOG_INFO(logger) << "shared stack fiber " << i << " ok";
+        },
+        0, true, true)));
+  }
+  for (auto &i : fibers) {
+    i->call();
+  }
+  for (auto &i : fibers) {
+    i->call();
+  }
+}
+
+// 协程栈池: 协程析构后栈留在本线程 下一个同样大小的协程直接复用
+// 缓存的总数不超过fiber.stack_pool.max_cached
+static const size_t kPoolStack = 64 * 1024; // 单独的大小 不和别的协程混
+
+void test_stack_pool() {
+  spadger::Fiber::GetThis();
+  char *first = nullptr;
+  for (int i = 0; i < 100; ++i) {
+    char *addr = nullptr;
+    spadger::Fiber::ptr fiber(new spadger::Fiber(
+        [&addr]() {
+          char local;
+          addr = &local;
+        },
+        kPoolStack, true));
+    fiber->call();
+    if (!first) {
+      first = addr;
+    }
+    SPADGER_ASSERT(addr == first); // 同一个栈 同一个位置
+  }
+
+  spadger::ConfigVar<uint32_t>::ptr max_cached =
+      spadger::Config::Lookup<uint32_t>("fiber.stack_pool.max_cached");
+  uint64_t base = spadger::Fiber::CachedStacks();
+  max_cached->setValue(base + 2);
+  {
+    std::vector<spadger::Fiber::ptr> fibers;
+    for (int i = 0; i < 8; ++i) {
+      fibers.push_back(
+          spadger::Fiber::ptr(new spadger::Fiber([]() {}, kPoolStack, true)));
+      fibers.back()->call();
+    }
+    SPADGER_ASSERT(spadger::Fiber::CachedStacks() == base - 1);
+  }
+  // 8个栈还回来 只留到上限 其余的munmap
+  SPADGER_ASSERT(spadger::Fiber::CachedStacks() == base + 2);
+  max_cached->setValue(1024);
+  SPADGER_LOG_INFO(logger) << "stack pool ok cached="
+                           << spadger::Fiber::CachedStacks();
+}
+
+// 线程退出时栈缓存先析构了 更晚析构的thread_local里的协程的栈直接还给系统
+struct FiberHolder {
+  spadger::Fiber::ptr fiber;
+};
+
+void test_stack_pool_exit() {
+  uint64_t base = spadger::Fiber::CachedStacks();
+  spadger::Thread::ptr thr(new spadger::Thread(
+      []() {
+        static thread_local FiberHolder holder; // 比栈缓存先构造 后析构
+        spadger::Fiber::GetThis();
+        holder.fiber.reset(new spadger::Fiber([]() {}, kPoolStack, true));
+        holder.fiber->call();
+      },
+      "pool_exit"));
+  thr->join();
+  uint64_t cached = spadger::Fiber::CachedStacks();
+  SPADGER_ASSERT(cached == base);
+  SPADGER_LOG_INFO(logger) << "stack pool exit ok";
+}
+
+// 栈溢出撞到guard page: 子进程里无限递归 应该被SIGSEGV杀掉
+static int overflow(int depth) {
+  volatile char buf[1024];
+  buf[0] = depth;
+  if (depth > (1 << 20)) { // 1G 早就撞到了
+    return buf[0];
+  }
+  return overflow(depth + 1) + buf[0];
+}
+
+void test_guard_page() {
+  pid_t pid = fork();
+  SPADGER_ASSERT(pid >= 0);
+  if (pid == 0) {
+    spadger::Fiber::GetThis();
+    spadger::Fiber::ptr fiber(
+        new spadger::Fiber([]() { overflow(0); }, kPoolStack, true));
+    fiber->call();
+    _exit(0);
+  }
+  int status = 0;
+  pid_t rt = waitpid(pid, &status, 0);
+  SPADGER_ASSERT(rt == pid);
+  SPADGER_ASSERT(WIFSIGNALED(status) && WTERMSIG(status) == SIGSEGV);
+  SPADGER_LOG_INFO(logger) << "guard page ok";
+}
+
 int main1() {
   spadger::Thread::SetName("main");
   test_fiber();
@@ -38,6 +156,10 @@ int main1() {
 
 int main(int argc, char **argv) {
   spadger::Thread::SetName("main");
+  test_shared_stack();
+  test_stack_pool();
+  test_stack_pool_exit();
+  test_guard_page();
 
   std::vector<spadger::Thread::ptr> thrs;
   for (int i = 0; i < 3; i++) {
@@ -0,0 +1,123 @@
+/*
+ * @Author: lxk
+ * @Date: 2022-11-11 14:05:27
+ * @LastEditors: lxk
+ * @LastEditTime: 2022-11-11 19:22:10
+ */
+#include "fd_manager.h"
+#include "hook.h"
+#include "iomanager.h"
+#include "spadger.h"
+#include <errno.h>
+#include <sstream>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+// 协程里的普通文件IO: epoll后端走OffloadPool io_uring后端走io_uring
+// 结果和直接调用一样 统计按类计数 单个fd可以关掉
+
+static spadger::Logger::ptr g_logger = SPADGER_LOG_ROOT();
+
+static uint64_t async_count(spadger::FileIoOp op) {
+  spadger::FileIoStats stats = spadger::get_file_io_stats(op);
+  return stats.uring + stats.offload;
+}
+
+void test_file(const std::string &path) {
+  bool uring = spadger::IOManager::GetThis()->hasUring();
+  spadger::FileIoStats old_read =
+      spadger::get_file_io_stats(spadger::FILE_IO_READ);
+  spadger::FileIoStats old_write =
+      spadger::get_file_io_stats(spadger::FILE_IO_WRITE);
+  uint64_t opens = async_count(spadger::FILE_IO_OPEN);
+  uint64_t syncs = async_count(spadger::FILE_IO_SYNC);
+
+  int fd = open(path.c_str(), O_CREAT | O_RDWR | O_TRUNC, 0644);
+  uint64_t count = async_count(spadger::FILE_IO_OPEN);
+  SPADGER_ASSERT(fd >= 0);
+  SPADGER_ASSERT(count == opens + 1);
+  spadger::FdCtx *ctx = spadger::FdMgr::GetInstance()->get(fd);
+  SPADGER_ASSERT(ctx && ctx->isFile() && !ctx->isSocket());
+
+  ssize_t n = write(fd, "hello ", 6);
+  SPADGER_ASSERT(n == 6);
+  iovec iov[2] = {{(void *)"fiber ", 6}, {(void *)"world", 5}};
+  n = writev(fd, iov, 2);
+  SPADGER_ASSERT(n == 11);
+  n = pwrite(fd, "F", 1, 6);
+  SPADGER_ASSERT(n == 1);
+  int rt = fsync(fd);
+  SPADGER_ASSERT(rt == 0);
+  rt = fdatasync(fd);
+  SPADGER_ASSERT(rt == 0);
+
+  char buf[32] = {0};
+  n = pread(fd, buf, sizeof(buf), 0);
+  SPADGER_ASSERT(n == 17);
+  SPADGER_ASSERT(std::string(buf) == "hello Fiber world");
+  // read/readv从当前位置读
+  off_t off = lseek(fd, 6, SEEK_SET);
+  SPADGER_ASSERT(off == 6);
+  memset(buf, 0, sizeof(buf));
+  n = read(fd, buf, 5);
+  SPADGER_ASSERT(n == 5);
+  SPADGER_ASSERT(std::string(buf) == "Fiber");
+  char a[3] = {0}, b[4] = {0};
+  iovec riov[2] = {{a, 2}, {b, 3}};
+  n = readv(fd, riov, 2);
+  SPADGER_ASSERT(n == 5);
+  SPADGER_ASSERT(std::string(a) == " w" && std::string(b) == "orl");
+  off = lseek(fd, 0, SEEK_CUR);
+  SPADGER_ASSERT(off == 16);
+
+  spadger::FileIoStats rd = spadger::get_file_io_stats(spadger::FILE_IO_READ);
+  spadger::FileIoStats wr = spadger::get_file_io_stats(spadger::FILE_IO_WRITE);
+  SPADGER_ASSERT(rd.calls - old_read.calls == 3);
+  SPADGER_ASSERT(rd.bytes - old_read.bytes == 27);
+  SPADGER_ASSERT(wr.calls - old_write.calls == 3);
+  SPADGER_ASSERT(wr.bytes - old_write.bytes == 18);
+  SPADGER_ASSERT((uring ? wr.uring - old_write.uring
+                        : wr.offload - old_write.offload) == 3);
+  count = async_count(spadger::FILE_IO_SYNC);
+  SPADGER_ASSERT(count == syncs + 2);
+
+  // 这个fd不要异步 直接调用 不计数
+  ctx->setFileAsync(false);
+  n = pread(fd, buf, 5, 0);
+  count = spadger::get_file_io_stats(spadger::FILE_IO_READ).calls;
+  SPADGER_ASSERT(n == 5);
+  SPADGER_ASSERT(count == rd.calls);
+  ctx->setFileAsync(true);
+  close(fd);
+
+  // 错误码带回来
+  fd = open(path.c_str(), O_WRONLY);
+  SPADGER_ASSERT(fd >= 0);
+  errno = 0;
+  n = read(fd, buf, 1);
+  SPADGER_ASSERT(n == -1 && errno == EBADF);
+  close(fd);
+  errno = 0;
+  fd = open((path + ".nonexist/x").c_str(), O_RDONLY);
+  SPADGER_ASSERT(fd == -1 && errno == ENOENT);
+  rt = unlink(path.c_str());
+  SPADGER_ASSERT(rt == 0);
+
+  std::stringstream ss;
+  spadger::dump_file_io_stats(ss);
+  SPADGER_LOG_INFO(g_logger) << "test_file ok uring=" << uring << " "
+                             << ss.str();
+}
+
+int main(int argc, char **argv) {
+  std::string path = "/tmp/spadger_file_io_" + std::to_string(getpid());
+  const char *backends[] = {"epoll", "io_uring"};
+  for (const char *backend : backends) {
+    spadger::Config::Lookup<std::string>("iomanager.backend")
+        ->setValue(backend);
+    spadger::IOManager iom(2, false, backend);
+    iom.schedule(std::bind(test_file, path));
+  }
+  return 0;
+}
@@ -0,0 +1,108 @@
+/*
+ * @Author: lxk
+ * @Date: 2022-11-10 16:31:08
+ * @LastEditors: lxk
+ * @LastEditTime: 2022-11-10 20:52:40
+ */
+#include "iomanager.h"
+#include "offload.h"
+#include "spadger.h"
+#include <atomic>
+#include <sstream>
+#include <stdexcept>
+#include <unistd.h>
+
+// 阻塞调用放到OffloadPool: 单线程的IOManager里别的协程照常跑
+// 返回值/异常带回来 回到原来的调度器 排队的统计
+
+static spadger::Logger::ptr g_logger = SPADGER_LOG_ROOT();
+
+static std::atomic<int> s_ticks = {0};
+static std::atomic<bool> s_done = {false};
+
+void test_run(spadger::IOManager *iom) {
+  spadger::OffloadPool *pool = spadger::OffloadMgr::GetInstance();
+  int before = s_ticks;
+  int rt = pool->run([]() {
+    SPADGER_ASSERT(!spadger::Scheduler::GetThis());
+    usleep(200 * 1000); // 池里的线程没有hook 真的阻塞
+    return 42;
+  });
+  SPADGER_ASSERT(rt == 42);
+  SPADGER_ASSERT(spadger::Scheduler::GetThis() == iom);
+  SPADGER_ASSERT(s_ticks - before >= 10);
+
+  std::string str = pool->run([]() { return std::string("hello"); });
+  SPADGER_ASSERT(str == "hello");
+
+  bool called = false;
+  pool->run([&called]() { called = true; });
+  SPADGER_ASSERT(called);
+
+  bool caught = false;
+  try {
+    pool->run([]() -> int { throw std::runtime_error("offload"); });
+  } catch (std::runtime_error &e) {
+    caught = std::string(e.what()) == "offload";
+  }
+  SPADGER_ASSERT(caught);
+  SPADGER_LOG_INFO(g_logger) << "test_run ok ticks=" << s_ticks - before;
+}
+
+// offload.threads=2 8个50ms的调用: 最多排6个 后面的要等
+void test_queue(spadger::IOManager *iom) {
+  static const int N = 8;
+  static std::atomic<int> finished = {0};
+  spadger::OffloadPool *pool = spadger::OffloadMgr::GetInstance();
+  spadger::OffloadPool::Stats old = pool->getStats();
+  uint64_t begin = spadger::getMonotonicUS();
+  for (int i = 0; i < N; ++i) {
+    iom->schedule([pool]() {
+      pool->run([]() { usleep(50 * 1000); });
+      ++finished;
+    });
+  }
+  while (finished < N) {
+    usleep(10 * 1000);
+  }
+  uint64_t used = spadger::getMonotonicUS() - begin;
+  spadger::OffloadPool::Stats stats = pool->getStats();
+  SPADGER_ASSERT(stats.threads == 2);
+  SPADGER_ASSERT(stats.completed - old.completed == N);
+  SPADGER_ASSERT(stats.queued == 0 && stats.running == 0);
+  SPADGER_ASSERT(stats.maxQueued >= N - 2);
+  SPADGER_ASSERT(stats.maxWaitUS >= 100 * 1000);
+  SPADGER_ASSERT(used >= 200 * 1000);
+  std::stringstream ss;
+  pool->dump(ss);
+  SPADGER_LOG_INFO(g_logger) << "test_queue ok used=" << used / 1000 << "ms "
+                             << ss.str();
+}
+
+int main(int argc, char **argv) {
+  spadger::Config::Lookup<uint32_t>("offload.threads")->setValue(2);
+
+  // 不在协程里: 直接执行
+  spadger::OffloadPool *pool = spadger::OffloadMgr::GetInstance();
+  SPADGER_ASSERT(pool->run([]() { return 1; }) == 1);
+  SPADGER_ASSERT(pool->getStats().submitted == 0);
+
+  {
+    spadger::IOManager iom(1, false, "offload");
+    iom.schedule([]() {
+      while (!s_done) {
+        ++s_ticks;
+        usleep(10 * 1000);
+      }
+    });
+    iom.schedule([&iom]() {
+      test_run(&iom);
+      s_done = true;
+    });
+  }
+  {
+    spadger::IOManager iom(1, false, "offload_queue");
+    test_queue(&iom);
+  }
+  return 0;
+}
@@ -0,0 +1,251 @@
+/*
+ * @Author: lxk
+ * @Date: 2022-11-12 10:26:41
+ * @LastEditors: lxk
+ * @LastEditTime: 2022-11-12 16:08:53
+ */
+#include "hook.h"
+#include "iomanager.h"
+#include "spadger.h"
+#include <atomic>
+#include <errno.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+// 协程里的poll/select/epoll_wait: 单线程的IOManager里等着的时候别的协程照常跑
+// 别的协程写了就醒 超时返回0 结果和原版一样
+
+static spadger::Logger::ptr g_logger = SPADGER_LOG_ROOT();
+
+static std::atomic<int> s_ticks = {0};
+static std::atomic<bool> s_done = {false};
+
+// 100ms之后往fd写一个字节
+static void write_later(int fd) {
+  spadger::IOManager::GetThis()->schedule([fd]() {
+    usleep(100 * 1000);
+    ssize_t n = write(fd, "x", 1);
+    SPADGER_ASSERT(n == 1);
+  });
+}
+
+// 进程用掉的CPU时间
+static uint64_t cpu_us() {
+  timespec ts;
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+  return ts.tv_sec * 1000000ull + ts.tv_nsec / 1000;
+}
+
+void test_poll(int sv[2], int pfd[2]) {
+  // 写端马上可写 不用等
+  pollfd fds[3] = {{sv[0], POLLIN, 0}, {pfd[0], POLLIN, 0}, {-1, POLLIN, 0}};
+  pollfd wfd = {pfd[1], POLLOUT, 0};
+  int rt = poll(&wfd, 1, 1000);
+  SPADGER_ASSERT(rt == 1 && wfd.revents == POLLOUT);
+
+  // 超时
+  uint64_t begin = spadger::getMonotonicUS();
+  int ticks = s_ticks;
+  rt = poll(fds, 3, 100);
+  uint64_t used = spadger::getMonotonicUS() - begin;
+  ticks = s_ticks - ticks;
+  SPADGER_ASSERT(rt == 0);
+  SPADGER_ASSERT(used >= 90 * 1000 && used < 500 * 1000);
+  SPADGER_ASSERT(ticks >= 5);
+
+  // 同一个fd出现两次 只等POLLIN 可写不能把它叫醒 (叫醒了就是一直空转)
+  pollfd dup[2] = {{sv[0], POLLIN, 0}, {sv[0], POLLIN, 0}};
+  ticks = s_ticks;
+  uint64_t cpu = cpu_us();
+  rt = poll(dup, 2, 200);
+  cpu = cpu_us() - cpu;
+  ticks = s_ticks - ticks;
+  SPADGER_ASSERT(rt == 0 && dup[0].revents == 0 && dup[1].revents == 0);
+  SPADGER_ASSERT(ticks >= 10);
+  SPADGER_ASSERT(cpu < 50 * 1000);
+
+  // 管道有数据了
+  write_later(pfd[1]);
+  ticks = s_ticks;
+  rt = poll(fds, 3, -1);
+  ticks = s_ticks - ticks;
+  SPADGER_ASSERT(rt == 1);
+  SPADGER_ASSERT(fds[0].revents == 0 && fds[1].revents == POLLIN &&
+                 fds[2].revents == 0);
+  SPADGER_ASSERT(ticks >= 5);
+  char c;
+  ssize_t n = read(pfd[0], &c, 1);
+  SPADGER_ASSERT(n == 1);
+
+  // 对端关了
+  int tmp[2];
+  rt = socketpair(AF_UNIX, SOCK_STREAM, 0, tmp);
+  SPADGER_ASSERT(rt == 0);
+  spadger::IOManager::GetThis()->schedule([tmp]() {
+    usleep(50 * 1000);
+    close(tmp[1]);
+  });
+  pollfd hup = {tmp[0], POLLIN | POLLRDHUP, 0};
+  rt = poll(&hup, 1, 1000);
+  SPADGER_ASSERT(rt == 1);
+  SPADGER_ASSERT(hup.revents & (POLLIN | POLLRDHUP));
+  close(tmp[0]);
+
+  // 无效的fd
+  pollfd bad = {1000, POLLIN, 0};
+  rt = poll(&bad, 1, 1000);
+  SPADGER_ASSERT(rt == 1 && bad.revents == POLLNVAL);
+
+  // 当sleep用
+  begin = spadger::getMonotonicUS();
+  rt = poll(nullptr, 0, 50);
+  used = spadger::getMonotonicUS() - begin;
+  SPADGER_ASSERT(rt == 0);
+  SPADGER_ASSERT(used >= 45 * 1000);
+  SPADGER_LOG_INFO(g_logger) << "poll ok";
+}
+
+void test_select(int sv[2], int pfd[2]) {
+  int nfds = std::max(sv[0], pfd[0]) + 1;
+  fd_set rset;
+  FD_ZERO(&rset);
+  FD_SET(sv[0], &rset);
+  FD_SET(pfd[0], &rset);
+  timeval tv = {0, 100 * 1000};
+  int ticks = s_ticks;
+  int rt = select(nfds, &rset, nullptr, nullptr, &tv);
+  ticks = s_ticks - ticks;
+  SPADGER_ASSERT(rt == 0);
+  SPADGER_ASSERT(!FD_ISSET(sv[0], &rset) && !FD_ISSET(pfd[0], &rset));
+  SPADGER_ASSERT(tv.tv_sec == 0 && tv.tv_usec == 0);
+  SPADGER_ASSERT(ticks >= 5);
+
+  write_later(sv[1]);
+  FD_SET(sv[0], &rset);
+  FD_SET(pfd[0], &rset);
+  fd_set wset;
+  FD_ZERO(&wset);
+  tv.tv_sec = 5;
+  tv.tv_usec = 0;
+  rt = select(nfds, &rset, &wset, nullptr, &tv);
+  SPADGER_ASSERT(rt == 1);
+  SPADGER_ASSERT(FD_ISSET(sv[0], &rset) && !FD_ISSET(pfd[0], &rset));
+  // 剩下的时间写回来了
+  SPADGER_ASSERT(tv.tv_sec == 4 && tv.tv_usec > 0);
+  char c;
+  ssize_t n = read(sv[0], &c, 1);
+  SPADGER_ASSERT(n == 1);
+
+  // 可写的 可读的一起算
+  FD_ZERO(&rset);
+  FD_ZERO(&wset);
+  FD_SET(pfd[0], &rset);
+  FD_SET(pfd[1], &wset);
+  nfds = std::max(pfd[0], pfd[1]) + 1;
+  rt = select(nfds, &rset, &wset, nullptr, nullptr);
+  SPADGER_ASSERT(rt == 1);
+  SPADGER_ASSERT(!FD_ISSET(pfd[0], &rset) && FD_ISSET(pfd[1], &wset));
+
+  // 关掉的fd
+  int tmp[2];
+  rt = pipe(tmp);
+  SPADGER_ASSERT(rt == 0);
+  close(tmp[1]);
+  close(tmp[0]);
+  FD_ZERO(&rset);
+  FD_SET(tmp[0], &rset);
+  errno = 0;
+  rt = select(tmp[0] + 1, &rset, nullptr, nullptr, nullptr);
+  SPADGER_ASSERT(rt == -1 && errno == EBADF);
+  SPADGER_LOG_INFO(g_logger) << "select ok";
+}
+
+void test_epoll_wait(int sv[2], int pfd[2]) {
+  int epfd = epoll_create1(EPOLL_CLOEXEC);
+  SPADGER_ASSERT(epfd >= 0);
+  epoll_event ev;
+  ev.events = EPOLLIN;
+  ev.data.fd = pfd[0];
+  int rt = epoll_ctl(epfd, EPOLL_CTL_ADD, pfd[0], &ev);
+  SPADGER_ASSERT(rt == 0);
+
+  epoll_event events[4];
+  int ticks = s_ticks;
+  uint64_t begin = spadger::getMonotonicUS();
+  rt = epoll_wait(epfd, events, 4, 100);
+  uint64_t used = spadger::getMonotonicUS() - begin;
+  ticks = s_ticks - ticks;
+  SPADGER_ASSERT(rt == 0);
+  SPADGER_ASSERT(used >= 90 * 1000);
+  SPADGER_ASSERT(ticks >= 5);
+
+  write_later(pfd[1]);
+  ticks = s_ticks;
+  rt = epoll_wait(epfd, events, 4, -1);
+  ticks = s_ticks - ticks;
+  SPADGER_ASSERT(rt == 1);
+  SPADGER_ASSERT(events[0].data.fd == pfd[0] && events[0].events == EPOLLIN);
+  SPADGER_ASSERT(ticks >= 5);
+  // 水平触发 没读还是就绪
+  rt = epoll_wait(epfd, events, 4, 1000);
+  SPADGER_ASSERT(rt == 1);
+  char c;
+  ssize_t n = read(pfd[0], &c, 1);
+  SPADGER_ASSERT(n == 1);
+
+  // 等的时候再加进来的fd
+  spadger::IOManager::GetThis()->schedule([epfd, sv]() {
+    usleep(50 * 1000);
+    epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.fd = sv[0];
+    int rt = epoll_ctl(epfd, EPOLL_CTL_ADD, sv[0], &ev);
+    SPADGER_ASSERT(rt == 0);
+  });
+  write_later(sv[1]);
+  rt = epoll_wait(epfd, events, 4, 1000);
+  SPADGER_ASSERT(rt == 1);
+  SPADGER_ASSERT(events[0].data.fd == sv[0]);
+  n = read(sv[0], &c, 1);
+  SPADGER_ASSERT(n == 1);
+  close(epfd);
+  SPADGER_LOG_INFO(g_logger) << "epoll_wait ok";
+}
+
+void run(bool uring) {
+  int sv[2], pfd[2];
+  int rt = socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+  SPADGER_ASSERT(rt == 0);
+  rt = pipe(pfd);
+  SPADGER_ASSERT(rt == 0);
+  test_poll(sv, pfd);
+  test_select(sv, pfd);
+  test_epoll_wait(sv, pfd);
+  for (int i = 0; i < 2; ++i) {
+    close(sv[i]);
+    close(pfd[i]);
+  }
+  SPADGER_LOG_INFO(g_logger) << "uring=" << uring << " ticks=" << s_ticks;
+}
+
+int main(int argc, char **argv) {
+  const char *backends[] = {"epoll", "io_uring"};
+  for (const char *backend : backends) {
+    spadger::Config::Lookup<std::string>("iomanager.backend")
+        ->setValue(backend);
+    spadger::IOManager iom(1, false, backend);
+    s_done = false;
+    iom.schedule([]() {
+      while (!s_done) {
+        ++s_ticks;
+        usleep(10 * 1000);
+      }
+    });
+    iom.schedule([]() {
+      run(spadger::IOManager::GetThis()->hasUring());
+      s_done = true;
+    });
+  }
+  return 0;
+}
@@ -0,0 +1,56 @@
+/*
+ * @Author: lxk
+ * @Date: 2022-10-26 15:08:21
+ * @LastEditors: lxk
+ * @LastEditTime: 2022-10-26 16:12:47
+ */
+#include "iomanager.h"
+#include "spadger.h"
+#include <atomic>
+#include <stdlib.h>
+
+// 调度器扩展性测试: 线程数从1增加到N 统计每秒执行的任务数
+// 外部线程提交一批任务 每个任务再在工作线程里派生子任务(走本地队列)
+// 用法: scheduler_scale_test [最大线程数] [根任务数]
+
+static spadger::Logger::ptr g_logger = SPADGER_LOG_ROOT();
+
+static const int s_fanout = 8;
+static std::atomic<uint64_t> s_done = {0};
+
+static void leaf() { ++s_done; }
+
+static void root() {
+  ++s_done;
+  for (int i = 0; i < s_fanout; ++i) {
+    spadger::Scheduler::GetThis()->schedule(&leaf);
+  }
+}
+
+static void bench(int threads, int roots) {
+  s_done = 0;
+  uint64_t begin = spadger::getCurrentUS();
+  {
+    // 基类Scheduler的idle是忙等 用IOManager才能体现空闲线程的开销
+    spadger::IOManager iom(threads, false, "scale");
+    for (int i = 0; i < roots; ++i) {
+      iom.schedule(&root);
+    }
+  } // 析构时stop 等所有任务执行完
+  uint64_t used = spadger::getCurrentUS() - begin;
+  uint64_t total = s_done;
+  SPADGER_LOG_INFO(g_logger)
+      << "threads=" << threads << " tasks=" << total << " used=" << used
+      << "us " << (uint64_t)(total * 1000000.0 / (used ? used : 1))
+      << " tasks/s";
+}
+
+int main(int argc, char **argv) {
+  g_logger->setLevel(spadger::LogLevel::INFO);
+  int max_threads = argc > 1 ? atoi(argv[1]) : 4;
+  int roots = argc > 2 ? atoi(argv[2]) : 100000;
+  for (int n = 1; n <= max_threads; ++n) {
+    bench(n, roots);
+  }
+  return 0;
+}
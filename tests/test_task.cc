@@ -0,0 +1,89 @@
+/*
+ * @Author: lxk
+ * @Date: 2022-10-27 16:05:12
+ * @LastEditors: lxk
+ * @LastEditTime: 2022-10-27 16:40:31
+ */
+#include "iomanager.h"
+#include "spadger.h"
+#include <atomic>
+#include <stdlib.h>
+
+// 统计operator new的次数 看调度小lambda的时候有没有分配内存
+static std::atomic<uint64_t> s_news = {0};
+
+void *operator new(size_t size) {
+  ++s_news;
+  void *p = malloc(size);
+  if (!p) {
+    throw std::bad_alloc();
+  }
+  return p;
+}
+void operator delete(void *p) noexcept { free(p); }
+void operator delete(void *p, size_t) noexcept { free(p); }
+
+static spadger::Logger::ptr g_logger = SPADGER_LOG_ROOT();
+
+void test_task() {
+  int count = 0;
+  std::shared_ptr<int> sp(new int(1));
+  spadger::Task t1([&count, sp]() { ++count; });
+  SPADGER_ASSERT(t1 && t1.isInline());
+  spadger::Task t2(std::move(t1));
+  SPADGER_ASSERT(!t1 && t2);
+  t2();
+  SPADGER_ASSERT(count == 1 && sp.use_count() == 2);
+  t2 = nullptr;
+  SPADGER_ASSERT(sp.use_count() == 1);
+
+  // 超过INLINE_SIZE的放到堆上
+  char big[128] = {0};
+  spadger::Task t3([big, &count]() { count += big[0] + 1; });
+  SPADGER_ASSERT(!t3.isInline());
+  t3();
+  SPADGER_ASSERT(count == 2);
+
+  void (*null_fn)() = nullptr;
+  SPADGER_ASSERT(!spadger::Task(null_fn));
+  SPADGER_ASSERT(!spadger::Task(std::function<void()>()));
+  SPADGER_LOG_INFO(g_logger) << "test_task ok";
+}
+
+static std::atomic<int> s_done = {0};
+
+void test_schedule() {
+  static const int N = 100000;
+  spadger::IOManager iom(1, false, "task");
+  iom.schedule([]() {
+    // 先跑一轮 让本地队列和协程池都分配好
+    for (int i = 0; i < N; ++i) {
+      spadger::Scheduler::GetThis()->schedule([]() { ++s_done; });
+    }
+  });
+  while (s_done < N) {
+    usleep(1000);
+  }
+  uint64_t before = s_news;
+  iom.schedule([]() {
+    int a = 1, b = 2;
+    void *p = nullptr;
+    for (int i = 0; i < N; ++i) {
+      spadger::Scheduler::GetThis()->schedule([a, b, p]() {
+        (void)a, (void)b, (void)p;
+        ++s_done;
+      });
+    }
+  });
+  while (s_done < 2 * N) {
+    usleep(1000);
+  }
+  SPADGER_LOG_INFO(g_logger)
+      << "schedule " << N << " lambdas: " << (s_news - before) << " news";
+}
+
+int main(int argc, char **argv) {
+  test_task();
+  test_schedule();
+  return 0;
+}
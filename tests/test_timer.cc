@@ -0,0 +1,247 @@
+/*
+ * @Author: lxk
+ * @Date: 2022-10-29 10:12:40
+ * @LastEditors: lxk
+ * @LastEditTime: 2022-10-29 16:35:08
+ */
+#include "spadger.h"
+#include "timer.h"
+#include <stdlib.h>
+#include <unistd.h>
+
+// 定时器测试: 到期顺序/取消/循环定时器 以及大量定时器下的性能
+// 用法: timer_test [定时器个数]
+
+static spadger::Logger::ptr g_logger = SPADGER_LOG_ROOT();
+
+class TestTimerManager : public spadger::TimerManager {
+public:
+  // 自己驱动: 睡到下一个定时器 再把到期的回调执行掉 返回执行了几个
+  size_t poll() {
+    uint64_t next = getNextTimer();
+    if (next) {
+      usleep(std::min<uint64_t>(next, 10) * 1000);
+    }
+    std::vector<spadger::Task> cbs;
+    listExpiredCb(cbs);
+    for (auto &cb : cbs) {
+      cb();
+    }
+    return cbs.size();
+  }
+  int tickles = 0;
+
+protected:
+  void onTimerInsertedAtFront(int) override { ++tickles; }
+};
+
+static void noop() {}
+
+void test_expire() {
+  static const int N = 2000;
+  TestTimerManager tm;
+  std::vector<uint64_t> due(N);
+  std::vector<uint64_t> fired(N, 0);
+  std::vector<spadger::Timer::ptr> timers(N);
+  for (int i = 0; i < N; ++i) {
+    uint64_t ms = rand() % 1500;
+    due[i] = spadger::getMonotonicUS() + ms * 1000;
+    timers[i] = tm.addTimer(ms, [&fired, i]() {
+      fired[i] = spadger::getMonotonicUS();
+    });
+  }
+  // 取消掉的不能执行
+  for (int i = 0; i < N; i += 10) {
+    SPADGER_ASSERT(timers[i]->cancel());
+    SPADGER_ASSERT(!timers[i]->cancel());
+  }
+
+  // 单次定时器在自己的回调里cancel: 已经到期了 返回false
+  bool self_cancel = true;
+  spadger::Timer::ptr once;
+  once = tm.addTimer(50, [&self_cancel, &once]() {
+    self_cancel = once->cancel();
+    once.reset();
+  });
+
+  // 循环定时器 执行5次之后在回调里取消自己
+  int count = 0;
+  spadger::Timer::ptr recurring;
+  recurring = tm.addTimer(
+      100,
+      [&count, &recurring]() {
+        if (++count == 5) {
+          recurring->cancel();
+        }
+      },
+      true);
+
+  while (tm.hasTimer()) {
+    tm.poll();
+  }
+  uint64_t max_late = 0;
+  for (int i = 0; i < N; ++i) {
+    if (i % 10 == 0) {
+      SPADGER_ASSERT(fired[i] == 0);
+      continue;
+    }
+    SPADGER_ASSERT(fired[i] >= due[i]);
+    max_late = std::max(max_late, fired[i] - due[i]);
+  }
+  SPADGER_ASSERT(count == 5);
+  SPADGER_ASSERT(!self_cancel);
+  SPADGER_LOG_INFO(g_logger) << "test_expire ok max_late=" << max_late
+                             << "us tickles=" << tm.tickles;
+}
+
+// 微秒定时器: 100us~2ms 按getNextTimerUS睡 不能早到
+void test_us() {
+  static const int N = 1000;
+  TestTimerManager tm;
+  std::vector<uint64_t> due(N);
+  std::vector<uint64_t> fired(N, 0);
+  for (int i = 0; i < N; ++i) {
+    uint64_t us = 100 + rand() % 1900;
+    due[i] = spadger::getMonotonicUS() + us;
+    tm.addTimerUS(us, [&fired, i]() { fired[i] = spadger::getMonotonicUS(); });
+  }
+  uint64_t total_late = 0;
+  while (tm.hasTimer()) {
+    uint64_t next = tm.getNextTimerUS();
+    if (next) {
+      usleep(next);
+    }
+    std::vector<spadger::Task> cbs;
+    tm.listExpiredCb(cbs);
+    for (auto &cb : cbs) {
+      cb();
+    }
+  }
+  for (int i = 0; i < N; ++i) {
+    SPADGER_ASSERT(fired[i] >= due[i]);
+    total_late += fired[i] - due[i];
+  }
+  // 毫秒的版本要向上取整 不然按它睡会早醒
+  tm.addTimerUS(500, &noop);
+  SPADGER_ASSERT(tm.getNextTimer() == 1);
+  SPADGER_LOG_INFO(g_logger) << "test_us ok avg_late=" << total_late / N
+                             << "us";
+}
+
+// 带slack的定时器: 不早于到期时间 不晚于到期时间+slack 醒来的次数少很多
+static int wakeups(uint64_t slack_us, uint64_t &max_late) {
+  static const int N = 2000;
+  TestTimerManager tm;
+  std::vector<uint64_t> due(N);
+  std::vector<uint64_t> fired(N, 0);
+  for (int i = 0; i < N; ++i) {
+    uint64_t us = 1000 + rand() % 200000;
+    due[i] = spadger::getMonotonicUS() + us;
+    tm.addTimerUS(
+        us, [&fired, i]() { fired[i] = spadger::getMonotonicUS(); }, false,
+        slack_us);
+  }
+  int count = 0;
+  while (tm.hasTimer()) {
+    uint64_t next = tm.getNextTimerUS();
+    if (next) {
+      usleep(next);
+    }
+    std::vector<spadger::Task> cbs;
+    tm.listExpiredCb(cbs);
+    for (auto &cb : cbs) {
+      cb();
+    }
+    count += !cbs.empty();
+  }
+  max_late = 0;
+  for (int i = 0; i < N; ++i) {
+    SPADGER_ASSERT(fired[i] >= due[i]);
+    max_late = std::max(max_late, fired[i] - due[i]);
+  }
+  return count;
+}
+
+void test_slack() {
+  uint64_t late0 = 0;
+  uint64_t late1 = 0;
+  int strict = wakeups(0, late0);
+  int slack = wakeups(10000, late1);
+  SPADGER_ASSERT(slack * 2 < strict);
+  SPADGER_LOG_INFO(g_logger) << "test_slack ok wakeups " << strict << " -> "
+                             << slack << " max_late " << late0 << "us -> "
+                             << late1 << "us";
+}
+
+void bench(int n) {
+  TestTimerManager tm;
+  std::vector<spadger::Timer::ptr> timers;
+  timers.reserve(n);
+
+  uint64_t begin = spadger::getCurrentUS();
+  for (int i = 0; i < n; ++i) {
+    timers.push_back(tm.addTimer(1000 + rand() % 600000, &noop));
+  }
+  uint64_t used = spadger::getCurrentUS() - begin;
+  SPADGER_LOG_INFO(g_logger) << "add " << n << " timers "
+                             << used * 1000 / n << "ns/op";
+
+  // 和hook里SO_RCVTIMEO的用法一样: IO前加一个条件定时器 IO完成后取消
+  std::shared_ptr<int> cond(new int(0));
+  begin = spadger::getCurrentUS();
+  for (int i = 0; i < n; ++i) {
+    tm.addConditionTimer(5000, &noop, cond)->cancel();
+  }
+  used = spadger::getCurrentUS() - begin;
+  SPADGER_LOG_INFO(g_logger) << "add+cancel with " << n
+                             << " outstanding " << used * 1000 / n
+                             << "ns/op";
+
+  begin = spadger::getCurrentUS();
+  for (int i = 0; i < n; ++i) {
+    timers[i]->cancel();
+  }
+  used = spadger::getCurrentUS() - begin;
+  SPADGER_LOG_INFO(g_logger) << "cancel " << n << " timers "
+                             << used * 1000 / n << "ns/op";
+  timers.clear();
+
+  // 到期处理: n个定时器在1秒内陆续到期
+  int fired = 0;
+  for (int i = 0; i < n; ++i) {
+    timers.push_back(tm.addTimer(rand() % 1000, [&fired]() { ++fired; }));
+  }
+  used = 0;
+  while (fired < n) {
+    uint64_t next = tm.getNextTimer();
+    if (next) {
+      usleep(std::min<uint64_t>(next, 10) * 1000);
+    }
+    begin = spadger::getCurrentUS();
+    std::vector<spadger::Task> cbs;
+    tm.listExpiredCb(cbs);
+    used += spadger::getCurrentUS() - begin;
+    for (auto &cb : cbs) {
+      cb();
+    }
+  }
+  SPADGER_LOG_INFO(g_logger) << "expire " << n << " timers "
+                             << used * 1000 / n << "ns/op";
+
+  // do_io超时之后还会cancel一次 这时已经到期了 不用加锁
+  begin = spadger::getCurrentUS();
+  for (int i = 0; i < n; ++i) {
+    SPADGER_ASSERT(!timers[i]->cancel());
+  }
+  used = spadger::getCurrentUS() - begin;
+  SPADGER_LOG_INFO(g_logger) << "cancel " << n << " expired timers "
+                             << used * 1000 / n << "ns/op";
+}
+
+int main(int argc, char **argv) {
+  test_expire();
+  test_us();
+  test_slack();
+  bench(argc > 1 ? atoi(argv[1]) : 1000000);
+  return 0;
+}